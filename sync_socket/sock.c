@@ -25,7 +25,9 @@
  * TODO:
  * -- Read cache objects by 64KB and use GSO?
  */
+#include <linux/interrupt.h>
 #include <linux/module.h>
+#include <linux/slab.h>
 #include <net/tcp.h>
 #include <net/inet_common.h>
 #include <net/ip6_route.h>
@@ -42,6 +44,24 @@ static SsHooks *ss_hooks __read_mostly;
 
 #define SS_CALL(f, ...)		(ss_hooks->f ? ss_hooks->f(__VA_ARGS__) : 0)
 
+/*
+ * Throttled socket which receives data again when the socket, which
+ * the data is forwarded to, has room to send. See ss_throttle().
+ */
+typedef struct ss_resume_t {
+	struct list_head	list;
+	struct sock		*sk;
+} SsResume;
+
+/*
+ * Throttled sockets are resumed by per-CPU tasklet, so the socket which
+ * got room doesn't lock the throttled one.
+ */
+static DEFINE_PER_CPU(struct list_head, ss_resume_list);
+static DEFINE_PER_CPU(struct tasklet_struct, ss_resume_tasklet);
+
+static void ss_tcp_process_data(struct sock *sk);
+
 /**
  * Copied from net/netfilter/xt_TEE.c.
  */
@@ -113,9 +133,9 @@ ss_skb_route(struct sk_buff *skb, struct tcp_sock *tp)
  * ------------------------------------------------------------------------
  */
 /**
- * Directly insert all skbs from @skb_list into @sk TCP write queue regardless
- * write buffer size. This allows directly forward modified packets without
- * copying.
+ * Directly insert @skb and all following skbs from @skb_list into @sk TCP
+ * write queue regardless write buffer size. This allows directly forward
+ * modified packets without copying.
  * See do_tcp_sendpages() and tcp_sendmsg() in linux/net/ipv4/tcp.c.
  *
  * Called in softirq context.
@@ -123,9 +143,8 @@ ss_skb_route(struct sk_buff *skb, struct tcp_sock *tp)
  * TODO use MSG_MORE untill we reach end of message.
  */
 void
-ss_send(struct sock *sk, const SsSkbList *skb_list)
+ss_send_from(struct sock *sk, const SsSkbList *skb_list, struct sk_buff *skb)
 {
-	struct sk_buff *skb;
 	struct tcp_skb_cb *tcb;
 	struct tcp_sock *tp = tcp_sk(sk);
 	int flags = MSG_DONTWAIT; /* we can't sleep */
@@ -135,9 +154,8 @@ ss_send(struct sock *sk, const SsSkbList *skb_list)
 
 	mss_now = tcp_send_mss(sk, &size_goal, flags);
 
-	BUG_ON(ss_skb_queue_empty(skb_list));
-	for (skb = ss_skb_peek(skb_list), tcb = TCP_SKB_CB(skb);
-	     skb; skb = ss_skb_next(skb_list, skb))
+	BUG_ON(!skb);
+	for (tcb = TCP_SKB_CB(skb); skb; skb = ss_skb_next(skb_list, skb))
 	{
 		skb->ip_summed = CHECKSUM_PARTIAL;
 		skb_shinfo(skb)->gso_segs = 0;
@@ -176,8 +194,117 @@ ss_send(struct sock *sk, const SsSkbList *skb_list)
 
 	bh_unlock_sock(sk);
 }
+EXPORT_SYMBOL(ss_send_from);
+
+/**
+ * Send all skbs from @skb_list, see ss_send_from().
+ */
+void
+ss_send(struct sock *sk, const SsSkbList *skb_list)
+{
+	BUG_ON(ss_skb_queue_empty(skb_list));
+	ss_send_from(sk, skb_list, ss_skb_peek(skb_list));
+}
 EXPORT_SYMBOL(ss_send);
 
+/**
+ * Stop receiving data on socket @sk while socket @dst, to which the data is
+ * forwarded, has no room in its send buffer. The received data is left in
+ * the receive queue of @sk, so the receive window of @sk isn't reopened
+ * until @dst sends the queued data. Only one socket can be throttled by
+ * @dst at a time.
+ *
+ * Called in softirq context under the @sk lock.
+ */
+void
+ss_throttle(struct sock *sk, struct sock *dst)
+{
+	SsProto *proto = sk->sk_user_data, *dproto;
+	SsResume *r;
+
+	if (sk_stream_memory_free(dst) || (proto->flags & SS_F_THROTTLED))
+		return;
+
+	r = kmalloc(sizeof(*r), GFP_ATOMIC);
+	if (!r)
+		return;
+
+	bh_lock_sock_nested(dst);
+
+	dproto = dst->sk_user_data;
+	if (!dproto || dproto->throttle || !dst->sk_socket
+	    || sk_stream_memory_free(dst))
+	{
+		bh_unlock_sock(dst);
+		kfree(r);
+		return;
+	}
+
+	SS_DBG("throttle socket %p until socket %p has room to send\n",
+	       sk, dst);
+
+	sock_hold(sk);
+	r->sk = sk;
+	dproto->throttle = r;
+	proto->flags |= SS_F_THROTTLED;
+	/* TCP calls sk_write_space() when the queued data is sent. */
+	set_bit(SOCK_NOSPACE, &dst->sk_socket->flags);
+
+	bh_unlock_sock(dst);
+}
+EXPORT_SYMBOL(ss_throttle);
+
+/**
+ * Resume the socket throttled by the socket with protocol @proto.
+ */
+static void
+ss_unthrottle(SsProto *proto)
+{
+	SsResume *r;
+
+	if (!proto || !proto->throttle)
+		return;
+
+	r = proto->throttle;
+	proto->throttle = NULL;
+
+	local_bh_disable();
+	list_add_tail(&r->list, this_cpu_ptr(&ss_resume_list));
+	tasklet_schedule(this_cpu_ptr(&ss_resume_tasklet));
+	local_bh_enable();
+}
+
+/**
+ * Process the data received on the resumed sockets while they were
+ * throttled.
+ */
+static void
+ss_resume(unsigned long data)
+{
+	LIST_HEAD(list);
+	SsResume *r, *tmp;
+
+	list_splice_init(this_cpu_ptr(&ss_resume_list), &list);
+
+	list_for_each_entry_safe(r, tmp, &list, list) {
+		struct sock *sk = r->sk;
+		SsProto *proto;
+
+		bh_lock_sock_nested(sk);
+		/* The socket can be closed while it's throttled. */
+		proto = sk->sk_user_data;
+		if (proto) {
+			proto->flags &= ~SS_F_THROTTLED;
+			if (!skb_queue_empty(&sk->sk_receive_queue))
+				ss_tcp_process_data(sk);
+		}
+		bh_unlock_sock(sk);
+
+		sock_put(sk);
+		kfree(r);
+	}
+}
+
 static int
 ss_tcp_process_proto_skb(struct sock *sk, unsigned char *data, size_t len,
 			 struct sk_buff *skb)
@@ -292,6 +419,9 @@ ss_do_close(struct sock *sk)
 	/* Don't try to close unassigned socket. */
 	BUG_ON(!sk->sk_user_data);
 
+	/* The throttled socket won't get room on this one. */
+	ss_unthrottle(sk->sk_user_data);
+
 	SS_CALL(connection_drop, sk);
 
 	sock_rps_reset_flow(sk);
@@ -458,6 +588,15 @@ ss_tcp_process_data(struct sock *sk)
 	struct tcp_sock *tp = tcp_sk(sk);
 
 	skb_queue_walk_safe(&sk->sk_receive_queue, skb, tmp) {
+		SsProto *proto = sk->sk_user_data;
+
+		/*
+		 * Leave the data in the receive queue, so the receive window
+		 * isn't reopened until the socket is resumed.
+		 */
+		if (proto && (proto->flags & SS_F_THROTTLED))
+			break;
+
 		if (unlikely(before(tp->copied_seq, TCP_SKB_CB(skb)->seq))) {
 			SS_WARN("recvmsg bug: TCP sequence gap at seq %X"
 				" recvnxt %X\n",
@@ -626,10 +765,30 @@ ss_tcp_error(struct sock *sk)
 {
 	SS_DBG("process error on socket %p\n", sk);
 
+	ss_unthrottle(sk->sk_user_data);
+
 	if (sk->sk_destruct)
 		sk->sk_destruct(sk);
 }
 
+/**
+ * Called by TCP when the queued data is sent and the socket has more room
+ * to send. Resume the socket throttled by @sk if the room is enough.
+ */
+static void
+ss_tcp_write_space(struct sock *sk)
+{
+	SsProto *proto = sk->sk_user_data;
+
+	if (!proto || !proto->throttle || !sk_stream_memory_free(sk))
+		return;
+
+	SS_DBG("resume socket throttled by socket %p\n", sk);
+
+	clear_bit(SOCK_NOSPACE, &sk->sk_socket->flags);
+	ss_unthrottle(proto);
+}
+
 /**
  * We're working with the sockets in softirq, so set allocations atomic.
  */
@@ -652,6 +811,7 @@ ss_set_callbacks(struct sock *sk)
 	sk->sk_data_ready = ss_tcp_data_ready;
 	sk->sk_state_change = ss_tcp_state_change;
 	sk->sk_error_report = ss_tcp_error;
+	sk->sk_write_space = ss_tcp_write_space;
 
 	write_unlock_bh(&sk->sk_callback_lock);
 }
@@ -756,12 +916,23 @@ EXPORT_SYMBOL(ss_hooks_unregister);
 int __init
 ss_init(void)
 {
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		INIT_LIST_HEAD(&per_cpu(ss_resume_list, cpu));
+		tasklet_init(&per_cpu(ss_resume_tasklet, cpu), ss_resume, 0);
+	}
+
 	return 0;
 }
 
 void __exit
 ss_exit(void)
 {
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		tasklet_kill(&per_cpu(ss_resume_tasklet, cpu));
 }
 
 module_init(ss_init);
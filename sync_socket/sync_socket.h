@@ -151,10 +151,21 @@ enum {
 	SS_OK		= 0,
 };
 
-/* Protocol descriptor. */
+/* The socket doesn't receive data, see ss_throttle(). */
+#define SS_F_THROTTLED		0x0001
+
+/*
+ * Protocol descriptor.
+ *
+ * @flags	- SS_F_* flags of the socket;
+ * @throttle	- the socket which doesn't receive data until this socket
+ *		  has room to send, see ss_throttle();
+ */
 typedef struct ss_proto_t {
 	struct socket	*listener;
 	int		type;
+	unsigned int	flags;
+	struct ss_resume_t *throttle;
 } SsProto;
 
 /* Table of socket connection callbacks. */
@@ -190,7 +201,10 @@ void ss_hooks_unregister(SsHooks* hooks);
 
 void ss_set_callbacks(struct sock *sk);
 void ss_tcp_set_listen(struct socket *sk, SsProto *handler);
+void ss_send_from(struct sock *sk, const SsSkbList *skb_list,
+		  struct sk_buff *skb);
 void ss_send(struct sock *sk, const SsSkbList *skb_list);
+void ss_throttle(struct sock *sk, struct sock *dst);
 void ss_close(struct sock *sk);
 
 #endif /* __SS_SOCK_H__ */
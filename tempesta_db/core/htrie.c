@@ -29,8 +29,6 @@
 #include "htrie.h"
 
 #define TDB_MAGIC	0x434947414D424454UL /* "TDBMAGIC" */
-#define TDB_BLK_SZ	PAGE_SIZE
-#define TDB_BLK_MASK	(~(TDB_BLK_SZ - 1))
 
 /**
  * Tempesta DB extent descriptor.
@@ -227,6 +225,9 @@ retry:
 	BUG_ON(!rptr);
 
 allocated:
+	/* The extent blocks bitmap has been updated. */
+	tdb_htrie_mark_dirty(dbh, TDB_HTRIE_OFF(dbh, e));
+
 	next_blk = rptr + TDB_BLK_SZ;
 	for ( ; g_nwb <= rptr; g_nwb = atomic64_read(&dbh->nwb))
 		atomic64_cmpxchg(&dbh->nwb, g_nwb, next_blk);
@@ -281,6 +282,12 @@ tdb_alloc_data(TdbHdr *dbh, size_t *len, int bucket_hdr)
 
 	local_bh_disable();
 
+	/* Check under the section the table freezing waits for. */
+	if (unlikely(dbh->flags & TDB_HDR_F_FROZEN)) {
+		rptr = 0;
+		goto out;
+	}
+
 	rptr = this_cpu_ptr(dbh->pcpu)->d_wcl;
 
 	if (!(rptr & ~TDB_BLK_MASK)
@@ -312,6 +319,7 @@ tdb_alloc_data(TdbHdr *dbh, size_t *len, int bucket_hdr)
 
 	if (bucket_hdr) {
 		tdb_htrie_init_bucket(TDB_PTR(dbh, rptr));
+		tdb_htrie_mark_dirty(dbh, rptr);
 		rptr += sizeof(TdbBucket);
 	}
 
@@ -331,6 +339,9 @@ tdb_alloc_index(TdbHdr *dbh)
 
 	local_bh_disable();
 
+	if (unlikely(dbh->flags & TDB_HDR_F_FROZEN))
+		goto out;
+
 	rptr = this_cpu_ptr(dbh->pcpu)->i_wcl;
 
 	if (unlikely(!(rptr & ~TDB_BLK_MASK)
@@ -463,6 +474,7 @@ do {									\
 			b = TDB_PTR(dbh, nb[k].b);			\
 			tdb_htrie_init_bucket(b);			\
 			memcpy(TDB_HTRIE_BCKT_1ST_REC(b), r, n);	\
+			tdb_htrie_mark_dirty(dbh, nb[k].b);		\
 			nb[k].off = sizeof(*b) + n;			\
 			new_in->shifts[k] = TDB_O2DI(nb[k].b) | TDB_HTRIE_DBIT;\
 			/* We copied a record, clear its orignal place. */\
@@ -473,6 +485,7 @@ do {									\
 		} else {						\
 			b = TDB_PTR(dbh, nb[k].b + nb[k].off);		\
 			memmove(b, r, n);				\
+			tdb_htrie_mark_dirty(dbh, nb[k].b);		\
 			nb[k].off += n;					\
 			TDB_DBG("burst: moved rec=%p (len=%lu key=%#lx)"\
 				" to dblk=%#lx w/ idx=%#lx\n",		\
@@ -495,7 +508,10 @@ do {									\
 	k = TDB_HTRIE_IDX(key, bits - TDB_HTRIE_BITS);
 	TDB_DBG("link iblk=%p w/ iblk=%p (%#x) by idx=%#lx\n",
 		*node, new_in, new_in_idx, k);
+	/* The new index node is filled, it must be copied before the link. */
+	tdb_htrie_mark_dirty(dbh, TDB_HTRIE_OFF(dbh, new_in));
 	(*node)->shifts[k] = new_in_idx;
+	tdb_htrie_mark_dirty(dbh, TDB_HTRIE_OFF(dbh, *node));
 	*node = new_in;
 
 	/* Now we can safely remove all copied records. */
@@ -504,6 +520,7 @@ do {									\
 			nb[free_nb].b, nb[free_nb].off);
 		memset(TDB_PTR(dbh, nb[free_nb].b + nb[free_nb].off),
 		       0, TDB_HTRIE_MINDREC - nb[free_nb].off);
+		tdb_htrie_mark_dirty(dbh, nb[free_nb].b);
 	}
 
 	return 0;
@@ -581,6 +598,7 @@ tdb_htrie_create_rec(TdbHdr *dbh, unsigned long off, unsigned long key,
 		ptr += sizeof(TdbFRec);
 	}
 	memcpy(ptr, data, len);
+	tdb_htrie_mark_range(dbh, off, ptr + len - (char *)r);
 
 	return r;
 }
@@ -590,26 +608,32 @@ tdb_htrie_create_rec(TdbHdr *dbh, unsigned long off, unsigned long key,
  *
  * The function is called to extend just added new record, so it's not expected
  * that it can be called concurrently for the same record.
+ *
+ * The chunk is allocated and linked in one softirq disabled section, so
+ * a snapshot never captures a link to a chunk with unwritten header.
  */
 TdbVRec *
 tdb_htrie_extend_rec(TdbHdr *dbh, TdbVRec *rec, size_t size)
 {
 	unsigned long o;
-	TdbVRec *chunk;
+	TdbVRec *chunk = NULL;
 
 	/* Cannot extend fixed-size records. */
 	BUG_ON(!TDB_HTRIE_VARLENRECS(dbh));
 
 	TDB_DBG("Extend record: rec_ptr=%p to_copy=%lu\n", rec, size);
 
+	local_bh_disable();
+
 	o = tdb_alloc_data(dbh, &size, 0);
 	if (!o)
-		return NULL;
+		goto out;
 
 	chunk = TDB_PTR(dbh, o);
 	chunk->key = rec->key;
 	chunk->chunk_next = 0;
 	chunk->len = size;
+	tdb_htrie_mark_dirty(dbh, o);
 
 	/* A caller is appreciated to pass the last record chunk by @rec. */
 retry:
@@ -619,7 +643,10 @@ retry:
 
 	if (atomic_cmpxchg((atomic_t *)&rec->chunk_next, 0, o))
 		goto retry;
+	tdb_htrie_mark_dirty(dbh, TDB_HTRIE_OFF(dbh, rec));
 
+out:
+	local_bh_enable();
 	return chunk;
 }
 
@@ -631,8 +658,8 @@ retry:
  * and do CAS on it with comparing the location with zero.
  * If competing context helps the current trx owner, then we get true lock-free.
  */
-TdbRec *
-tdb_htrie_insert(TdbHdr *dbh, unsigned long key, void *data, size_t *len)
+static TdbRec *
+__tdb_htrie_insert(TdbHdr *dbh, unsigned long key, void *data, size_t *len)
 {
 	int bits = 0;
 	unsigned long o;
@@ -640,10 +667,6 @@ tdb_htrie_insert(TdbHdr *dbh, unsigned long key, void *data, size_t *len)
 	TdbRec *rec = NULL;
 	TdbHtrieNode *node = TDB_HTRIE_ROOT(dbh);
 
-	/* Don't store empty data. */
-	if (unlikely(!*len))
-		return NULL;
-
 retry:
 	o = tdb_htrie_descend(dbh, &node, key, &bits);
 	if (!o) {
@@ -661,7 +684,10 @@ retry:
 		i = TDB_HTRIE_IDX(key, bits);
 		if (atomic_cmpxchg((atomic_t *)&node->shifts[i], 0,
 				   TDB_O2DI(o) | TDB_HTRIE_DBIT) == 0)
+		{
+			tdb_htrie_mark_dirty(dbh, TDB_HTRIE_OFF(dbh, node));
 			return rec;
+		}
 		/* Somebody already created the new brach. */
 		// TODO free just allocated data block
 		goto retry;
@@ -741,6 +767,7 @@ retry:
 
 		rec = tdb_htrie_create_rec(dbh, o, key, data, *len);
 		bckt->coll_next = TDB_O2DI(o);
+		tdb_htrie_mark_dirty(dbh, TDB_HTRIE_OFF(dbh, bckt));
 
 		write_unlock_bh(&bckt->lock);
 
@@ -770,6 +797,47 @@ retry:
 	goto retry;
 }
 
+/**
+ * The whole insertion is done in one softirq disabled section, so freezing
+ * of the table for a snapshot waits until all the written blocks are marked
+ * as dirty, see snapshot.c.
+ */
+TdbRec *
+tdb_htrie_insert(TdbHdr *dbh, unsigned long key, void *data, size_t *len)
+{
+	TdbRec *rec = NULL;
+
+	/* Don't store empty data. */
+	if (unlikely(!*len))
+		return NULL;
+
+	local_bh_disable();
+
+	/* A snapshot is being finished, don't touch the table. */
+	if (likely(!(dbh->flags & TDB_HDR_F_FROZEN)))
+		rec = __tdb_htrie_insert(dbh, key, data, len);
+
+	local_bh_enable();
+
+	return rec;
+}
+
+/**
+ * Mark variable-length record @rec as removed.
+ * The record memory can be reused by following insertions only under bucket
+ * write lock, so readers holding the bucket lock can still access the record.
+ */
+void
+tdb_htrie_remove_rec(TdbHdr *dbh, TdbVRec *rec)
+{
+	BUG_ON(!TDB_HTRIE_VARLENRECS(dbh));
+
+	local_bh_disable();
+	tdb_free_vsrec(rec);
+	tdb_htrie_mark_dirty(dbh, TDB_HTRIE_OFF(dbh, rec));
+	local_bh_enable();
+}
+
 TdbBucket *
 tdb_htrie_lookup(TdbHdr *dbh, unsigned long key)
 {
@@ -784,6 +852,32 @@ tdb_htrie_lookup(TdbHdr *dbh, unsigned long key)
 	return TDB_PTR(dbh, o);
 }
 
+/**
+ * Reinitialize locks of all the buckets reachable from index node @node.
+ * Locks could be captured in acquired state if the table was saved by
+ * a snapshot, see snapshot.c.
+ */
+static void
+tdb_htrie_reinit_locks(TdbHdr *dbh, TdbHtrieNode *node)
+{
+	int i;
+	unsigned int o;
+	TdbBucket *b;
+
+	for (i = 0; i < TDB_HTRIE_FANOUT; ++i) {
+		o = node->shifts[i];
+		if (!o)
+			continue;
+		if (o & TDB_HTRIE_DBIT) {
+			b = TDB_PTR(dbh, TDB_DI2O(o & ~TDB_HTRIE_DBIT));
+			for ( ; b; b = TDB_HTRIE_BUCKET_NEXT(dbh, b))
+				rwlock_init(&b->lock);
+		} else {
+			tdb_htrie_reinit_locks(dbh, TDB_PTR(dbh, TDB_II2O(o)));
+		}
+	}
+}
+
 TdbHdr *
 tdb_htrie_init(void *p, size_t db_size, unsigned int rec_len)
 {
@@ -796,6 +890,11 @@ tdb_htrie_init(void *p, size_t db_size, unsigned int rec_len)
 			TDB_ERR("cannot init db mapping\n");
 			return NULL;
 		}
+	} else {
+		/* Reset runtime state stored on the disk. */
+		hdr->dirty_bmp = NULL;
+		hdr->flags = 0;
+		tdb_htrie_reinit_locks(hdr, TDB_HTRIE_ROOT(hdr));
 	}
 
 	/* Set per-CPU pointers. */
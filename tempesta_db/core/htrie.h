@@ -23,6 +23,8 @@
 
 #include "tdb.h"
 
+#define TDB_BLK_SZ		PAGE_SIZE
+#define TDB_BLK_MASK		(~(TDB_BLK_SZ - 1))
 #define TDB_BLK_BMP_2L		(TDB_EXT_SZ / PAGE_SIZE / BITS_PER_LONG)
 /* Get current extent by an offset in it. */
 #define TDB_EXT_O(o)		((unsigned long)(o) & TDB_EXT_MASK)
@@ -154,9 +156,36 @@ tdb_live_vsrec(TdbVRec *rec)
 	return rec->len && !(rec->len & TDB_HTRIE_VRFREED);
 }
 
+/**
+ * Mark blocks containing @len bytes at offset @o as modified, so a running
+ * snapshot copies them once more. The bitmap lives until the table is closed,
+ * so it's safe to set a bit in it even if the snapshot has just finished.
+ *
+ * The blocks must be marked after they are written and in the same softirq
+ * disabled section, so the snapshot doesn't clear the bit before the write
+ * and doesn't freeze the table in the middle of the section, see snapshot.c.
+ */
+static inline void
+tdb_htrie_mark_range(TdbHdr *dbh, unsigned long o, size_t len)
+{
+	unsigned long b, *bmp = *(unsigned long * volatile *)&dbh->dirty_bmp;
+
+	if (!bmp || !len)
+		return;
+	for (b = o / TDB_BLK_SZ; b <= (o + len - 1) / TDB_BLK_SZ; ++b)
+		set_bit(b, bmp);
+}
+
+static inline void
+tdb_htrie_mark_dirty(TdbHdr *dbh, unsigned long o)
+{
+	tdb_htrie_mark_range(dbh, o, 1);
+}
+
 TdbVRec *tdb_htrie_extend_rec(TdbHdr *dbh, TdbVRec *rec, size_t size);
 TdbRec *tdb_htrie_insert(TdbHdr *dbh, unsigned long key, void *data,
 			 size_t *len);
+void tdb_htrie_remove_rec(TdbHdr *dbh, TdbVRec *rec);
 TdbBucket *tdb_htrie_lookup(TdbHdr *dbh, unsigned long key);
 TdbHdr *tdb_htrie_init(void *p, size_t db_size, unsigned int rec_len);
 void tdb_htrie_exit(TdbHdr *dbh);
@@ -237,6 +237,74 @@ tdb_if_select(struct sk_buff *skb, struct netlink_callback *cb)
 	return 0;
 }
 
+static int
+tdb_if_snapshot(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	TdbMsg *resp_m, *m = cb->data;
+	TdbCrTblRec *ct = (TdbCrTblRec *)(m->recs + 1);
+	struct nlmsghdr *nlh;
+	TDB *db;
+
+	nlh = nlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+			cb->nlh->nlmsg_type, sizeof(TdbMsg), 0);
+	if (!nlh)
+		return -EMSGSIZE;
+
+	resp_m = nlmsg_data(nlh);
+	resp_m->rec_n = 0;
+	resp_m->type = TDB_MSG_SNAPSHOT;
+
+	db = tdb_tbl_lookup(m->t_name, TDB_TBLNAME_LEN);
+	if (!db) {
+		TDB_WARN("Tried to snapshot non existent table '%s'\n",
+			 m->t_name);
+		return 0;
+	}
+
+	/* The snapshot is written in background, see tdb_if_snap_stat(). */
+	if (!tdb_snapshot(db, ct->path))
+		resp_m->type |= TDB_NLF_RESP_OK;
+
+	tdb_put(db);
+
+	return 0;
+}
+
+static int
+tdb_if_snap_stat(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	int r;
+	TdbMsg *resp_m, *m = cb->data;
+	struct nlmsghdr *nlh;
+	TDB *db;
+
+	nlh = nlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+			cb->nlh->nlmsg_type, sizeof(TdbMsg), 0);
+	if (!nlh)
+		return -EMSGSIZE;
+
+	resp_m = nlmsg_data(nlh);
+	resp_m->rec_n = 0;
+	resp_m->type = TDB_MSG_SNAP_STATUS;
+
+	db = tdb_tbl_lookup(m->t_name, TDB_TBLNAME_LEN);
+	if (!db) {
+		TDB_WARN("Tried to get snapshot status of non existent table"
+			 " '%s'\n", m->t_name);
+		return 0;
+	}
+
+	r = tdb_snapshot_status(db);
+	if (!r)
+		resp_m->type |= TDB_NLF_RESP_OK;
+	else if (r == -EINPROGRESS)
+		resp_m->type |= TDB_NLF_RESP_OK | TDB_NLF_RESP_BUSY;
+
+	tdb_put(db);
+
+	return 0;
+}
+
 static const struct {
 	int (*dump)(struct sk_buff *, struct netlink_callback *);
 } tdb_if_call_tbl[__TDB_MSG_TYPE_MAX] = {
@@ -245,6 +313,8 @@ static const struct {
 	[TDB_MSG_CLOSE - __TDB_MSG_BASE]	= { .dump = tdb_if_open_close },
 	[TDB_MSG_INSERT - __TDB_MSG_BASE]	= { .dump = tdb_if_insert },
 	[TDB_MSG_SELECT - __TDB_MSG_BASE]	= { .dump = tdb_if_select },
+	[TDB_MSG_SNAPSHOT - __TDB_MSG_BASE]	= { .dump = tdb_if_snapshot },
+	[TDB_MSG_SNAP_STATUS - __TDB_MSG_BASE]	= { .dump = tdb_if_snap_stat },
 };
 
 static int
@@ -330,6 +400,35 @@ tdb_if_proc_msg(struct sk_buff *skb, struct nlmsghdr *nlh)
 		if (!tdb_if_check_tblname(m))
 			return -EINVAL;
 		break;
+	case TDB_MSG_SNAPSHOT:
+		if (m->rec_n != 1) {
+			TDB_ERR("empty snapshot msg\n");
+			return -EINVAL;
+		}
+		if (!tdb_if_check_tblname(m))
+			return -EINVAL;
+		if (m->recs[0].dlen < sizeof(TdbCrTblRec)) {
+			TDB_ERR("empty record in snapshot msg\n");
+			return -EINVAL;
+		}
+		{
+			TdbCrTblRec *ct = (TdbCrTblRec *)(m->recs + 1);
+			if (ct->path_len < sizeof(TDB_SUFFIX)) {
+				TDB_ERR("malformed snapshot msg: path_len=%u\n",
+					ct->path_len);
+				return -EINVAL;
+			}
+		}
+		break;
+	case TDB_MSG_SNAP_STATUS:
+		if (m->rec_n) {
+			TDB_ERR("Bad snapshot status msg: rec_n=%u\n",
+				m->rec_n);
+			return -EINVAL;
+		}
+		if (!tdb_if_check_tblname(m))
+			return -EINVAL;
+		break;
 	default:
 		TDB_ERR("bad netlink msg type %u\n", m->type);
 		return -EINVAL;
@@ -22,9 +22,11 @@
  */
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 
 #include "file.h"
 #include "htrie.h"
+#include "snapshot.h"
 #include "table.h"
 #include "tdb_if.h"
 
@@ -39,9 +41,13 @@ TdbRec *
 tdb_entry_create(TDB *db, unsigned long key, void *data, size_t *len)
 {
 	TdbRec *r = tdb_htrie_insert(db->hdr, key, data, len);
-	if (!r)
-		TDB_ERR("Cannot create cache entry for %.*s, key=%#lx\n",
-			(int)*len, (char *)data, key);
+	if (!r) {
+		if (tdb_frozen(db))
+			tdb_snapshot_frozen_fail(db);
+		else
+			TDB_ERR("Cannot create cache entry for %.*s,"
+				" key=%#lx\n", (int)*len, (char *)data, key);
+	}
 
 	return r;
 }
@@ -56,7 +62,11 @@ EXPORT_SYMBOL(tdb_entry_create);
 TdbVRec *
 tdb_entry_add(TDB *db, TdbVRec *r, size_t size)
 {
-	return tdb_htrie_extend_rec(db->hdr, r, size);
+	TdbVRec *e = tdb_htrie_extend_rec(db->hdr, r, size);
+	if (!e && tdb_frozen(db))
+		tdb_snapshot_frozen_fail(db);
+
+	return e;
 }
 EXPORT_SYMBOL(tdb_entry_add);
 
@@ -92,6 +102,9 @@ tdb_rec_get(TDB *db, unsigned long key)
 
 	/* The bucket must be alive regardless deleted/evicted records in it. */
 	TDB_HTRIE_FOREACH_REC(db->hdr, b, r, {
+		/* Buckets can contain records with different keys. */
+		if (r->key != key)
+			continue;
 		/* Return the record w/ locked bucket. */
 		if (TDB_HTRIE_VARLENRECS(db->hdr)) {
 			if (tdb_live_vsrec((TdbVRec *)r))
@@ -114,6 +127,53 @@ tdb_rec_put(void *rec)
 }
 EXPORT_SYMBOL(tdb_rec_put);
 
+/**
+ * Remove a variable-length record @rec acquired by tdb_rec_get() or just
+ * created by tdb_entry_create(). The record isn't returned by following
+ * lookups, but the caller can still read it until tdb_rec_put().
+ */
+void
+tdb_rec_remove(TDB *db, void *rec)
+{
+	tdb_htrie_remove_rec(db->hdr, (TdbVRec *)rec);
+}
+EXPORT_SYMBOL(tdb_rec_remove);
+
+/**
+ * @return true if @rec was removed by tdb_rec_remove().
+ */
+bool
+tdb_rec_removed(TDB *db, void *rec)
+{
+	return !tdb_live_vsrec((TdbVRec *)rec);
+}
+EXPORT_SYMBOL(tdb_rec_removed);
+
+/**
+ * Data written by a caller directly to records (e.g. to rooms returned by
+ * tdb_entry_add() or to fields of a record got by tdb_rec_get()) must be
+ * written between tdb_rec_write_begin() and tdb_rec_write_end(), so a running
+ * snapshot copies the data. The section must not sleep: table freezing waits
+ * for such sections to finish, see snapshot.c.
+ */
+void
+tdb_rec_write_begin(void)
+{
+	local_bh_disable();
+}
+EXPORT_SYMBOL(tdb_rec_write_begin);
+
+/**
+ * Mark @len bytes written at @ptr as dirty and close the write section.
+ */
+void
+tdb_rec_write_end(TDB *db, void *ptr, size_t len)
+{
+	tdb_htrie_mark_range(db->hdr, TDB_OFF(db->hdr, ptr), len);
+	local_bh_enable();
+}
+EXPORT_SYMBOL(tdb_rec_write_end);
+
 int
 tdb_info(char *buf, size_t len)
 {
@@ -226,6 +286,7 @@ __do_close_table(TDB *db)
 	tdb_file_close(db);
 
 	tdb_htrie_exit(db->hdr);
+	tdb_snapshot_free(db);
 
 	TDB_LOG("Close table %s\n", db->tbl_name);
 
@@ -255,11 +316,18 @@ tdb_init(void)
 	if (r)
 		return r;
 
-	r = tdb_if_init();
+	r = tdb_snapshot_init();
 	if (r)
 		return r;
 
+	r = tdb_if_init();
+	if (r)
+		goto err_if;
+
 	return 0;
+err_if:
+	tdb_snapshot_exit();
+	return r;
 }
 
 static void __exit
@@ -268,6 +336,7 @@ tdb_exit(void)
 	TDB_LOG("Shutdown Tempesta DB\n");
 
 	tdb_if_exit();
+	tdb_snapshot_exit();
 
 	/*
 	 * There are no database users, so roughtly close all abandoned
@@ -0,0 +1,422 @@
+/**
+ *		Tempesta DB
+ *
+ * Online table snapshots.
+ *
+ * A snapshot is a regular table file which can be loaded by tdb_open(), so
+ * a warm table can be cloned to another node without stopping the database.
+ * Writers are never blocked on the snapshot: extents are copied to the file
+ * while the table is being updated and all the blocks modified during the
+ * copying are tracked in dirty blocks bitmap and copied once again. When
+ * number of dirty blocks is small enough, the allocation cursors are frozen,
+ * the rest of dirty blocks and the table header are written.
+ *
+ * Writers modify the table in softirq disabled sections and mark written blocks
+ * as dirty at the end of the sections, after the writes, so the copying never
+ * clears a dirty bit of a block before the block is written. Thus
+ * synchronize_sched() waits for all the writes which aren't tracked yet.
+ *
+ * Writers check the frozen flag inside the sections and see frozen table as
+ * full table, so records insertions fail during the final pass. The failed
+ * insertions are counted and reported when the snapshot is written, users
+ * can also check tdb_frozen() to tell such failures from the table overflow.
+ * Records which were allocated, but aren't fully written by the freezing
+ * time can be captured partially, just like on table closing.
+ *
+ * The copying can take long time for large tables, so snapshots are written
+ * by a work queue. tdb_snapshot() only starts the snapshot and its result can
+ * be got by tdb_snapshot_status() later.
+ *
+ * Copyright (C) 2015 Tempesta Technologies.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include "htrie.h"
+#include "snapshot.h"
+
+/* Maximum number of dirty blocks copying passes before freezing the table. */
+#define TDB_SNAP_PASSES		8
+/* Freeze the table if there are less dirty blocks. */
+#define TDB_SNAP_DIRTY_MIN	64
+
+/**
+ * State of the last snapshot of a table.
+ *
+ * @work	- the snapshot writing work;
+ * @db		- the table, referenced while the snapshot is being written;
+ * @status	- the snapshot result or -EINPROGRESS while it's being written;
+ * @frozen_fails - number of insertions failed while the table was frozen;
+ * @path	- the snapshot file;
+ */
+typedef struct tdb_snap_t {
+	struct work_struct	work;
+	TDB			*db;
+	int			status;
+	atomic_long_t		frozen_fails;
+	char			path[TDB_PATH_LEN];
+} TdbSnap;
+
+/* Snapshots are written one by one. */
+static struct workqueue_struct *snap_wq;
+/* Protects snapshots state. */
+static DEFINE_MUTEX(snap_mtx);
+
+static int
+tdb_snap_write(struct file *filp, void *addr, size_t len, loff_t off)
+{
+	ssize_t r;
+	mm_segment_t oldfs = get_fs();
+
+	set_fs(get_ds());
+	r = vfs_write(filp, (char *)addr, len, &off);
+	set_fs(oldfs);
+
+	if (r != len) {
+		TDB_ERR("Cannot write %lu bytes to snapshot at offset %lld,"
+			" ret=%ld\n", len, off, r);
+		return r < 0 ? r : -EIO;
+	}
+
+	return 0;
+}
+
+/**
+ * Copy all used extents. The header is written at the last step.
+ */
+static int
+tdb_snap_copy_extents(TDB *db, struct file *filp)
+{
+	int r;
+	unsigned long e, off, n = db->hdr->dbsz / TDB_EXT_SZ;
+
+	for (e = 0; e < n; ++e) {
+		if (!test_bit(e, db->hdr->ext_bmp))
+			continue;
+		off = e * TDB_EXT_SZ;
+		r = tdb_snap_write(filp, TDB_PTR(db->hdr, off), TDB_EXT_SZ,
+				   off);
+		if (r)
+			return r;
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/**
+ * Copy blocks modified since the previous pass.
+ * @return number of copied blocks or negative value on error.
+ */
+static long
+tdb_snap_copy_dirty(TDB *db, struct file *filp)
+{
+	int r;
+	long copied = 0;
+	unsigned long b, off, n = db->hdr->dbsz / TDB_BLK_SZ;
+
+	for (b = find_first_bit(db->snap_bmp, n); b < n;
+	     b = find_next_bit(db->snap_bmp, n, b + 1))
+	{
+		if (!test_and_clear_bit(b, db->snap_bmp))
+			continue;
+		off = b * TDB_BLK_SZ;
+		r = tdb_snap_write(filp, TDB_PTR(db->hdr, off), TDB_BLK_SZ,
+				   off);
+		if (r)
+			return r;
+		if (!(++copied % 256))
+			cond_resched();
+	}
+
+	return copied;
+}
+
+/**
+ * Write the first table blocks containing the header.
+ * Runtime data in the header isn't valid after loading the snapshot.
+ */
+static int
+tdb_snap_write_hdr(TDB *db, struct file *filp)
+{
+	int r;
+	TdbHdr *hdr;
+	size_t len = TDB_BLK_ALIGN(TDB_HDR_SZ(db->hdr));
+
+	hdr = kmalloc(len, GFP_KERNEL);
+	if (!hdr)
+		return -ENOMEM;
+
+	memcpy(hdr, db->hdr, len);
+	hdr->pcpu = NULL;
+	hdr->dirty_bmp = NULL;
+	hdr->flags = 0;
+
+	r = tdb_snap_write(filp, hdr, len, 0);
+
+	kfree(hdr);
+
+	return r;
+}
+
+static void
+tdb_snap_unfreeze(TDB *db)
+{
+	db->hdr->flags &= ~TDB_HDR_F_FROZEN;
+	db->hdr->dirty_bmp = NULL;
+	smp_mb();
+}
+
+/**
+ * Write consistent copy of table @db to file @path.
+ * The resulting file can be loaded by tdb_open() with the same table size.
+ */
+static int
+tdb_snap_do(TDB *db, const char *path)
+{
+	int i, r;
+	long n;
+	size_t bmp_sz;
+	struct file *filp;
+
+	bmp_sz = BITS_TO_LONGS(db->hdr->dbsz / TDB_BLK_SZ) * sizeof(long);
+	if (!db->snap_bmp) {
+		db->snap_bmp = vzalloc(bmp_sz);
+		if (!db->snap_bmp) {
+			TDB_ERR("Cannot allocate snapshot bitmap for %s\n",
+				db->tbl_name);
+			return -ENOMEM;
+		}
+	} else {
+		memset(db->snap_bmp, 0, bmp_sz);
+	}
+
+	filp = filp_open(path, O_CREAT | O_TRUNC | O_WRONLY | O_LARGEFILE,
+			 0600);
+	if (IS_ERR(filp)) {
+		TDB_ERR("Cannot open snapshot file %s\n", path);
+		return PTR_ERR(filp);
+	}
+	/* The file size must match the table size, see tempesta_map_file(). */
+	r = vfs_truncate(&filp->f_path, db->hdr->dbsz);
+	if (r) {
+		TDB_ERR("Cannot set snapshot file %s size\n", path);
+		goto err_file;
+	}
+
+	/*
+	 * Start dirty blocks tracking before the first copying pass and wait
+	 * for writers which might not see the bitmap.
+	 */
+	db->hdr->dirty_bmp = db->snap_bmp;
+	smp_mb();
+	synchronize_sched();
+
+	r = tdb_snap_copy_extents(db, filp);
+	if (r)
+		goto err_copy;
+
+	for (i = 0; i < TDB_SNAP_PASSES; ++i) {
+		n = tdb_snap_copy_dirty(db, filp);
+		if (n < 0) {
+			r = n;
+			goto err_copy;
+		}
+		TDB_DBG("snapshot %s: pass %d copied %ld dirty blocks\n",
+			db->tbl_name, i, n);
+		if (n < TDB_SNAP_DIRTY_MIN)
+			break;
+	}
+
+	/*
+	 * Freeze the allocation cursors and wait for write sections which
+	 * could miss the flag, so all their blocks are marked as dirty.
+	 */
+	db->hdr->flags |= TDB_HDR_F_FROZEN;
+	smp_mb();
+	synchronize_sched();
+
+	n = tdb_snap_copy_dirty(db, filp);
+	if (n < 0) {
+		r = n;
+		goto err_copy;
+	}
+	r = tdb_snap_write_hdr(db, filp);
+	if (r)
+		goto err_copy;
+
+	tdb_snap_unfreeze(db);
+
+	r = vfs_fsync(filp, 0);
+	if (r)
+		TDB_WARN("Cannot sync snapshot file %s\n", path);
+
+	filp_close(filp, NULL);
+
+	return 0;
+err_copy:
+	tdb_snap_unfreeze(db);
+err_file:
+	filp_close(filp, NULL);
+	return r;
+}
+
+static void
+tdb_snap_work(struct work_struct *work)
+{
+	TdbSnap *s = container_of(work, TdbSnap, work);
+	TDB *db = s->db;
+	int r;
+
+	r = tdb_snap_do(db, s->path);
+	if (r)
+		TDB_ERR("Cannot create snapshot of table %s\n", db->tbl_name);
+	else
+		TDB_LOG("Written snapshot of table %s to %s, %ld insertions"
+			" failed while the table was frozen\n", db->tbl_name,
+			s->path, atomic_long_read(&s->frozen_fails));
+
+	mutex_lock(&snap_mtx);
+	s->status = r;
+	s->db = NULL;
+	mutex_unlock(&snap_mtx);
+
+	/* The table can be closed by the last reference, so @s is freed. */
+	tdb_close(db);
+}
+
+/**
+ * Start writing consistent copy of table @db to file @path.
+ * Only one snapshot of a table can be written at a time, the result of the
+ * snapshot is returned by tdb_snapshot_status().
+ *
+ * The function must not be called from softirq!
+ */
+int
+tdb_snapshot(TDB *db, const char *path)
+{
+	int r = 0;
+	TdbSnap *s;
+
+	if (!db->hdr)
+		return -EINVAL;
+	if (strlen(path) >= TDB_PATH_LEN) {
+		TDB_ERR("Too long snapshot path %s\n", path);
+		return -ENAMETOOLONG;
+	}
+	if (!strcmp(path, db->path)) {
+		TDB_ERR("Cannot write snapshot of %s to the table file\n",
+			db->tbl_name);
+		return -EINVAL;
+	}
+
+	mutex_lock(&snap_mtx);
+
+	if (!db->snap) {
+		db->snap = kzalloc(sizeof(TdbSnap), GFP_KERNEL);
+		if (!db->snap) {
+			TDB_ERR("Cannot allocate snapshot for %s\n",
+				db->tbl_name);
+			r = -ENOMEM;
+			goto out;
+		}
+		INIT_WORK(&db->snap->work, tdb_snap_work);
+	}
+	s = db->snap;
+	if (s->db) {
+		TDB_WARN("Snapshot of table %s is already running\n",
+			 db->tbl_name);
+		r = -EBUSY;
+		goto out;
+	}
+
+	s->db = tdb_get(db);
+	s->status = -EINPROGRESS;
+	atomic_long_set(&s->frozen_fails, 0);
+	strcpy(s->path, path);
+	queue_work(snap_wq, &s->work);
+
+	TDB_LOG("Start snapshot of table %s to %s\n", db->tbl_name, path);
+out:
+	mutex_unlock(&snap_mtx);
+	return r;
+}
+EXPORT_SYMBOL(tdb_snapshot);
+
+/**
+ * @return 0 if the last snapshot of @db is written, -EINPROGRESS if it's
+ * being written, -ENOENT if there were no snapshots or the snapshot error.
+ */
+int
+tdb_snapshot_status(TDB *db)
+{
+	int r;
+
+	mutex_lock(&snap_mtx);
+	r = db->snap ? db->snap->status : -ENOENT;
+	mutex_unlock(&snap_mtx);
+
+	return r;
+}
+EXPORT_SYMBOL(tdb_snapshot_status);
+
+/**
+ * Account an insertion into @db failed due to the table freezing.
+ */
+void
+tdb_snapshot_frozen_fail(TDB *db)
+{
+	TdbSnap *s = ACCESS_ONCE(db->snap);
+
+	if (s)
+		atomic_long_inc(&s->frozen_fails);
+}
+
+/**
+ * Free snapshot data of closed table @db.
+ */
+void
+tdb_snapshot_free(TDB *db)
+{
+	vfree(db->snap_bmp);
+	kfree(db->snap);
+}
+
+int __init
+tdb_snapshot_init(void)
+{
+	snap_wq = alloc_ordered_workqueue("tdb_snap", 0);
+	if (!snap_wq) {
+		TDB_ERR("Cannot create snapshot work queue\n");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/**
+ * Wait for running snapshots, the tables are closed after that.
+ */
+void
+tdb_snapshot_exit(void)
+{
+	destroy_workqueue(snap_wq);
+}
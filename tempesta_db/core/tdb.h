@@ -53,6 +53,10 @@ typedef struct {
  * @nwb		- next to write block (byte offset);
  * @pcpu	- pointer to per-cpu dynamic data for the TDB handler;
  * @rec_len	- fixed-size records length or zero for variable-length records;
+ * @dirty_bmp	- bitmap of blocks modified while a snapshot is running or NULL
+ *		  if there is no running snapshot (runtime only, see
+ *		  snapshot.c);
+ * @flags	- runtime table state flags (TDB_HDR_F_*);
  ** @ext_bmp	- bitmap of used/free extents.
  * 		  Must be small and cache line aligned;
  */
@@ -62,16 +66,25 @@ typedef struct {
 	atomic64_t		nwb;
 	TdbPerCpu __percpu	*pcpu;
 	unsigned int		rec_len;
-	unsigned char		_padding[8 * 3 + 4];
+	unsigned long		*dirty_bmp;
+	unsigned long		flags;
+	unsigned char		_padding[8 + 4];
 	unsigned long		ext_bmp[0];
 } __attribute__((packed)) TdbHdr;
 
+/* No new blocks can be allocated, a snapshot is being finished. */
+#define TDB_HDR_F_FROZEN	0x0001
+
 /**
  * Database handle descriptor.
  *
  * @filp	- mmap()'ed file;
  * @node	- NUMA node ID;
  * @count	- reference counter;
+ * @snap_bmp	- dirty blocks bitmap for snapshots, allocated by the first
+ *		  snapshot and freed on table closing;
+ * @snap	- state of the last snapshot, allocated by the first snapshot
+ *		  and freed on table closing, see snapshot.c;
  * @tbl_name	- table name;
  * @path	- path to the table;
  */
@@ -80,6 +93,8 @@ typedef struct {
 	struct file	*filp;
 	int		node;
 	atomic_t	count;
+	unsigned long	*snap_bmp;
+	struct tdb_snap_t *snap;
 	char		tbl_name[TDB_TBLNAME_LEN + 1];
 	char		path[TDB_PATH_LEN];
 } TDB;
@@ -123,8 +138,9 @@ typedef TdbFRec TdbRec;
  */
 #define TDB_HTRIE_MINDREC	(L1_CACHE_BYTES * 2)
 
-/* Convert internal offsets to system pointer. */
+/* Convert internal offsets to system pointer and vise versa. */
 #define TDB_PTR(h, o)		(void *)((char *)(h) + (o))
+#define TDB_OFF(h, p)		((unsigned long)(p) - (unsigned long)(h))
 /* Get index and data block indexes by byte offset and vise versa. */
 #define TDB_O2DI(o)		((o) / TDB_HTRIE_MINDREC)
 #define TDB_O2II(o)		((o) / TDB_HTRIE_NODE_SZ)
@@ -149,14 +165,29 @@ TdbRec *tdb_entry_create(TDB *db, unsigned long key, void *data, size_t *len);
 TdbVRec *tdb_entry_add(TDB *db, TdbVRec *r, size_t size);
 void *tdb_rec_get(TDB *db, unsigned long key);
 void tdb_rec_put(void *rec);
+void tdb_rec_remove(TDB *db, void *rec);
+bool tdb_rec_removed(TDB *db, void *rec);
+void tdb_rec_write_begin(void);
+void tdb_rec_write_end(TDB *db, void *ptr, size_t len);
 int tdb_info(char *buf, size_t len);
 
 /* Open/close database handler. */
 TDB *tdb_open(const char *path, size_t fsize, unsigned int rec_size, int node);
 void tdb_close(TDB *db);
+int tdb_snapshot(TDB *db, const char *path);
+int tdb_snapshot_status(TDB *db);
 
 unsigned long tdb_hash_calc(const char *data, size_t len);
 
+/**
+ * @return true if a snapshot of @db is being finished, so insertions fail.
+ */
+static inline bool
+tdb_frozen(TDB *db)
+{
+	return db->hdr && (db->hdr->flags & TDB_HDR_F_FROZEN);
+}
+
 static inline TDB *
 tdb_get(TDB *db)
 {
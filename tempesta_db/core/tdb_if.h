@@ -44,6 +44,8 @@ enum tdb_msg_type {
 	TDB_MSG_CLOSE,
 	TDB_MSG_INSERT,
 	TDB_MSG_SELECT,
+	TDB_MSG_SNAPSHOT,
+	TDB_MSG_SNAP_STATUS,
 	__TDB_MSG_TYPE_MAX
 };
 
@@ -51,9 +53,11 @@ enum tdb_msg_type {
 #define TDB_NLF_RESP_OK		0x0100 /* good reposne status */
 #define TDB_NLF_RESP_TRUNC	0x0200 /* response was truncated */
 #define TDB_NLF_RESP_END	0x0400 /* end of chunked response */
+#define TDB_NLF_RESP_BUSY	0x0800 /* operation is still running */
 
 /**
- * Record for create table command.
+ * Record for create table and snapshot commands.
+ * Only @path is used for snapshots.
  */
 typedef struct {
 	size_t		tbl_size;
@@ -38,6 +38,7 @@
 bool debug = false;
 
 const size_t TdbHndl::MMSZ = 256 * 1024;
+const unsigned int TdbHndl::SNAP_POLL_US = 100 * 1000;
 
 /*
  * ------------------------------------------------------------------------
@@ -63,6 +64,10 @@ TdbHndl::LastOpStatus::update(const TdbMsg *m) noexcept
 	case TDB_MSG_SELECT:
 		op = "SELECT";
 		break;
+	case TDB_MSG_SNAPSHOT:
+	case TDB_MSG_SNAP_STATUS:
+		op = "SNAPSHOT";
+		break;
 	default:
 		op = "[unspecified]";
 	}
@@ -376,6 +381,87 @@ TdbHndl::close_table(std::string &tbl_name)
 	});
 }
 
+void
+TdbHndl::snapshot_table(std::string &db_path, std::string &tbl_name)
+{
+	if (trx_)
+		throw TdbExcept("cannot run the action inside transaction");
+
+	if (tbl_name.length() > TDB_TBLNAME_LEN)
+		throw TdbExcept("too long table name");
+
+	msg_send([&db_path, &tbl_name](nlmsghdr *nlh) {
+		TdbMsg *m = (TdbMsg *)NLMSG_DATA(nlh);
+		m->type = TDB_MSG_SNAPSHOT;
+		m->rec_n = 1;
+		tbl_name.copy(m->t_name, TDB_TBLNAME_LEN);
+		m->t_name[tbl_name.length()] = 0;
+
+		std::string p = db_path + "/" + tbl_name + TDB_SUFFIX;
+
+		TdbCrTblRec *ct = (TdbCrTblRec *)(m->recs + 1);
+		ct->tbl_size = 0;
+		ct->rec_size = 0;
+		ct->path_len = p.length() + 1;
+		p.copy(ct->path, p.length());
+		ct->path[p.length()] = 0;
+
+		m->recs[0].klen = 0;
+		m->recs[0].dlen = sizeof(*ct) + ct->path_len;
+
+		nlh->nlmsg_len = sizeof(*nlh) + sizeof(*m)
+				 + TDB_MSGREC_LEN(&m->recs[0]);
+		nlh->nlmsg_type = NLMSG_MIN_TYPE + 1;
+		nlh->nlmsg_flags |= NLM_F_REQUEST;
+	});
+
+	// Just check for status message.
+	msg_recv([=](nlmsghdr *nlh) -> bool {
+		if (nlh->nlmsg_len < sizeof(*nlh) + sizeof(TdbMsg))
+			throw TdbExcept("bad snapshot status msg");
+
+		TdbMsg *m = (TdbMsg *)NLMSG_DATA(nlh);
+		if (m->type != (TDB_MSG_SNAPSHOT | TDB_NLF_RESP_OK))
+			throw TdbExcept("cannot snapshot table, see dmesg");
+
+		last_status_.update(m);
+
+		return false;
+	});
+
+	// The snapshot is written in background, wait for it.
+	for (bool busy = true; busy; ) {
+		usleep(SNAP_POLL_US);
+
+		msg_send([&tbl_name](nlmsghdr *nlh) {
+			nlh->nlmsg_len = sizeof(*nlh) + sizeof(TdbMsg);
+			nlh->nlmsg_type = NLMSG_MIN_TYPE + 1;
+			nlh->nlmsg_flags |= NLM_F_REQUEST;
+
+			TdbMsg *m = (TdbMsg *)NLMSG_DATA(nlh);
+			memset(m, 0, sizeof(*m));
+			m->type = TDB_MSG_SNAP_STATUS;
+			tbl_name.copy(m->t_name, TDB_TBLNAME_LEN);
+			m->t_name[tbl_name.length()] = 0;
+		});
+
+		msg_recv([&](nlmsghdr *nlh) -> bool {
+			if (nlh->nlmsg_len < sizeof(*nlh) + sizeof(TdbMsg))
+				throw TdbExcept("bad snapshot status msg");
+
+			TdbMsg *m = (TdbMsg *)NLMSG_DATA(nlh);
+			if (!(m->type & TDB_NLF_RESP_OK))
+				throw TdbExcept("cannot snapshot table,"
+						" see dmesg");
+			busy = m->type & TDB_NLF_RESP_BUSY;
+
+			last_status_.update(m);
+
+			return false;
+		});
+	}
+}
+
 void
 TdbHndl::insert(std::string &tbl_name, size_t klen, size_t vlen,
 		std::function<void (char *, char *)> placement_cb)
@@ -92,6 +92,7 @@ public:
 	void open_table(std::string &db_path, std::string &tbl_name,
 			size_t pages, unsigned int rec_size);
 	void close_table(std::string &tbl_name);
+	void snapshot_table(std::string &db_path, std::string &tbl_name);
 	void insert(std::string &tbl_name, size_t klen, size_t vlen,
 		    std::function<void (char *, char *)> placement_cb);
 	void query(std::string &tbl_name, std::string &key,
@@ -110,6 +111,9 @@ private:
 	void msg_send(std::function<void (nlmsghdr *)> msg_build_cb);
 
 private:
+	// Snapshot status polling interval.
+	static const unsigned int SNAP_POLL_US;
+
 	int fd_;
 	size_t ring_sz_;
 	unsigned int rx_fr_off_, tx_fr_off_;
@@ -30,6 +30,7 @@ enum {
 	ACT_CLOSE,
 	ACT_INSERT,
 	ACT_SELECT,
+	ACT_SNAPSHOT,
 };
 
 namespace po = boost::program_options;
@@ -76,6 +77,8 @@ struct Cfg {
 			action = ACT_INSERT;
 		} else if (a == "select") {
 			action = ACT_SELECT;
+		} else if (a == "snapshot") {
+			action = ACT_SNAPSHOT;
 		} else {
 			throw TdbExcept("bad action: %s", a.c_str());
 		}
@@ -93,6 +96,8 @@ struct Cfg {
 			throw TdbExcept("please specify a table");
 		if (action == ACT_OPEN && db_path.empty())
 			throw TdbExcept("please specify database path");
+		if (action == ACT_SNAPSHOT && db_path.empty())
+			throw TdbExcept("please specify snapshot path");
 
 		if (mm_sz % 2)
 			throw TdbExcept("mmap size must be multiple of 2");
@@ -120,7 +125,8 @@ main(int argc, char *argv[])
 		 "  open    - open and create a new table if necessary;\n"
 		 "  close   - close a table;\n"
 		 "  insert  - insert a record to a table;\n"
-		 "  select  - select from a table")
+		 "  select  - select from a table;\n"
+		 "  snapshot - write online snapshot of a table to the path")
 		("key,k", po::value<std::string>(), "The record key")
 		("path,p", po::value<std::string>(), "Path to database files")
 		("rec_size,r", po::value<size_t>()->default_value(0),
@@ -193,6 +199,11 @@ main(int argc, char *argv[])
 					std::cout << "'" << std::endl;
 				 });
 			break;
+		case ACT_SNAPSHOT:
+			th.snapshot_table(cfg.db_path, cfg.table);
+			std::cout << "table " << cfg.table << " snapshot written"
+				  << std::endl;
+			break;
 		default:
 			throw TdbExcept("bad action number %d", cfg.action);
 		}
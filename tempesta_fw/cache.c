@@ -1,17 +1,45 @@
 /**
  *		Tempesta FW
  *
- * HTTP cache (see RFC 2616).
+ * HTTP cache (see RFC 7234).
  * Here is implementation of expiration and validation models and other HTTP
  * specific stuff. The cache is backed by physical storage layer.
  *
+ * Responses are stored as received from upstream servers. Cached responses
+ * are served while they're fresh according to Cache-Control and Expires
+ * response headers and request Cache-Control directives, Age header is
+ * generated for each cache hit.
+ *
+ * ETag and Last-Modified validators are stored along with the entry, so
+ * conditional client requests are answered by 304 responses built from
+ * the entry itself and stale entries are revalidated by conditional
+ * requests to upstream servers (RFC 7232).
+ *
+ * Concurrent requests missing the cache for the same key are collapsed:
+ * only the first one is forwarded to upstream server while the others wait
+ * for its response to be stored in the cache.
+ *
+ * Stale responses can be served during configured grace windows while
+ * a single background request revalidates the entry and when upstream
+ * servers aren't available or respond with errors (RFC 5861).
+ *
+ * Responses with Vary header are stored as variants under secondary keys.
+ * Text responses can be also stored compressed by gzip for clients accepting
+ * the content coding.
+ *
+ * Entries are invalidated by PURGE requests from configured addresses for
+ * single URI or for all URIs with given prefix (e.g. curl -X PURGE <URL>*).
+ *
+ * Files of configured document root are loaded to the cache as complete
+ * responses in background at start and changed files are reloaded by
+ * periodic rescans.
+ *
  * TODO:
- * 1. Cache-Control, Expires, ETag, Last-Modified, Vary and some other
- *    RFC 2616 HTTP cache control facilities are not supported yet.
+ * 1. Some RFC 7234 HTTP cache control facilities are not supported yet.
+ *    Date and Age headers of upstream responses aren't used in freshness
+ *    calculations.
  *    RFC 3143 also affects the caching design.
  *
- * 2. Purge cache by individual entities (e.g. curl -X PURGE <URL>)
- *
  * Copyright (C) 2012-2014 NatSys Lab. (info@natsys-lab.com).
  * Copyright (C) 2014 Tempesta Technologies, Inc.
  *
@@ -29,86 +57,597 @@
  * this program; if not, write to the Free Software Foundation, Inc., 59
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
+#include <linux/crc32.h>
+#include <linux/ctype.h>
+#include <linux/file.h>
 #include <linux/freezer.h>
+#include <linux/fs.h>
+#include <linux/hash.h>
 #include <linux/ipv6.h>
 #include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/namei.h>
+#include <linux/random.h>
+#include <linux/rbtree.h>
+#include <linux/shrinker.h>
 #include <linux/tcp.h>
+#include <linux/time.h>
+#include <linux/timer.h>
 #include <linux/topology.h>
+#include <linux/vmalloc.h>
 #include <linux/workqueue.h>
+#include <linux/zlib.h>
+#include <net/ipv6.h>
+#include <asm/unaligned.h>
 
 #include "tdb.h"
 
 #include "tempesta_fw.h"
+#include "addr.h"
 #include "cache.h"
+#include "client.h"
+#include "debugfs.h"
+#include "hash.h"
 #include "http_msg.h"
 #include "lib.h"
 
+#define TFW_CE_ETAG(ce)		((char *)((ce) + 1))
+#define TFW_CE_LM(ce)		(TFW_CE_ETAG(ce) + (ce)->etag_len)
+#define TFW_CE_NM(ce)		(TFW_CE_LM(ce) + (ce)->lm_len)
+#define TFW_CE_VARY(ce)		(TFW_CE_NM(ce) + (ce)->nm_len)
+
+
+/*
+ * The response body isn't stored in the database: pages of the received
+ * response are referenced by @resp, so the entry is useless w/o @resp.
+ */
+#define TFW_CE_F_ADOPTED	0x0001
+/*
+ * The response is still being received and written to the entry, only
+ * @filled bytes of the body are available.
+ */
+#define TFW_CE_F_FILLING	0x0002
+/*
+ * Negatively cached error response: only the status line and headers are
+ * stored, the response is sent with empty body.
+ */
+#define TFW_CE_F_NEGATIVE	0x0004
+/* The response is built from a file of the document root. */
+#define TFW_CE_F_STATIC		0x0008
+/*
+ * Response to HEAD request: only the status line and headers are stored
+ * and the entry is used for HEAD requests only.
+ */
+#define TFW_CE_F_HEAD		0x0010
+/* The entry has gzip variant stored under tfw_cache_gzip_key() key. */
+#define TFW_CE_F_GZIP		0x0020
+/* The entry is gzip variant of another entry. */
+#define TFW_CE_F_GZIPPED	0x0040
+/*
+ * The body is stored with its chunked transfer coding, so @body_len counts
+ * the chunk framing and the body can't be sliced into ranges or compressed.
+ */
+#define TFW_CE_F_CHUNKED	0x0080
+
+#define SKB_HDR_SZ	(MAX_HEADER + sizeof(struct ipv6hdr)		\
+			 + sizeof(struct tcphdr))
+
+/*
+ * Context of response copying to database.
+ *
+ * @p		- current write position in @trec;
+ * @trec	- currently written data chunk;
+ * @crlf	- CRLF between the response headers and body;
+ * @len		- number of bytes remaining to copy;
+ * @copied	- number of copied bytes;
+ * @hdr_len	- offset of @crlf from the response beginning;
+ * @hdrs_only	- stop copying after @crlf, the body isn't stored;
+ */
+typedef struct {
+	char		*p;
+	TdbVRec		*trec;
+	unsigned char	*crlf;
+	size_t		len;
+	size_t		copied;
+	size_t		hdr_len;
+	bool		hdrs_only;
+} TfwCacheCopyCtx;
+
+/*
+ * State of response writing to the cache while it's being received.
+ *
+ * @hentry	- entry in the fills hash table, so requests hitting the
+ *		  filled entry can join it;
+ * @ce		- the filled entry or NULL if the response isn't written
+ *		  while it's received;
+ * @key		- the primary cache key of the response;
+ * @skb		- the last copied skb of the response;
+ * @hdr_skb	- the last skb of the response headers;
+ * @tails	- clients which joined the entry, protected by the fills hash
+ *		  table bucket lock;
+ * @readers	- clients getting the body as it's written, only the response
+ *		  owner accesses the list;
+ * @ctx		- context of the response copying;
+ */
+typedef struct {
+	struct hlist_node hentry;
+	TfwCacheEntry	*ce;
+	unsigned long	key;
+	struct sk_buff	*skb;
+	struct sk_buff	*hdr_skb;
+	struct list_head tails;
+	struct list_head readers;
+	TfwCacheCopyCtx	ctx;
+} TfwCacheFill;
+
 /*
- * @trec	- Database record descriptor.
- * @key		- the cache enty key (URI + Host header)
- * @hdr_lens	- array of size @hdr_num with all HTTP header lengths
- * @hdrs	- pointer to list of HTTP headers (with trailing CRLFs)
- * @body	- pointer to response body (with a prepending CRLF)
- * @resp	- Linked response if the entry is just created from recent
- * 		  message and NULL if loaded from database.
- *
- * Members from @trec to @body_len are directly written to database file.
- * Data pointers from @key to @body are converted from pointers to offsets
- * on database writing.
+ * Client of a request for the entry which is still being filled. The client
+ * gets the written part of the body at once and the rest as it's written.
+ *
+ * @list	- link in the tails or readers list of the fill;
+ * @sk		- the client socket;
+ * @sent	- number of the body bytes sent to the client;
  */
 typedef struct {
-	TdbVRec		trec;
-	/* TDB record body begins from the below. */
-	unsigned int	hdr_num;
-	unsigned int	key_len;
-	unsigned long	body_len;
-	/* db direct write bound */
-	char	*key;
-	unsigned int	*hdr_lens;
-	char		*hdrs;
-	char		*body;
-	/* db conversion bound */
-	TfwHttpResp	*resp;
-} TfwCacheEntry;
-
-/* Work to copy response body to database. */
+	struct list_head list;
+	struct sock	*sk;
+	unsigned long	sent;
+} TfwCacheTail;
+
+/*
+ * Work to copy response body to database or to process a request.
+ * @key is the primary cache key of the response or the request.
+ * Requests waiting for in-flight fetch are linked by @list.
+ */
 typedef struct tfw_cache_work_t {
 	struct work_struct	work;
+	unsigned long		key;
 	union {
-		TfwCacheEntry			*ce;
+		struct {
+			TfwCacheEntry		*ce;
+			TfwHttpResp		*resp;
+		} _c;
 		struct {
 			TfwHttpReq		*req;
 			tfw_http_req_cache_cb_t	action;
 			void			*data;
-			unsigned long		key;
+			struct list_head	list;
 		} _r;
 	} _u;
-#define cw_ce	_u.ce
+#define cw_ce	_u._c.ce
+#define cw_resp	_u._c.resp
 #define cw_req	_u._r.req
 #define cw_act	_u._r.action
 #define cw_data	_u._r.data
-#define cw_key	_u._r.key
+#define cw_key	key
+#define cw_list	_u._r.list
 } TfwCWork;
 
+/*
+ * In-flight fetch of a response from upstream server for cache key @key.
+ *
+ * @hentry	- entry in the fetches hash table;
+ * @key		- the cache key of the fetched response;
+ * @waiters	- works of requests waiting for the response;
+ * @timer	- timer to forward the waiting requests to upstream server
+ *		  if the response doesn't come in time;
+ */
+typedef struct {
+	struct hlist_node	hentry;
+	unsigned long		key;
+	struct list_head	waiters;
+	struct timer_list	timer;
+} TfwCacheFetch;
+
+#define TFW_CACHE_FETCH_HASH_BITS	10
+
+/*
+ * The bucket keeps in-flight fetches and entries being filled, see
+ * TfwCacheFill, for keys with the same hash.
+ */
+typedef struct {
+	struct hlist_head	list;
+	struct hlist_head	fills;
+	spinlock_t		lock;
+} TfwCacheFetchBucket;
+
+static TfwCacheFetchBucket fetch_hash[1 << TFW_CACHE_FETCH_HASH_BITS] = {
+	[0 ... ((1 << TFW_CACHE_FETCH_HASH_BITS) - 1)] = {
+		HLIST_HEAD_INIT,
+		HLIST_HEAD_INIT,
+		__SPIN_LOCK_UNLOCKED(lock)
+	}
+};
+
+static struct kmem_cache *fetch_cache;
+
 static TDB *db;
 static struct task_struct *cache_mgr_thr;
 static struct workqueue_struct *cache_wq;
 static struct kmem_cache *c_cache;
 
+/*
+ * Per-CPU cache statistics, see tfw_cache_stat_debugfs().
+ * Latency histograms have log2 buckets of nanoseconds.
+ */
+enum {
+	TFW_CACHE_STAT_HITS,
+	TFW_CACHE_STAT_STALE_HITS,
+	TFW_CACHE_STAT_MISSES,
+	TFW_CACHE_STAT_FILLS,
+	TFW_CACHE_STAT_FILL_ERRS,
+	TFW_CACHE_STAT_BYTES,
+	TFW_CACHE_STAT_EVICTIONS,
+	TFW_CACHE_STAT_COLD_HITS,
+	TFW_CACHE_STAT_DEMOTIONS,
+	TFW_CACHE_STAT_COLD_EVICTIONS,
+	TFW_CACHE_STAT_FROZEN_DROPS,
+	TFW_CACHE_STAT_N
+};
+
+enum {
+	TFW_CACHE_HIST_LOOKUP,
+	TFW_CACHE_HIST_BUILD,
+	TFW_CACHE_HIST_FILL,
+	TFW_CACHE_HIST_N
+};
+
+#define TFW_CACHE_HIST_BUCKETS	32
+
+typedef struct {
+	unsigned long	cnt[TFW_CACHE_STAT_N];
+	unsigned long	hist[TFW_CACHE_HIST_N][TFW_CACHE_HIST_BUCKETS];
+} TfwCacheStat;
+
+static DEFINE_PER_CPU(TfwCacheStat, cache_stat);
+
+static inline void
+tfw_cache_stat_add(int cnt, unsigned long n)
+{
+	this_cpu_add(cache_stat.cnt[cnt], n);
+}
+
+static inline void
+tfw_cache_stat_inc(int cnt)
+{
+	this_cpu_inc(cache_stat.cnt[cnt]);
+}
+
+/**
+ * Account a hit served by response @resp.
+ */
+static inline void
+tfw_cache_stat_hit(int cnt, TfwHttpResp *resp)
+{
+	this_cpu_inc(cache_stat.cnt[cnt]);
+	this_cpu_add(cache_stat.cnt[TFW_CACHE_STAT_BYTES], resp->msg.len);
+}
+
+/**
+ * Account latency of operation @hist started at @start by local_clock().
+ * Bucket N counts operations taking [2^(N-1), 2^N) nanoseconds.
+ */
+static inline void
+tfw_cache_stat_time(int hist, u64 start)
+{
+	int b = fls64(local_clock() - start);
+
+	this_cpu_inc(cache_stat.hist[hist][min(b, TFW_CACHE_HIST_BUCKETS - 1)]);
+}
+
+/*
+ * Responses built from cache entries consume DRAM (skbs and message pools)
+ * in contrast to TDB data, so they're released in batches of
+ * TFW_CACHE_SHRINK_BATCH least recently used entries on memory pressure.
+ * The responses are freed after RCU-bh grace period since cache readers
+ * can use them. Responses of removed entries are released in the same way.
+ */
+#define TFW_CACHE_SHRINK_BATCH	128
+/*
+ * Cache hits move entries in the LRU list not more often than once in the
+ * interval, so concurrent hits on hot entries don't contend on the lock.
+ */
+#define TFW_CACHE_LRU_TOUCH	HZ
+
+static LIST_HEAD(cache_lru);
+static LIST_HEAD(cache_free);
+static DEFINE_SPINLOCK(cache_lru_lock);
+static unsigned long cache_lru_n;
+static unsigned long cache_epoch;
+
+/*
+ * Range of error status codes which can be cached negatively with
+ * configured freshness lifetime, see tfw_cache_neg_ttl().
+ */
+#define TFW_CACHE_NEG_MIN	400
+#define TFW_CACHE_NEG_MAX	599
+/* Maximum number of addresses allowed to send PURGE requests. */
+#define TFW_CACHE_PURGE_ACL_MAX	16
+/*
+ * Maximum number and length of query parameter names in cache key
+ * normalization rules.
+ */
+#define TFW_CACHE_KEY_PARAMS_MAX	16
+#define TFW_CACHE_KEY_PARAM_LEN		32
+/* Maximum length of normalized Host header. */
+#define TFW_CACHE_KEY_HOST_MAX		256
+
+/*
+ * Query parameter names of cache key normalization rule.
+ * Names with @prefix set match all parameters beginning with @name.
+ */
+typedef struct {
+	unsigned int	n;
+	struct {
+		unsigned int	len;
+		bool		prefix;
+		char		name[TFW_CACHE_KEY_PARAM_LEN];
+	} p[TFW_CACHE_KEY_PARAMS_MAX];
+} TfwCacheKeyParams;
+
 static struct {
 	bool cache;
 	unsigned int db_size;
 	const char *db_path;
+	unsigned int default_ttl;
+	unsigned int collapse_timeout;
+	unsigned int stale_while_revalidate;
+	unsigned int stale_if_error;
+	bool zero_copy;
+	bool admission;
+	unsigned int stream_min;
+	unsigned int neg_ttl[TFW_CACHE_NEG_MAX - TFW_CACHE_NEG_MIN + 1];
+	unsigned int purge_acl_n;
+	struct in6_addr purge_acl[TFW_CACHE_PURGE_ACL_MAX];
+	const char *docroot;
+	const char *docroot_host;
+	unsigned int docroot_rescan;
+	bool compress;
+	bool key_host;
+	bool key_query_sort;
+	TfwCacheKeyParams key_query_keep;
+	TfwCacheKeyParams key_query_drop;
+	const char *cold_path;
+	unsigned int cold_size;
 } cache_cfg __read_mostly;
 
+/*
+ * Maximum length of generated Age and Warning headers and the final CRLF
+ * including terminating zero written by snprintf().
+ */
+#define TFW_CACHE_STALE_HDR	"Warning: 110 - \"Response is Stale\"\r\n"
+#define TFW_CACHE_AGE_HDR_MAX	sizeof("Age: 4294967295\r\n"	\
+				       TFW_CACHE_STALE_HDR "\r\n")
+
+/*
+ * Timeout of in-flight fetches for background revalidation if requests
+ * collapsing is disabled.
+ */
+#define TFW_CACHE_FETCH_TIMEOUT	1000
+
+/*
+ * Maximum length of validators and 304 response headers stored with
+ * a cache entry. Entries with larger validators aren't validated.
+ */
+#define TFW_CACHE_VALIDATORS_MAX	1024
+/* Maximum length of conditional request header value. */
+#define TFW_CACHE_COND_MAX		256
+/*
+ * Maximum length of Vary header list and of varied request headers
+ * used to calculate secondary key.
+ */
+#define TFW_CACHE_VARY_MAX		1024
+
+#define TFW_CACHE_NM_STATUS	"HTTP/1.1 304 Not Modified\r\n"
+#define TFW_CACHE_RANGE_STATUS	"HTTP/1.1 206 Partial Content\r\n"
+#define TFW_CACHE_NS_STATUS	"HTTP/1.1 416 Range Not Satisfiable\r\n"
+#define TFW_CACHE_PURGE_OK	"HTTP/1.1 200 OK\r\n"
+#define TFW_CACHE_PURGE_DENIED	"HTTP/1.1 403 Forbidden\r\n"
+#define TFW_CACHE_PURGE_NF	"HTTP/1.1 404 Not Found\r\n"
+/*
+ * Maximum length of generated headers of 206 and 416 responses and of
+ * multipart/byteranges body part headers w/o Content-Type value.
+ */
+#define TFW_CACHE_RANGE_HDR_MAX	192
+
+/* Stored response headers which are sent in 304 response, RFC 7232 4.1. */
+static const struct {
+	const char	*name;
+	int		len;
+} tfw_cache_nm_hdrs[] = {
+	{ "cache-control",	13 },
+	{ "content-location",	16 },
+	{ "date",		4 },
+	{ "etag",		4 },
+	{ "expires",		7 },
+	{ "last-modified",	13 },
+	{ "vary",		4 },
+};
+
+/*
+ * Compressible responses of TFW_CACHE_GZIP_MIN to TFW_CACHE_GZIP_MAX bytes
+ * are also stored as gzip variants if cache_compress is enabled. Cache
+ * workers compress the responses one by one with the single zlib workspace.
+ */
+#define TFW_CACHE_GZIP_MIN	256
+#define TFW_CACHE_GZIP_MAX	(1 << 20)
+#define TFW_CACHE_GZIP_SALT	0x677a6970UL
+#define TFW_CACHE_GZIP_VARY	"Vary: Accept-Encoding\r\n"
+/* gzip member header w/o optional fields and trailer, RFC 1952 2.3. */
+#define TFW_CACHE_GZIP_HDR	"\x1f\x8b\x08\0\0\0\0\0\0\x03"
+#define TFW_CACHE_GZIP_TRAILER	8
+/* Maximum length of generated headers of gzip variant. */
+#define TFW_CACHE_GZIP_HDRS_MAX	128
+
+static const char *tfw_cache_gzip_types[] = {
+	"text/",
+	"application/javascript",
+	"application/json",
+	"application/x-javascript",
+	"application/xml",
+	"image/svg+xml",
+};
+
+static void *cache_gzip_ws;
+static DEFINE_MUTEX(cache_gzip_mtx);
+
+static void tfw_cache_free_work(struct work_struct *work);
+static DECLARE_WORK(cache_free_work, tfw_cache_free_work);
+static void tfw_cache_fetch_done(unsigned long key);
+static bool tfw_cache_admit(unsigned long key);
+static void tfw_cache_uri_remove(unsigned long key);
+static void tfw_cache_entry_release(TfwCacheEntry *ce);
+static void tfw_cache_front_add(unsigned long key, TfwCacheEntry *ce,
+				TfwCacheTmpl *gz);
+static bool tfw_cache_entry_remove(TfwCacheEntry *ce);
+static void tfw_cache_entry_drop(TfwCacheEntry *ce);
+static bool tfw_cache_cold_drop(unsigned long key);
+static bool tfw_cache_cold_demote(TfwHttpReq *req, TfwHttpResp *resp,
+				  unsigned long key);
+static void tfw_cache_cold_store(TfwHttpResp *resp, unsigned long key,
+				 unsigned long date, unsigned int lifetime);
+
+
+/**
+ * Hash of Host header @host case-folded and w/o default port.
+ */
+static unsigned long
+tfw_cache_key_host(const TfwStr *host)
+{
+	size_t n;
+	unsigned long crc = TFW_HASH_INIT;
+	char buf[TFW_CACHE_KEY_HOST_MAX], *v, *end;
+
+	if (!host->ptr || tfw_str_len(host) >= sizeof(buf))
+		return tfw_hash_str(host);
+
+	n = tfw_str_to_cstr(host, buf, sizeof(buf));
+	end = buf + n;
+	v = memchr(buf, ':', n);
+	if (!v)
+		return tfw_hash_str(host);
+	for (++v; v < end && isspace(*v); ++v)
+		;
+	while (end > v && isspace(end[-1]))
+		--end;
+	if (end - v > 3 && !memcmp(end - 3, ":80", 3))
+		end -= 3;
+
+	for (n = 0; n < sizeof("host:") - 1; ++n)
+		crc = tfw_hash_chr(crc, "host:"[n]);
+	for ( ; v < end; ++v)
+		crc = tfw_hash_chr(crc, tolower(*v));
+
+	return crc;
+}
+
+static bool
+tfw_cache_key_param_match(const TfwCacheKeyParams *kp, const char *name,
+			  unsigned int len)
+{
+	int i;
+
+	for (i = 0; i < kp->n; ++i) {
+		if (kp->p[i].prefix ? len < kp->p[i].len
+				    : len != kp->p[i].len)
+			continue;
+		if (!memcmp(name, kp->p[i].name, kp->p[i].len))
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Add hash @crc of query parameter with name @name of length @len to hash
+ * @acc of the kept parameters. @len is the full name length, while only first
+ * TFW_CACHE_KEY_PARAM_LEN bytes of the name are available, which is enough
+ * since configured names aren't longer. Hashes of sorted parameters are combined in order
+ * independent way, so the parameters aren't actually sorted.
+ */
+static unsigned long
+tfw_cache_key_param(unsigned long acc, unsigned long crc, const char *name,
+		    unsigned int len)
+{
+	/* Empty parameter. */
+	if (crc == TFW_HASH_INIT)
+		return acc;
+	if (tfw_cache_key_param_match(&cache_cfg.key_query_drop, name, len))
+		return acc;
+	if (cache_cfg.key_query_keep.n
+	    && !tfw_cache_key_param_match(&cache_cfg.key_query_keep, name,
+					  len))
+		return acc;
+
+	if (cache_cfg.key_query_sort)
+		return acc + hash_64(crc, 64);
+	return hash_64(acc ^ crc, 64);
+}
+
+/**
+ * Hash of URI @uri with query parameters filtered and probably sorted.
+ * The URI is hashed as is if there are no query normalization rules.
+ */
+static unsigned long
+tfw_cache_key_uri(const TfwStr *uri)
+{
+	const TfwStr *c;
+	unsigned int i, n = 0;
+	unsigned long crc = TFW_HASH_INIT, p_crc = TFW_HASH_INIT, acc = 0;
+	bool query = false, in_name = true;
+	char name[TFW_CACHE_KEY_PARAM_LEN];
+
+	if (!cache_cfg.key_query_sort && !cache_cfg.key_query_keep.n
+	    && !cache_cfg.key_query_drop.n)
+		return tfw_hash_str(uri);
+
+	TFW_STR_FOR_EACH_CHUNK(c, uri) {
+		for (i = 0; i < c->len; ++i) {
+			unsigned char ch = ((unsigned char *)c->ptr)[i];
+
+			if (!query) {
+				if (ch == '?')
+					query = true;
+				else
+					crc = tfw_hash_chr(crc, ch);
+				continue;
+			}
+			if (ch == '&') {
+				acc = tfw_cache_key_param(acc, p_crc, name, n);
+				p_crc = TFW_HASH_INIT;
+				in_name = true;
+				n = 0;
+				continue;
+			}
+			if (in_name && ch == '=') {
+				in_name = false;
+			} else if (in_name) {
+				/* Count the full length of long names. */
+				if (n < sizeof(name))
+					name[n] = ch;
+				++n;
+			}
+			p_crc = tfw_hash_chr(p_crc, ch);
+		}
+	}
+	acc = tfw_cache_key_param(acc, p_crc, name, n);
+
+	return crc ^ acc;
+}
 
 /**
  * Calculates search key for the request URI and Host header.
+ * The key is the same as tfw_http_req_key_calc() unless cache key
+ * normalization is configured.
  */
 static unsigned long
 tfw_cache_key_calc(TfwHttpReq *req)
 {
-	return tfw_http_req_key_calc(req);
+	TfwStr *host = &req->h_tbl->tbl[TFW_HTTP_HDR_HOST].field;
+	unsigned long h = cache_cfg.key_host ? tfw_cache_key_host(host)
+					     : tfw_hash_str(host);
+
+	return h ^ tfw_cache_key_uri(&req->uri_path);
 }
 
 /**
@@ -140,6 +679,118 @@ tfw_cache_sched_work_cpu(int node)
 	return smp_processor_id();
 }
 
+/**
+ * Finish writing of @ce members stored in the database file, which must be
+ * started by tdb_rec_write_begin(), so a running table snapshot copies them.
+ */
+static inline void
+tfw_cache_entry_written(TfwCacheEntry *ce)
+{
+	tdb_rec_write_end(db, ce, offsetof(TfwCacheEntry, tmpl));
+}
+
+/**
+ * Create database record with key @key for entry @cdata followed by data
+ * of length @len (validators or Vary list).
+ *
+ * Runtime members of entries, e.g. @tmpl, are referenced w/o the bucket
+ * lock, but TDB moves small records on bucket burst and reuses space of
+ * removed small records. So the entry is padded to TDB_HTRIE_MINDREC bytes
+ * to be stored as large record, which always stays at its place.
+ */
+static TfwCacheEntry *
+tfw_cache_entry_create(unsigned long key, TfwCacheEntry *cdata, size_t len)
+{
+	char buf[TDB_HTRIE_MINDREC] = { 0 };
+	char *data = (char *)cdata + sizeof(cdata->trec);
+	size_t n;
+	TfwCacheEntry *ce;
+
+	len += sizeof(*cdata) - sizeof(cdata->trec);
+	if (len < TDB_HTRIE_MINDREC) {
+		memcpy(buf, data, len);
+		data = buf;
+		len = TDB_HTRIE_MINDREC;
+	}
+
+	n = len;
+	ce = (TfwCacheEntry *)tdb_entry_create(db, key, data, &n);
+	BUG_ON(ce && n != len);
+	/*
+	 * The table is frozen for a short time by a snapshot, so the entry
+	 * can be stored by a following request, just account the drop.
+	 */
+	if (!ce && tdb_frozen(db))
+		tfw_cache_stat_inc(TFW_CACHE_STAT_FROZEN_DROPS);
+
+	return ce;
+}
+
+/**
+ * Allocate template for response @resp built from entry @ce.
+ */
+static TfwCacheTmpl *
+tfw_cache_tmpl_new(TfwCacheEntry *ce, TfwHttpResp *resp)
+{
+	size_t n = ce->etag_len + ce->lm_len + ce->nm_len;
+	TfwCacheTmpl *t;
+
+	t = kmalloc(sizeof(*t) + n, GFP_ATOMIC);
+	if (!t)
+		return NULL;
+	atomic_set(&t->refcnt, 1);
+	t->dead = 0;
+	t->resp = resp;
+	memcpy(&t->ce, ce, sizeof(*ce) + n);
+
+	return t;
+}
+
+static void
+tfw_cache_tmpl_put(TfwCacheTmpl *t)
+{
+	if (!atomic_dec_and_test(&t->refcnt))
+		return;
+	tfw_http_msg_free((TfwHttpMsg *)t->resp);
+	kfree(t);
+}
+
+/**
+ * Link template @t with entry @ce and the LRU list.
+ * Called under cache_lru_lock.
+ */
+void
+__tfw_cache_tmpl_link(TfwCacheEntry *ce, TfwCacheTmpl *t)
+{
+	t->owner = ce;
+	t->lru_touch = jiffies;
+	list_add(&t->list, &cache_lru);
+	++cache_lru_n;
+	ce->tmpl = t;
+	/* Lockless readers check @epoch before @tmpl. */
+	smp_wmb();
+	ce->epoch = cache_epoch;
+}
+DEBUG_EXPORT_SYMBOL(__tfw_cache_tmpl_link);
+
+/**
+ * Unlink the template of @ce from the entry and the LRU list and add it
+ * to @free_list. The template is released after RCU-bh grace period since
+ * cache readers can use it. Called under cache_lru_lock.
+ */
+static void
+__tfw_cache_tmpl_unlink(TfwCacheEntry *ce, struct list_head *free_list)
+{
+	TfwCacheTmpl *t = ce->tmpl;
+
+	list_move(&t->list, free_list);
+	--cache_lru_n;
+	t->owner = NULL;
+	/* The front caches drop the template on next hit. */
+	ACCESS_ONCE(t->dead) = 1;
+	ce->tmpl = NULL;
+}
+
 /**
  * Copies plain TfwStr to TdbRec.
  * @return number of copied bytes (@src length).
@@ -167,7 +818,9 @@ tfw_cache_copy_str(char **p, TdbVRec **trec, TfwStr *src, size_t tot_len)
 			room = (*trec)->len;
 		}
 		room = min((long)room, src->len - copied);
-		memcpy(p, (char *)src->ptr + copied, room);
+		tdb_rec_write_begin();
+		memcpy(*p, (char *)src->ptr + copied, room);
+		tdb_rec_write_end(db, *p, room);
 		*p += room;
 		copied += room;
 	}
@@ -176,342 +829,5167 @@ tfw_cache_copy_str(char **p, TdbVRec **trec, TfwStr *src, size_t tot_len)
 }
 
 /**
- * Copies TfwStr (probably compound) to TdbRec.
- * @return number of copied bytes (@src overall length).
+ * Copy @len bytes of message data at @data to TDB record.
+ * Position of @ctx->crlf in the message is saved if it's found in @data.
  */
-static long
-tfw_cache_copy_str_compound(char **p, TdbVRec **trec, TfwStr *src,
-			    size_t tot_len)
+static int
+tfw_cache_copy_data(TfwCacheCopyCtx *ctx, unsigned char *data, size_t len)
 {
-	int i;
-	long copied = 0;
-
-	BUG_ON(!tot_len);
+	long n;
+	TfwStr s = { .ptr = data, .len = min(len, ctx->len) };
 
-	if (!(src->flags & TFW_STR_COMPOUND))
-		return tfw_cache_copy_str(p, trec, src, tot_len);
+	if (!s.len)
+		return 0;
 
-	for (i = 0; i < src->len; ++i) {
-		long n = tfw_cache_copy_str(p, trec, (TfwStr *)src->ptr + i,
-					    tot_len - copied);
-		if (n < 0)
-			return n;
-		copied += n;
-		BUG_ON(tot_len < copied);
+	if (ctx->crlf >= data && ctx->crlf < data + s.len) {
+		ctx->hdr_len = ctx->copied + (ctx->crlf - data);
+		/* The CRLF is the last copied data if there is no body. */
+		if (ctx->hdrs_only) {
+			ctx->len = ctx->crlf - data + 2;
+			s.len = min(s.len, ctx->len);
+		}
 	}
 
-	return copied;
+	n = tfw_cache_copy_str(&ctx->p, &ctx->trec, &s, ctx->len);
+	if (n < 0)
+		return n;
+	ctx->copied += n;
+	ctx->len -= n;
+
+	return 0;
 }
 
 /**
- * Work to copy response skbs to database mapped area.
- *
- * It's nasty to copy data on CPU, but we can't use DMA for mmaped file
- * as well as for unaligned memory areas.
+ * Copy linear, paged and fragmented data of @skb to TDB record.
+ * See ss_tcp_process_skb() as reference.
  */
-static void
-tfw_cache_copy_resp(struct work_struct *work)
+static int
+tfw_cache_copy_skb(TfwCacheCopyCtx *ctx, struct sk_buff *skb)
 {
-	int i;
-	size_t hlens, tot_len;
-	long n;
-	char *p;
-	TfwCWork *cw = (TfwCWork *)work;
-	TfwCacheEntry *ce = cw->cw_ce;
-	TdbVRec *trec;
-	TfwHttpHdrTbl *htbl;
-	TfwHttpHdr *hdr;
-
-	BUG_ON(!ce->resp);
-
-	/* Write HTTP headers. */
-	htbl = ce->resp->h_tbl;
-	ce->hdr_num = htbl->size;
-
-	hlens = sizeof(ce->hdr_lens[0]) * ce->hdr_num;
-	tot_len = hlens + ce->resp->msg.len;
+	int i, r;
+	struct sk_buff *frag_i;
 
-	/*
-	 * Try to place the cached response in single memory chunk.
-	 *
-	 * Number of HTTP headers is limited by TFW_HTTP_HDR_NUM_MAX while TDB
-	 * should be able to allocate an empty page if we issued a large
-	 * request. So HTTP header lengths must fit the first allocated data
-	 * chunk, also there must be some space for headers and message bodies.
-	 */
-	trec = tdb_entry_add(db, (TdbVRec *)ce, tot_len);
-	if (!trec || trec->len <= hlens) {
-		TFW_WARN("Cannot allocate memory to cache HTTP headers."
-			 " Probably TDB cache is exhausted.\n");
-		goto err;
-	}
-	p = (char *)(trec + 1) + hlens;
-	tot_len -= hlens;
+	r = tfw_cache_copy_data(ctx, skb->data, skb_headlen(skb));
+	if (r)
+		return r;
 
-	/*
-	 * Set start of headers pointer just after array of
-	 * header length.
-	 */
-	ce->hdrs = p;
-	hdr = htbl->tbl;
-	for (i = 0; i < hlens / sizeof(ce->hdr_lens[0]); ++i, ++hdr) {
-		n = tfw_cache_copy_str_compound(&p, &trec, &hdr->field,
-						tot_len);
-		if (n < 0) {
-			TFW_ERR("Cache: cannot copy HTTP header\n");
-			goto err;
-		}
-		BUG_ON(n > tot_len);
-		tot_len -= n;
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; ++i) {
+		const skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+		r = tfw_cache_copy_data(ctx, skb_frag_address(frag),
+					skb_frag_size(frag));
+		if (r)
+			return r;
 	}
 
-	/* Write HTTP response body. */
-	ce->body = p;
-	n = tfw_cache_copy_str_compound(&p, &trec, &ce->resp->body, tot_len);
-	if (n < 0) {
-		TFW_ERR("Cache: cannot copy HTTP body\n");
-		goto err;
+	skb_walk_frags(skb, frag_i) {
+		r = tfw_cache_copy_skb(ctx, frag_i);
+		if (r)
+			return r;
 	}
-	ce->body_len = n;
 
-err:
-	/* FIXME all allocated TDB blocks are leaked here. */
-	kmem_cache_free(c_cache, cw);
+	return 0;
 }
 
-void
-tfw_cache_add(TfwHttpResp *resp, TfwHttpReq *req)
+/**
+ * Read @len bytes of cache entry data from position @data in chunk @trec
+ * to @dst and move the position. The data is just skipped if @dst is NULL.
+ */
+static void
+tfw_cache_read(TdbVRec **trec, char **data, char *dst, size_t len)
 {
-	TfwCWork *cw;
-	TfwCacheEntry *ce, cdata = {{}};
-	unsigned long key;
-	size_t len = sizeof(cdata);
+	while (len) {
+		size_t n = (*trec)->data + (*trec)->len - *data;
 
-	if (!cache_cfg.cache)
-		goto out;
+		if (!n) {
+			BUG_ON(!(*trec)->chunk_next);
+			*trec = TDB_PTR(db->hdr, TDB_DI2O((*trec)->chunk_next));
+			*data = (*trec)->data;
+			continue;
+		}
+		n = min(n, len);
+		if (dst) {
+			memcpy(dst, *data, n);
+			dst += n;
+		}
+		*data += n;
+		len -= n;
+	}
+}
 
-	key = tfw_cache_key_calc(req);
+/**
+ * Set start position of the stored response of @ce.
+ * See tfw_cache_copy_resp().
+ */
+static void
+tfw_cache_entry_data(TfwCacheEntry *ce, TdbVRec **trec, char **data)
+{
+	*trec = TDB_PTR(db->hdr, TDB_DI2O(ce->trec.chunk_next));
+	*data = TDB_PTR(db->hdr, (unsigned long)ce->hdrs);
+	BUG_ON(*data < (*trec)->data || *data > (*trec)->data + (*trec)->len);
+}
 
-	/* TODO copy at least first part of URI here. */
+#define TFW_CACHE_NEG_CL	"Content-Length: 0\r\n"
 
-	ce = (TfwCacheEntry *)tdb_entry_create(db, key, &cdata, &len);
-	BUG_ON(len != sizeof(cdata));
-	if (!ce)
-		goto out;
+static inline bool
+tfw_cache_hdr_line_eq(const char *line, size_t len, const char *name, int n)
+{
+	return len > n && line[n] == ':' && !strncasecmp(line, name, n);
+}
+
+/**
+ * Replace message framing headers in @len bytes of status line and headers
+ * @hdrs of negative entry by empty body length. There must be room for
+ * TFW_CACHE_NEG_CL after @hdrs.
+ * @return length of the resulting headers.
+ */
+static size_t
+tfw_cache_neg_hdrs(char *hdrs, size_t len)
+{
+	char *p = hdrs, *end = hdrs + len, *eol, *dst;
+
+	/* Keep the status line. */
+	eol = memchr(p, '\n', end - p);
+	p = dst = eol ? eol + 1 : end;
+
+	for ( ; p < end; p = eol) {
+		eol = memchr(p, '\n', end - p);
+		eol = eol ? eol + 1 : end;
+		if (tfw_cache_hdr_line_eq(p, eol - p, "content-length", 14)
+		    || tfw_cache_hdr_line_eq(p, eol - p, "transfer-encoding",
+					     17))
+			continue;
+		memmove(dst, p, eol - p);
+		dst += eol - p;
+	}
+	memcpy(dst, TFW_CACHE_NEG_CL, sizeof(TFW_CACHE_NEG_CL) - 1);
 
-	ce->resp = resp;
+	return dst + sizeof(TFW_CACHE_NEG_CL) - 1 - hdrs;
+}
+
+/**
+ * Allocate response template for @ce: status line and @hdr_len bytes of
+ * the stored headers are read to linear data of the first skb, so cache hits
+ * don't walk the database records. The body is added as paged fragments of
+ * next skbs by tfw_cache_resp_add_frag(). @trec and @data are set to the body
+ * beginning. Note that the template message length covers the body only.
+ */
+static TfwHttpResp *
+tfw_cache_tmpl_alloc(TfwCacheEntry *ce, size_t hdr_len, TdbVRec **trec,
+		     char **data)
+{
+	struct sk_buff *skb;
+	TfwHttpResp *resp;
 
 	/*
-	 * We must write the entry key now because the request dies
-	 * when the function finishes.
+	 * Allocated response won't be checked by any filters and
+	 * is used for sending response data only, so don't initialize
+	 * connection and GFSM fields.
 	 */
-	if (tfw_cache_entry_key_copy(ce, req))
-		goto out;
+	resp = (TfwHttpResp *)tfw_http_msg_alloc(Conn_Srv);
+	if (!resp)
+		return NULL;
 
-	cw = kmem_cache_alloc(c_cache, GFP_ATOMIC);
-	if (!cw)
-		goto out;
-	INIT_WORK(&cw->work, tfw_cache_copy_resp);
-	cw->cw_ce = ce;
-	queue_work_on(tfw_cache_sched_work_cpu(numa_node_id()), cache_wq,
-		      (struct work_struct *)cw);
+	skb = alloc_skb(hdr_len + sizeof(TFW_CACHE_NEG_CL)
+			+ sizeof(TFW_CACHE_GZIP_VARY), GFP_ATOMIC);
+	if (!skb) {
+		tfw_http_msg_free((TfwHttpMsg *)resp);
+		return NULL;
+	}
+	ss_skb_queue_tail(&resp->msg.skb_list, skb);
 
-out:
-	/* Now we don't need the request and the reponse anymore. */
-	tfw_http_msg_free((TfwHttpMsg *)req);
-	tfw_http_msg_free((TfwHttpMsg *)resp);
+	/* Read the headers and skip CRLF before the body. */
+	tfw_cache_entry_data(ce, trec, data);
+	tfw_cache_read(trec, data, (char *)skb_tail_pointer(skb), hdr_len);
+	tfw_cache_read(trec, data, NULL, 2);
+	if (ce->flags & TFW_CE_F_NEGATIVE)
+		hdr_len = tfw_cache_neg_hdrs((char *)skb_tail_pointer(skb),
+					     hdr_len);
+	/* The identity response also varies if there is gzip variant. */
+	if (ce->flags & TFW_CE_F_GZIP) {
+		memcpy(skb_tail_pointer(skb) + hdr_len, TFW_CACHE_GZIP_VARY,
+		       sizeof(TFW_CACHE_GZIP_VARY) - 1);
+		hdr_len += sizeof(TFW_CACHE_GZIP_VARY) - 1;
+	}
+	skb_put(skb, hdr_len);
+
+	return resp;
 }
 
-#define SKB_HDR_SZ	(MAX_HEADER + sizeof(struct ipv6hdr)		\
-			 + sizeof(struct tcphdr))
+/**
+ * Add @size bytes of @page at offset @off as paged fragment to the last skb
+ * of @resp or to a new skb if the last one is full. The page reference is
+ * dropped when the skb is freed.
+ */
+static int
+tfw_cache_resp_add_frag(TfwHttpResp *resp, struct page *page, int off,
+			int size)
+{
+	struct sk_buff *skb = ss_skb_peek_tail(&resp->msg.skb_list);
+
+	/* Linear data of template skb is the stored headers. */
+	if (!skb || skb_headlen(skb)
+	    || skb_shinfo(skb)->nr_frags == MAX_SKB_FRAGS)
+	{
+		/* Protocol headers are placed in linear data only. */
+		skb = alloc_skb(SKB_HDR_SZ, GFP_ATOMIC);
+		if (!skb)
+			return -ENOMEM;
+		skb_reserve(skb, SKB_HDR_SZ);
+		ss_skb_queue_tail(&resp->msg.skb_list, skb);
+	}
+
+	skb_fill_page_desc(skb, skb_shinfo(skb)->nr_frags, page, off, size);
+	skb->len += size;
+	skb->data_len += size;
+	skb->truesize += size;
+	resp->msg.len += size;
+
+	return 0;
+}
 
 /**
- * Build ce->resp and ce->resp->msg that it can be sent via TCP socket.
- *
- * Cache entry data is set as paged fragments of skb.
- * See do_tcp_sendpages() as reference.
+ * Add @len bytes of stored data at @data of @trec to @resp as paged fragments
+ * referencing the database pages.
+ */
+static int
+tfw_cache_resp_add_data(TfwHttpResp *resp, TdbVRec *trec, char *data,
+			size_t len)
+{
+	while (len) {
+		struct page *page;
+		int off, size = trec->data + trec->len - data;
+
+		if (!size) {
+			trec = TDB_PTR(db->hdr, TDB_DI2O(trec->chunk_next));
+			data = trec->data;
+			continue;
+		}
+
+		off = (unsigned long)data & ~PAGE_MASK;
+		size = min_t(size_t, min_t(int, size, PAGE_SIZE - off), len);
+		page = virt_to_page(data);
+
+		get_page(page);
+		if (tfw_cache_resp_add_frag(resp, page, off, size)) {
+			put_page(page);
+			return -ENOMEM;
+		}
+
+		data += size;
+		len -= size;
+	}
+
+	return 0;
+}
+
+/**
+ * Build a message with @len bytes of @ce body starting from offset @off.
+ */
+static TfwHttpResp *
+tfw_cache_body_resp(TfwCacheEntry *ce, unsigned long off, size_t len)
+{
+	TdbVRec *trec;
+	char *data;
+	TfwHttpResp *resp;
+
+	resp = (TfwHttpResp *)tfw_http_msg_alloc(Conn_Srv);
+	if (!resp)
+		return NULL;
+
+	/* Skip the headers and CRLF before the body. */
+	tfw_cache_entry_data(ce, &trec, &data);
+	tfw_cache_read(&trec, &data, NULL, ce->hdr_len + 2 + off);
+	if (tfw_cache_resp_add_data(resp, trec, data, len)) {
+		tfw_http_msg_free((TfwHttpMsg *)resp);
+		return NULL;
+	}
+
+	return resp;
+}
+
+/*
+ * Context of response body adoption.
  *
- * We return skbs in the cache entry response w/o setting any
- * network headers - tcp_transmit_skb() will do it for us.
+ * @body	- response with the adopted body;
+ * @skip	- number of bytes to skip before the body;
+ * @len		- number of body bytes remaining to adopt;
+ */
+typedef struct {
+	TfwHttpResp	*body;
+	size_t		skip;
+	size_t		len;
+} TfwCacheAdoptCtx;
+
+/**
+ * Adopt @len bytes of response data @data. Paged data at @page is referenced,
+ * while linear data (@page is NULL) is copied to new pages.
+ */
+static int
+tfw_cache_adopt_data(TfwCacheAdoptCtx *ctx, unsigned char *data, size_t len,
+		     struct page *page, int off)
+{
+	size_t n = min(len, ctx->skip);
+
+	ctx->skip -= n;
+	data += n;
+	off += n;
+	len = min(len - n, ctx->len);
+
+	while (len) {
+		if (page) {
+			n = len;
+			get_page(page);
+		} else {
+			n = min_t(size_t, len, PAGE_SIZE);
+			page = alloc_page(GFP_KERNEL);
+			if (!page)
+				return -ENOMEM;
+			memcpy(page_address(page), data, n);
+			off = 0;
+		}
+		if (tfw_cache_resp_add_frag(ctx->body, page, off, n)) {
+			put_page(page);
+			return -ENOMEM;
+		}
+		if (!off)
+			page = NULL;
+		data += n;
+		len -= n;
+		ctx->len -= n;
+	}
+
+	return 0;
+}
+
+static int
+tfw_cache_adopt_skb(TfwCacheAdoptCtx *ctx, struct sk_buff *skb)
+{
+	int i, r;
+	struct sk_buff *frag_i;
+
+	r = tfw_cache_adopt_data(ctx, skb->data, skb_headlen(skb), NULL, 0);
+	if (r)
+		return r;
+
+	for (i = 0; i < skb_shinfo(skb)->nr_frags && ctx->len; ++i) {
+		const skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+		r = tfw_cache_adopt_data(ctx, skb_frag_address(frag),
+					 skb_frag_size(frag),
+					 skb_frag_page(frag),
+					 frag->page_offset);
+		if (r)
+			return r;
+	}
+
+	skb_walk_frags(skb, frag_i) {
+		r = tfw_cache_adopt_skb(ctx, frag_i);
+		if (r)
+			return r;
+	}
+
+	return 0;
+}
+
+/**
+ * Whether body of @resp should be adopted by reference instead of copying.
+ * Only responses with known body length are adopted.
+ */
+static bool
+tfw_cache_adoptable(TfwHttpResp *resp)
+{
+	return cache_cfg.zero_copy && !(resp->flags & TFW_HTTP_CHUNKED)
+	       && resp->content_length
+	       && resp->content_length < resp->msg.len;
+}
+
+/**
+ * Adopt body of @resp, which starts at offset @skip, by reference as
+ * the cache entry @ce response template with @hdr_len bytes of headers.
+ * The template is released as usual on memory pressure or when the entry
+ * is removed.
  */
 static int
-tfw_cache_build_resp(TfwCacheEntry *ce)
+tfw_cache_adopt_body(TfwCacheEntry *ce, TfwHttpResp *resp, size_t hdr_len,
+		     size_t skip)
 {
-	int f = 0;
-	TdbVRec *trec = &ce->trec;
+	TdbVRec *trec;
 	char *data;
-	struct sk_buff *skb = NULL;
+	struct sk_buff *skb;
+	TfwCacheTmpl *t;
+	TfwCacheAdoptCtx ctx = { .skip = skip, .len = ce->body_len };
 
-	/*
-	 * Allocated response won't be checked by any filters and
-	 * is used for sending response data only, so don't initialize
-	 * connection and GFSM fields.
-	 */
-	ce->resp = (TfwHttpResp *)tfw_http_msg_alloc(Conn_Srv);
-	if (!ce->resp)
+	ctx.body = tfw_cache_tmpl_alloc(ce, hdr_len, &trec, &data);
+	if (!ctx.body)
+		return -ENOMEM;
+
+	for (skb = ss_skb_peek(&resp->msg.skb_list); skb && ctx.len;
+	     skb = ss_skb_next(&resp->msg.skb_list, skb))
+	{
+		if (tfw_cache_adopt_skb(&ctx, skb))
+			goto err;
+	}
+	if (ctx.len)
+		goto err;
+
+	tdb_rec_write_begin();
+	ce->flags |= TFW_CE_F_ADOPTED;
+	tfw_cache_entry_written(ce);
+	t = tfw_cache_tmpl_new(ce, ctx.body);
+	if (!t)
+		goto err;
+
+	spin_lock_bh(&cache_lru_lock);
+	__tfw_cache_tmpl_link(ce, t);
+	spin_unlock_bh(&cache_lru_lock);
+
+	return 0;
+err:
+	tfw_http_msg_free((TfwHttpMsg *)ctx.body);
+	return -ENOMEM;
+}
+
+/**
+ * Primary key of gzip variant of entry with key @key.
+ */
+static inline unsigned long
+tfw_cache_gzip_key(unsigned long key)
+{
+	return hash_64(key ^ TFW_CACHE_GZIP_SALT, 64);
+}
+
+/**
+ * Whether response with status line and headers @hdrs of length @len can be
+ * stored compressed: it must be a text w/o content coding and the sender
+ * mustn't prohibit transformations of the response (RFC 7234 5.2.2.4).
+ */
+static bool
+tfw_cache_gzip_hdrs_ok(const char *hdrs, size_t len)
+{
+	int i;
+	size_t n;
+	bool text = false;
+	const char *p, *v, *eol, *end = hdrs + len;
+
+	eol = memchr(hdrs, '\n', len);
+	for (p = eol ? eol + 1 : end; p < end; p = eol) {
+		eol = memchr(p, '\n', end - p);
+		eol = eol ? eol + 1 : end;
+		if (tfw_cache_hdr_line_eq(p, eol - p, "content-encoding", 16)
+		    || tfw_cache_hdr_line_eq(p, eol - p, "transfer-encoding",
+					     17)
+		    || tfw_cache_hdr_line_eq(p, eol - p, "content-range", 13)
+		    || tfw_cache_hdr_line_eq(p, eol - p, "vary", 4))
+			return false;
+		if (tfw_cache_hdr_line_eq(p, eol - p, "cache-control", 13)
+		    && strnstr(p, "no-transform", eol - p))
+			return false;
+		if (!tfw_cache_hdr_line_eq(p, eol - p, "content-type", 12))
+			continue;
+		for (v = p + 13; v < eol && isspace(*v); ++v)
+			;
+		for (i = 0; i < ARRAY_SIZE(tfw_cache_gzip_types); ++i) {
+			n = strlen(tfw_cache_gzip_types[i]);
+			if (eol - v >= n
+			    && !strncasecmp(v, tfw_cache_gzip_types[i], n))
+				text = true;
+		}
+	}
+
+	return text;
+}
+
+/**
+ * Write headers of gzip variant with body of length @clen to @buf: stored
+ * headers @hdrs of length @len w/o Content-Length and ETag, which belong to
+ * the identity response, and the content coding headers.
+ * @return length of the headers including the final CRLF.
+ */
+static size_t
+tfw_cache_gzip_hdrs(const char *hdrs, size_t len, size_t clen, char *buf)
+{
+	char *dst = buf;
+	const char *p, *eol, *end = hdrs + len;
+
+	for (p = hdrs; p < end; p = eol) {
+		eol = memchr(p, '\n', end - p);
+		eol = eol ? eol + 1 : end;
+		if (tfw_cache_hdr_line_eq(p, eol - p, "content-length", 14)
+		    || tfw_cache_hdr_line_eq(p, eol - p, "etag", 4))
+			continue;
+		memcpy(dst, p, eol - p);
+		dst += eol - p;
+	}
+	dst += snprintf(dst, TFW_CACHE_GZIP_HDRS_MAX,
+			"Content-Encoding: gzip\r\n" TFW_CACHE_GZIP_VARY
+			"Content-Length: %lu\r\n\r\n", clen);
+
+	return dst - buf;
+}
+
+/**
+ * Account @n bytes of compressed data at @buf in @clen and copy them to
+ * position @p in chunk @trec if it's not NULL.
+ * @return -E2BIG if the compressed data is longer than @max.
+ */
+static int
+tfw_cache_gzip_out(const char *buf, size_t n, size_t *clen, size_t max,
+		   TdbVRec **trec, char **p)
+{
+	TfwStr s = { .ptr = (void *)buf, .len = n };
+
+	*clen += n;
+	if (*clen > max)
+		return -E2BIG;
+	if (trec && tfw_cache_copy_str(p, trec, &s, max - *clen + n) != n)
 		return -ENOMEM;
 
-	/* Deserialize offsets to pointers. */
-	ce->key = TDB_PTR(db->hdr, (unsigned long)ce->key);
-	ce->hdr_lens = TDB_PTR(db->hdr, (unsigned long)ce->hdr_lens);
-	ce->hdrs = TDB_PTR(db->hdr, (unsigned long)ce->hdrs);
-	ce->body = TDB_PTR(db->hdr, (unsigned long)ce->body);
+	return 0;
+}
+
+/**
+ * Compress @len bytes of the entry data at position @data in chunk @trec
+ * as gzip member (RFC 1952) using @buf of PAGE_SIZE bytes for the output.
+ * The output is written to position @p in chunk @dst or only counted if
+ * @dst is NULL, so the body is compressed twice to store the variant:
+ * deflate is deterministic for the same input and parameters.
+ * @return length of the compressed data or zero if it's longer than @max.
+ */
+static size_t
+tfw_cache_gzip_body(TdbVRec *trec, char *data, size_t len, char *buf,
+		    size_t max, TdbVRec **dst, char **p)
+{
+	int r;
+	size_t n, clen = 0;
+	u32 crc = ~0U, total = len;
+	z_stream s = { .workspace = cache_gzip_ws };
+
+	if (tfw_cache_gzip_out(TFW_CACHE_GZIP_HDR,
+			       sizeof(TFW_CACHE_GZIP_HDR) - 1, &clen, max,
+			       dst, p))
+		return 0;
+
+	/* Raw deflate stream, the gzip header and trailer are ours. */
+	if (zlib_deflateInit2(&s, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+			      -MAX_WBITS, MAX_MEM_LEVEL,
+			      Z_DEFAULT_STRATEGY) != Z_OK)
+		return 0;
+
+	do {
+		if (!s.avail_in && len) {
+			while (data == trec->data + trec->len) {
+				trec = TDB_PTR(db->hdr,
+					       TDB_DI2O(trec->chunk_next));
+				data = trec->data;
+			}
+			n = min_t(size_t, trec->data + trec->len - data, len);
+			crc = crc32_le(crc, data, n);
+			s.next_in = data;
+			s.avail_in = n;
+			data += n;
+			len -= n;
+		}
+		s.next_out = buf;
+		s.avail_out = PAGE_SIZE;
+		r = zlib_deflate(&s, len || s.avail_in ? Z_NO_FLUSH : Z_FINISH);
+		if (r != Z_OK && r != Z_STREAM_END)
+			goto err;
+		if (tfw_cache_gzip_out(buf, PAGE_SIZE - s.avail_out, &clen,
+				       max, dst, p))
+			goto err;
+		cond_resched();
+	} while (r != Z_STREAM_END);
+	zlib_deflateEnd(&s);
+
+	put_unaligned_le32(~crc, buf);
+	put_unaligned_le32(total, buf + 4);
+	if (tfw_cache_gzip_out(buf, TFW_CACHE_GZIP_TRAILER, &clen, max,
+			       dst, p))
+		return 0;
+
+	return clen;
+err:
+	zlib_deflateEnd(&s);
+	return 0;
+}
+
+/**
+ * Store gzip variant of entry @ce with @hdr_len bytes of stored headers if
+ * the response is compressible and the compressed body is smaller.
+ * The variant has no validators, conditional requests are answered from
+ * the identity entry.
+ * @return true if the variant is stored.
+ */
+static bool
+tfw_cache_gzip_store(TfwCacheEntry *ce, size_t hdr_len)
+{
+	bool r = false;
+	size_t n, clen;
+	unsigned long key = tfw_cache_gzip_key(ce->trec.key);
+	char *data, *hdrs, *buf, *p;
+	TfwCacheEntry *gz, cdata = { .flags = TFW_CE_F_GZIPPED };
+	TdbVRec *trec, *gtrec;
+	TfwStr s = { .ptr = NULL };
+
+	if (!cache_cfg.compress || ce->status != 200
+	    || (ce->flags & (TFW_CE_F_ADOPTED | TFW_CE_F_NEGATIVE
+			     | TFW_CE_F_HEAD | TFW_CE_F_FILLING
+			     | TFW_CE_F_CHUNKED))
+	    || ce->body_len < TFW_CACHE_GZIP_MIN
+	    || ce->body_len > TFW_CACHE_GZIP_MAX)
+		return false;
+
+	/* The stored headers are followed by the variant headers. */
+	hdrs = kmalloc(2 * hdr_len + TFW_CACHE_GZIP_HDRS_MAX, GFP_KERNEL);
+	if (!hdrs)
+		return false;
+	tfw_cache_entry_data(ce, &trec, &data);
+	tfw_cache_read(&trec, &data, hdrs, hdr_len);
+	tfw_cache_read(&trec, &data, NULL, 2);
+	if (!tfw_cache_gzip_hdrs_ok(hdrs, hdr_len))
+		goto out;
+
+	buf = (char *)__get_free_page(GFP_KERNEL);
+	if (!buf)
+		goto out;
+	mutex_lock(&cache_gzip_mtx);
+	/* Count the compressed body length for Content-Length first. */
+	clen = tfw_cache_gzip_body(trec, data, ce->body_len, buf,
+				   ce->body_len, NULL, NULL);
+	if (!clen)
+		goto out_unlock;
+	n = tfw_cache_gzip_hdrs(hdrs, hdr_len, clen, hdrs + hdr_len);
+
+	cdata.date = ce->date;
+	cdata.lifetime = ce->lifetime;
+	cdata.status = ce->status;
+
+	rcu_read_lock_bh();
+	gz = tdb_rec_get(db, key);
+	if (gz)
+		tfw_cache_entry_drop(gz);
+	rcu_read_unlock_bh();
+
+	gz = tfw_cache_entry_create(key, &cdata, 0);
+	if (!gz)
+		goto out_unlock;
+	gtrec = tdb_entry_add(db, (TdbVRec *)gz, n + clen);
+	if (!gtrec)
+		goto err;
+	p = gtrec->data;
+	tdb_rec_write_begin();
+	gz->hdrs = (char *)TDB_OFF(db->hdr, p);
+	tfw_cache_entry_written(gz);
+	s.ptr = hdrs + hdr_len;
+	s.len = n;
+	if (tfw_cache_copy_str(&p, &gtrec, &s, n + clen) != n)
+		goto err;
+	if (tfw_cache_gzip_body(trec, data, ce->body_len, buf, clen,
+				&gtrec, &p) != clen)
+		goto err;
+	tdb_rec_write_begin();
+	gz->body_len = clen;
+	/* Readers don't use the entry until @hdr_len is set. */
+	smp_wmb();
+	gz->hdr_len = n - 2;
+	tfw_cache_entry_written(gz);
+	r = true;
+	goto out_unlock;
+err:
+	tdb_rec_remove(db, gz);
+out_unlock:
+	mutex_unlock(&cache_gzip_mtx);
+	free_page((unsigned long)buf);
+out:
+	kfree(hdrs);
+	return r;
+}
+
+/**
+ * Work to copy response skbs to database mapped area.
+ * The response is copied as is, so the stored response contains all
+ * the headers sent by upstream server.
+ *
+ * It's nasty to copy data on CPU, but we can't use DMA for mmaped file
+ * as well as for unaligned memory areas. So if zero-copy mode is enabled,
+ * then only the status line and headers are copied, while paged fragments
+ * of the response body are adopted by reference and only linear body data
+ * is copied to new pages, see tfw_cache_adopt_body().
+ */
+static void
+tfw_cache_copy_resp(struct work_struct *work)
+{
+	TfwCWork *cw = (TfwCWork *)work;
+	TfwCacheEntry *ce = cw->cw_ce;
+	TfwHttpResp *resp = cw->cw_resp;
+	TfwCacheCopyCtx ctx = { .crlf = resp->crlf, .len = resp->msg.len };
+	unsigned long key = cw->cw_key;
+	struct sk_buff *skb;
+	bool adopt, gzip;
+	u64 start = local_clock();
+
+	BUG_ON(!resp);
+
+	ctx.hdrs_only = ce->flags & (TFW_CE_F_NEGATIVE | TFW_CE_F_HEAD);
+	adopt = !ctx.hdrs_only && tfw_cache_adoptable(resp);
+	/* Response to HEAD has no body regardless of Content-Length. */
+	if ((adopt || ctx.hdrs_only) && !(resp->flags & TFW_HTTP_VOID_BODY))
+		ctx.len -= resp->content_length;
+	/* Chunked body of negative response is also skipped. */
 
-	/* See tfw_cache_copy_resp(). */
-	BUG_ON((char *)(trec + 1) + trec->len <= ce->hdrs);
+	/* Try to place the cached response in single memory chunk. */
+	ctx.trec = tdb_entry_add(db, (TdbVRec *)ce, ctx.len);
+	if (!ctx.trec) {
+		TFW_WARN("Cannot allocate memory to cache HTTP response."
+			 " Probably TDB cache is exhausted.\n");
+		/* Demote the response if it's a plain one. */
+		if (!ctx.hdrs_only && ce->trec.key == key)
+			tfw_cache_cold_store(resp, key, ce->date,
+					     ce->lifetime);
+		goto err;
+	}
+	ctx.p = ctx.trec->data;
+	tdb_rec_write_begin();
+	ce->hdrs = (char *)TDB_OFF(db->hdr, ctx.p);
+	tfw_cache_entry_written(ce);
 
-	trec = TDB_PTR(db->hdr, TDB_DI2O(trec->chunk_next));
-	for (data = ce->hdrs;
-	     (long)trec != (long)db->hdr;
-	     trec = TDB_PTR(db->hdr, TDB_DI2O(trec->chunk_next)),
-		data = trec->data)
+	for (skb = ss_skb_peek(&resp->msg.skb_list); skb && ctx.len;
+	     skb = ss_skb_next(&resp->msg.skb_list, skb))
 	{
-		int off, size = trec->len;
+		if (tfw_cache_copy_skb(&ctx, skb)) {
+			TFW_ERR("Cache: cannot copy HTTP response\n");
+			goto err;
+		}
+	}
+	if (ctx.len || !ctx.hdr_len) {
+		TFW_ERR("Cache: bad HTTP response layout\n");
+		goto err;
+	}
 
-		if (!skb || f == MAX_SKB_FRAGS) {
-			/* Protocol headers are placed in linear data only. */
-			skb = alloc_skb(SKB_HDR_SZ, GFP_ATOMIC);
-			if (!skb)
-				goto err_skb;
-			skb_reserve(skb, SKB_HDR_SZ);
-			ss_skb_queue_tail(&ce->resp->msg.skb_list, skb);
-			f = 0;
+	if (adopt) {
+		if (ctx.copied != ctx.hdr_len + 2) {
+			TFW_ERR("Cache: bad HTTP response layout\n");
+			goto err;
+		}
+		tdb_rec_write_begin();
+		ce->body_len = resp->content_length;
+		tfw_cache_entry_written(ce);
+		if (tfw_cache_adopt_body(ce, resp, ctx.hdr_len,
+					 ctx.copied)) {
+			TFW_ERR("Cache: cannot adopt HTTP response body\n");
+			goto err;
 		}
+	} else {
+		/* Skip CRLF between the headers and the body. */
+		tdb_rec_write_begin();
+		ce->body_len = ctx.copied - ctx.hdr_len - 2;
+		tfw_cache_entry_written(ce);
+	}
+	gzip = tfw_cache_gzip_store(ce, ctx.hdr_len);
+	tdb_rec_write_begin();
+	if (gzip)
+		ce->flags |= TFW_CE_F_GZIP;
+	/* Readers don't use the entry until @hdr_len is set. */
+	smp_wmb();
+	ce->hdr_len = ctx.hdr_len;
+	tfw_cache_entry_written(ce);
+	tfw_cache_stat_inc(TFW_CACHE_STAT_FILLS);
+	tfw_cache_stat_time(TFW_CACHE_HIST_FILL, start);
+	goto out;
+err:
+	/*
+	 * The entry isn't used by readers w/o @hdr_len.
+	 * FIXME all allocated TDB blocks are leaked here.
+	 */
+	tdb_rec_remove(db, ce);
+	tfw_cache_uri_remove(ce->trec.key);
+	tfw_cache_stat_inc(TFW_CACHE_STAT_FILL_ERRS);
+out:
+	/* Process requests waiting for the response. */
+	tfw_cache_fetch_done(key);
+	tfw_http_msg_free((TfwHttpMsg *)resp);
+	kmem_cache_free(c_cache, cw);
+}
 
-		off = (unsigned long)data & ~PAGE_MASK;
-		size = (char *)(trec + 1) + trec->len - data;
+/**
+ * Get configured freshness lifetime of negatively cached responses with
+ * status code @status or zero if such responses aren't cached negatively.
+ */
+static inline unsigned int
+tfw_cache_neg_ttl(unsigned short status)
+{
+	if (status < TFW_CACHE_NEG_MIN || status > TFW_CACHE_NEG_MAX)
+		return 0;
+	return cache_cfg.neg_ttl[status - TFW_CACHE_NEG_MIN];
+}
+
+/**
+ * Calculate freshness lifetime of @resp received at @now, RFC 7234 4.2.1.
+ * Date header isn't parsed, so Expires is compared with the receiving time.
+ */
+unsigned int
+tfw_cache_lifetime(TfwHttpResp *resp, unsigned long now)
+{
+	TfwCacheControl *cc = &resp->cache_ctl;
+	unsigned int lifetime, neg_ttl = tfw_cache_neg_ttl(resp->status);
+
+	if (cc->flags & TFW_HTTP_CC_S_MAXAGE)
+		lifetime = cc->s_maxage;
+	else if (cc->flags & TFW_HTTP_CC_MAX_AGE)
+		lifetime = cc->max_age;
+	else if (resp->expires)
+		lifetime = resp->expires > now ? resp->expires - now : 0;
+	else
+		/* Heuristic freshness, RFC 7234 4.2.2. */
+		lifetime = neg_ttl ? neg_ttl : cache_cfg.default_ttl;
+
+	/* Error responses are cached for short time only. */
+	return neg_ttl ? min(lifetime, neg_ttl) : lifetime;
+}
+DEBUG_EXPORT_SYMBOL(tfw_cache_lifetime);
+
+/**
+ * Whether response @resp to request @req can be stored, RFC 7234 3.
+ * Responses which must be validated before each use aren't stored.
+ */
+bool
+tfw_cache_storable(TfwHttpReq *req, TfwHttpResp *resp)
+{
+	if ((req->method != TFW_HTTP_METH_GET
+	     && req->method != TFW_HTTP_METH_HEAD) || !resp->crlf)
+		return false;
+	if ((req->cache_ctl.flags | resp->cache_ctl.flags)
+	    & TFW_HTTP_CC_NO_STORE)
+		return false;
+	if (resp->cache_ctl.flags
+	    & (TFW_HTTP_CC_PRIVATE | TFW_HTTP_CC_NO_CACHE))
+		return false;
+
+	/* Status codes cacheable by default, RFC 7231 6.1. */
+	switch (resp->status) {
+	case 200: case 203: case 204: case 300: case 301:
+	case 404: case 405: case 410: case 414: case 501:
+		return true;
+	default:
+		return tfw_cache_neg_ttl(resp->status);
+	}
+}
+DEBUG_EXPORT_SYMBOL(tfw_cache_storable);
+
+/**
+ * Copy ETag and Last-Modified values of @resp and status line and headers
+ * of 304 response for the entry @ce to @buf following @ce.
+ * @return length of the copied data or zero if @resp has no validators or
+ * they don't fit TFW_CACHE_VALIDATORS_MAX bytes.
+ */
+static size_t
+tfw_cache_validators_copy(TfwCacheEntry *ce, TfwHttpResp *resp, char *buf)
+{
+	int i;
+	size_t n, room = TFW_CACHE_VALIDATORS_MAX;
+	char *nm, *p = buf;
+
+	ce->etag_len = tfw_http_msg_hdr_val((TfwHttpMsg *)resp, "etag", 4,
+					    p, room);
+	p += ce->etag_len;
+	room -= ce->etag_len;
+	ce->lm_len = tfw_http_msg_hdr_val((TfwHttpMsg *)resp, "last-modified",
+					  13, p, room);
+	p += ce->lm_len;
+	room -= ce->lm_len;
+	if (!ce->etag_len && !ce->lm_len)
+		return 0;
+
+	if (room < sizeof(TFW_CACHE_NM_STATUS))
+		goto no_room;
+	nm = p;
+	memcpy(p, TFW_CACHE_NM_STATUS, sizeof(TFW_CACHE_NM_STATUS) - 1);
+	p += sizeof(TFW_CACHE_NM_STATUS) - 1;
+	room -= sizeof(TFW_CACHE_NM_STATUS) - 1;
+
+	for (i = 0; i < ARRAY_SIZE(tfw_cache_nm_hdrs); ++i) {
+		TfwStr *hdr = tfw_http_msg_hdr_find((TfwHttpMsg *)resp,
+						    tfw_cache_nm_hdrs[i].name,
+						    tfw_cache_nm_hdrs[i].len);
+		if (!hdr)
+			continue;
+		/* The header, CRLF and terminating zero. */
+		if (tfw_str_len(hdr) + 3 > room)
+			goto no_room;
+		n = tfw_str_to_cstr(hdr, p, room);
+		p[n++] = '\r';
+		p[n++] = '\n';
+		p += n;
+		room -= n;
+	}
+	ce->nm_len = p - nm;
+
+	return p - buf;
+no_room:
+	ce->etag_len = ce->lm_len = 0;
+	return 0;
+}
+
+/**
+ * Normalize comma separated list @s of length @len in place: remove spaces
+ * and lowercase the characters.
+ * @return length of the normalized list.
+ */
+static size_t
+tfw_cache_vary_normalize(char *s, size_t len)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < len; ++i)
+		if (!isspace(s[i]))
+			s[n++] = tolower(s[i]);
+
+	return n;
+}
+
+/**
+ * Copy normalized list of request header names from Vary header of @resp
+ * to @buf of size @size.
+ * @return length of the list, zero if there is no Vary header or negative
+ * value if the response can't be cached because of Vary.
+ */
+static int
+tfw_cache_vary_names(TfwHttpResp *resp, char *buf, size_t size)
+{
+	size_t n;
+
+	if (!tfw_http_msg_hdr_find((TfwHttpMsg *)resp, "vary", 4))
+		return 0;
+
+	n = tfw_http_msg_hdr_val((TfwHttpMsg *)resp, "vary", 4, buf, size);
+	n = tfw_cache_vary_normalize(buf, n);
+	if (!n)
+		return -EINVAL;
+
+	/* "*" never matches any request, RFC 7234 4.1. */
+	if ((n == 1 && *buf == '*') || strnstr(buf, ",*", n)
+	    || (buf[0] == '*' && buf[1] == ','))
+		return -EINVAL;
+
+	return n;
+}
+
+/**
+ * Calculate secondary key for @req by primary key @key and normalized values
+ * of request headers listed in @vary of length @len.
+ * @return true on success and false if the request headers are too long.
+ */
+static bool
+tfw_cache_vary_key(TfwHttpReq *req, unsigned long key, const char *vary,
+		   size_t len, unsigned long *skey)
+{
+	size_t n, v_len, room = TFW_CACHE_VARY_MAX;
+	const char *name, *end = vary + len;
+	char *buf, *p;
+	TfwStr vals = {};
+
+	p = buf = tfw_pool_alloc(req->pool, TFW_CACHE_VARY_MAX);
+	if (!buf)
+		return false;
+
+	for (name = vary; name < end; name += n + 1) {
+		const char *c = memchr(name, ',', end - name);
+		n = (c ? c : end) - name;
+		/* Header name, separator and at least terminating zero. */
+		if (n + 2 > room)
+			return false;
+		memcpy(p, name, n);
+		p[n] = ':';
+		p += n + 1;
+		room -= n + 1;
+
+		/* Absent header gives empty value. */
+		if (!tfw_http_msg_hdr_find((TfwHttpMsg *)req, name, n))
+			continue;
+		v_len = tfw_http_msg_hdr_val((TfwHttpMsg *)req, name, n, p,
+					     room);
+		if (!v_len)
+			return false;
+		v_len = tfw_cache_vary_normalize(p, v_len);
+		p += v_len;
+		room -= v_len;
+	}
+
+	vals.ptr = buf;
+	vals.len = p - buf;
+	*skey = key ^ tfw_hash_str(&vals);
+	/* The secondary key must differ from the primary one. */
+	if (unlikely(*skey == key))
+		*skey = ~key;
+
+	return true;
+}
+
+/**
+ * Make sure that primary entry for @key keeps Vary header list @vary
+ * of length @len, so the variants can be found.
+ */
+static int
+tfw_cache_vary_primary(TfwHttpResp *resp, unsigned long key,
+		       const char *vary, size_t len)
+{
+	TfwCacheEntry *ce, *cdata;
+
+	ce = tdb_rec_get(db, key);
+	if (ce) {
+		bool same = ce->vary_len == len
+			    && !memcmp(TFW_CE_VARY(ce), vary, len);
+		/*
+		 * Replace non-varying response or another Vary list.
+		 * Variants of the previous list just become unreachable.
+		 */
+		if (same) {
+			tdb_rec_put(ce);
+			return 0;
+		}
+		tfw_cache_entry_drop(ce);
+	}
+
+	cdata = tfw_pool_alloc(resp->pool, sizeof(*cdata) + len);
+	if (!cdata)
+		return -ENOMEM;
+	memset(cdata, 0, sizeof(*cdata));
+	cdata->vary_len = len;
+	memcpy(TFW_CE_VARY(cdata), vary, len);
+
+	ce = tfw_cache_entry_create(key, cdata, len);
+
+	return ce ? 0 : -ENOMEM;
+}
+
+/* Maximum length of indexed URI including terminating zero. */
+#define TFW_CACHE_URI_MAX	1024
+#define TFW_CACHE_URI_HASH_BITS	12
+
+/*
+ * Node of ordered index of cached URIs used to purge entries by URI prefix.
+ * The URI is lowercased Host header value followed by URI path, @key is
+ * the primary key of the URI entry. Nodes are also hashed by @key in
+ * @hentry, so they're removed with the entries, see tfw_cache_uri_remove().
+ * Nodes removed from the index are linked into purge list by @list.
+ *
+ * Each cache entry takes at least TDB_HTRIE_MINDREC bytes of the table, so
+ * the index keeps not more nodes than the table can keep entries.
+ */
+typedef struct {
+	union {
+		struct rb_node		node;
+		struct list_head	list;
+	};
+	struct hlist_node	hentry;
+	unsigned long		key;
+	unsigned int		len;
+	char			uri[0];
+} TfwCacheUri;
+
+/* Work to remove entries of URIs detached from the index. */
+typedef struct {
+	struct work_struct	work;
+	struct list_head	uris;
+} TfwCachePurge;
+
+static struct rb_root cache_uri_index = RB_ROOT;
+static struct hlist_head cache_uri_hash[1 << TFW_CACHE_URI_HASH_BITS];
+static unsigned long cache_uri_n;
+/* Protects the index, i.e. @cache_uri_index and @cache_uri_hash. */
+static DEFINE_SPINLOCK(cache_uri_lock);
+
+/**
+ * Write URI of @req to @buf of size TFW_CACHE_URI_MAX.
+ * @return length of the URI or zero if it's too long.
+ */
+static size_t
+tfw_cache_req_uri(TfwHttpReq *req, char *buf)
+{
+	size_t i, n = 0, len;
+	char *v, *end;
+	TfwStr *host = &req->h_tbl->tbl[TFW_HTTP_HDR_HOST].field;
+
+	if (host->ptr) {
+		if (tfw_str_len(host) >= TFW_CACHE_URI_MAX)
+			return 0;
+		n = tfw_str_to_cstr(host, buf, TFW_CACHE_URI_MAX);
+		v = memchr(buf, ':', n);
+		v = v ? v + 1 : buf;
+		for (end = buf + n; v < end && isspace(*v); ++v)
+			;
+		while (end > v && isspace(end[-1]))
+			--end;
+		n = end - v;
+		for (i = 0; i < n; ++i)
+			buf[i] = tolower(v[i]);
+	}
+
+	len = tfw_str_len(&req->uri_path);
+	if (n + len >= TFW_CACHE_URI_MAX)
+		return 0;
+	tfw_str_to_cstr(&req->uri_path, buf + n, TFW_CACHE_URI_MAX - n);
+
+	return n + len;
+}
+
+static int
+tfw_cache_uri_cmp(const TfwCacheUri *u, const char *uri, size_t len)
+{
+	int r = memcmp(u->uri, uri, min_t(size_t, u->len, len));
+
+	if (r)
+		return r;
+	return u->len < len ? -1 : u->len > len;
+}
+
+/**
+ * Find the first index node with URI not less than @uri of length @len.
+ * Must be called under cache_uri_lock.
+ */
+static struct rb_node *
+tfw_cache_uri_lower_bound(const char *uri, size_t len)
+{
+	struct rb_node *n = cache_uri_index.rb_node, *lb = NULL;
+
+	while (n) {
+		TfwCacheUri *u = rb_entry(n, TfwCacheUri, node);
+		if (tfw_cache_uri_cmp(u, uri, len) >= 0) {
+			lb = n;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+
+	return lb;
+}
+
+static inline struct hlist_head *
+tfw_cache_uri_bucket(unsigned long key)
+{
+	return &cache_uri_hash[hash_min(key, TFW_CACHE_URI_HASH_BITS)];
+}
+
+/**
+ * Detach node @u from the index. Must be called under cache_uri_lock.
+ */
+static void
+__tfw_cache_uri_detach(TfwCacheUri *u)
+{
+	hlist_del(&u->hentry);
+	rb_erase(&u->node, &cache_uri_index);
+	--cache_uri_n;
+}
+
+/**
+ * Add URI @uri of length @len with primary key @key to the index.
+ */
+static void
+tfw_cache_uri_insert(const char *uri, size_t len, unsigned long key)
+{
+	int cmp;
+	TfwCacheUri *u;
+	struct rb_node **p = &cache_uri_index.rb_node, *parent = NULL;
+
+	spin_lock_bh(&cache_uri_lock);
+
+	while (*p) {
+		parent = *p;
+		u = rb_entry(parent, TfwCacheUri, node);
+		cmp = tfw_cache_uri_cmp(u, uri, len);
+		if (cmp > 0) {
+			p = &parent->rb_left;
+		} else if (cmp < 0) {
+			p = &parent->rb_right;
+		} else {
+			hlist_del(&u->hentry);
+			u->key = key;
+			hlist_add_head(&u->hentry, tfw_cache_uri_bucket(key));
+			goto out;
+		}
+	}
+
+	/* The URI can't be purged by prefix, but by exact URI only. */
+	if (cache_uri_n >= cache_cfg.db_size / TDB_HTRIE_MINDREC)
+		goto out;
+	u = kmalloc(sizeof(*u) + len, GFP_ATOMIC);
+	if (!u)
+		goto out;
+	u->key = key;
+	u->len = len;
+	memcpy(u->uri, uri, len);
+	rb_link_node(&u->node, parent, p);
+	rb_insert_color(&u->node, &cache_uri_index);
+	hlist_add_head(&u->hentry, tfw_cache_uri_bucket(key));
+	++cache_uri_n;
+out:
+	spin_unlock_bh(&cache_uri_lock);
+}
+
+/**
+ * Remove all the index nodes of entry with key @key.
+ * Keys of entries w/o indexed URIs, e.g. secondary keys, just aren't found.
+ */
+static void
+tfw_cache_uri_remove(unsigned long key)
+{
+	TfwCacheUri *u;
+	struct hlist_node *tmp;
+
+	spin_lock_bh(&cache_uri_lock);
+	hlist_for_each_entry_safe(u, tmp, tfw_cache_uri_bucket(key), hentry)
+		if (u->key == key) {
+			__tfw_cache_uri_detach(u);
+			kfree(u);
+		}
+	spin_unlock_bh(&cache_uri_lock);
+}
+
+static void
+tfw_cache_uri_add(TfwHttpReq *req, unsigned long key)
+{
+	size_t len;
+	char *uri;
+
+	uri = tfw_pool_alloc(req->pool, TFW_CACHE_URI_MAX);
+	if (!uri)
+		return;
+	len = tfw_cache_req_uri(req, uri);
+	if (len)
+		tfw_cache_uri_insert(uri, len, key);
+}
+
+static void
+tfw_cache_uri_cleanup(void)
+{
+	struct rb_node *n;
+
+	spin_lock_bh(&cache_uri_lock);
+	while ((n = rb_first(&cache_uri_index))) {
+		TfwCacheUri *u = rb_entry(n, TfwCacheUri, node);
+		__tfw_cache_uri_detach(u);
+		kfree(u);
+	}
+	spin_unlock_bh(&cache_uri_lock);
+}
+
+/**
+ * Update stored response @ce by response @resp to HEAD request with
+ * validators in @cdata, RFC 7234 4.3.5. Full stored response is kept if
+ * the HEAD response has the same body length and validators.
+ * @return true if @ce is freshened and mustn't be replaced.
+ */
+static bool
+tfw_cache_head_freshen(TfwCacheEntry *ce, TfwHttpResp *resp,
+		       TfwCacheEntry *cdata)
+{
+	if (!ACCESS_ONCE(ce->hdr_len))
+		return false;
+	smp_rmb();
+	if (ce->flags & (TFW_CE_F_HEAD | TFW_CE_F_NEGATIVE | TFW_CE_F_FILLING)
+	    || (cdata->flags & TFW_CE_F_NEGATIVE)
+	    || (resp->flags & TFW_HTTP_CHUNKED)
+	    || resp->content_length != ce->body_len)
+		return false;
+	if (ce->etag_len != cdata->etag_len || ce->lm_len != cdata->lm_len
+	    || memcmp(TFW_CE_ETAG(ce), TFW_CE_ETAG(cdata),
+		      ce->etag_len + ce->lm_len))
+		return false;
+
+	tdb_rec_write_begin();
+	ce->lifetime = cdata->lifetime;
+	ce->date = cdata->date;
+	tfw_cache_entry_written(ce);
+	tfw_cache_entry_release(ce);
+
+	return true;
+}
+
+/**
+ * Create cache entry for response @resp to @req with primary key @key.
+ * The entry has the key and validators only, so readers don't use it until
+ * @hdr_len is set.
+ * @return the entry or NULL if the response isn't stored.
+ */
+static TfwCacheEntry *
+tfw_cache_entry_new(TfwHttpResp *resp, TfwHttpReq *req, unsigned long key)
+{
+	int vary_len;
+	TfwCacheEntry *ce, *cdata;
+	unsigned long ckey = key, now = get_seconds();
+	size_t len = 0;
+	char *vary;
+
+	if (!tfw_cache_storable(req, resp))
+		return NULL;
+
+	/* The entry and its validators are written to the record at once. */
+	cdata = tfw_pool_alloc(resp->pool, sizeof(*cdata)
+					   + TFW_CACHE_VALIDATORS_MAX);
+	if (!cdata)
+		return NULL;
+	memset(cdata, 0, sizeof(*cdata));
+
+	cdata->date = now;
+	cdata->status = resp->status;
+	cdata->lifetime = tfw_cache_lifetime(resp, now);
+	if (!cdata->lifetime)
+		return NULL;
+	/* Negative entries are never validated. */
+	if (tfw_cache_neg_ttl(resp->status))
+		cdata->flags |= TFW_CE_F_NEGATIVE;
+	else
+		len = tfw_cache_validators_copy(cdata, resp,
+						TFW_CE_ETAG(cdata));
+	if (req->method == TFW_HTTP_METH_HEAD)
+		cdata->flags |= TFW_CE_F_HEAD;
+	if (resp->flags & TFW_HTTP_CHUNKED)
+		cdata->flags |= TFW_CE_F_CHUNKED;
+
+	if (!tfw_cache_admit(key))
+		return NULL;
+
+	/* Varying response is stored as a variant under secondary key. */
+	vary = tfw_pool_alloc(resp->pool, TFW_CACHE_VARY_MAX);
+	if (!vary)
+		return NULL;
+	vary_len = tfw_cache_vary_names(resp, vary, TFW_CACHE_VARY_MAX);
+	if (vary_len < 0)
+		return NULL;
+	if (vary_len) {
+		if (tfw_cache_vary_primary(resp, key, vary, vary_len))
+			return NULL;
+		if (!tfw_cache_vary_key(req, key, vary, vary_len, &ckey))
+			return NULL;
+	}
+
+	/* The new response replaces the stored one. */
+	ce = tdb_rec_get(db, ckey);
+	if (ce) {
+		bool fresh = req->method == TFW_HTTP_METH_HEAD
+			     && tfw_cache_head_freshen(ce, resp, cdata);
+		if (fresh) {
+			tdb_rec_put(ce);
+			return NULL;
+		}
+		tfw_cache_entry_drop(ce);
+	}
+
+	/* TODO copy at least first part of URI here. */
+
+	ce = tfw_cache_entry_create(ckey, cdata, len);
+	if (!ce)
+		return NULL;
+
+	/*
+	 * We must write the entry key now because the request dies
+	 * when the response is written.
+	 */
+	if (tfw_cache_entry_key_copy(ce, req)) {
+		tdb_rec_remove(db, ce);
+		return NULL;
+	}
+	tfw_cache_uri_add(req, key);
+
+	return ce;
+}
+
+/**
+ * Send body of @ce up to @end to client @t.
+ * @return false if the client can't get the body.
+ */
+static bool
+tfw_cache_tail_send(TfwCacheEntry *ce, TfwCacheTail *t, unsigned long end)
+{
+	TfwHttpResp *resp;
+
+	if (t->sent >= end)
+		return true;
+	if (sock_flag(t->sk, SOCK_DEAD) || t->sk->sk_state != TCP_ESTABLISHED)
+		return false;
+
+	resp = tfw_cache_body_resp(ce, t->sent, end - t->sent);
+	if (!resp)
+		return false;
+	ss_send(t->sk, &resp->msg.skb_list);
+	tfw_http_msg_free((TfwHttpMsg *)resp);
+	t->sent = end;
+
+	return true;
+}
+
+/**
+ * Release client @t of the filled entry. The client connection is closed
+ * if the client didn't get the whole body, so it doesn't wait for the rest
+ * of the response forever.
+ */
+static void
+tfw_cache_tail_free(TfwCacheTail *t, bool done)
+{
+	if (done)
+		sock_put(t->sk);
+	else
+		ss_close(t->sk);
+	kfree(t);
+}
+
+static TfwCacheFetchBucket *
+tfw_cache_fill_bucket(TfwCacheFill *fill)
+{
+	return &fetch_hash[hash_min(fill->key, TFW_CACHE_FETCH_HASH_BITS)];
+}
+
+/**
+ * Make the filled entry available for clients of following requests.
+ */
+static void
+tfw_cache_fill_link(TfwCacheFill *fill)
+{
+	TfwCacheFetchBucket *b = tfw_cache_fill_bucket(fill);
+
+	spin_lock_bh(&b->lock);
+	hlist_add_head(&fill->hentry, &b->fills);
+	spin_unlock_bh(&b->lock);
+}
+
+/**
+ * Move clients which joined the filled entry to the fill readers and also
+ * unlink the fill if @unlink is true, so no more clients join it.
+ */
+static void
+tfw_cache_fill_readers(TfwCacheFill *fill, bool unlink)
+{
+	TfwCacheFetchBucket *b = tfw_cache_fill_bucket(fill);
+
+	spin_lock_bh(&b->lock);
+	if (unlink && !hlist_unhashed(&fill->hentry))
+		hlist_del_init(&fill->hentry);
+	list_splice_tail_init(&fill->tails, &fill->readers);
+	spin_unlock_bh(&b->lock);
+}
+
+/**
+ * Send the written body part to clients of the filled entry.
+ */
+static void
+tfw_cache_fill_send(TfwCacheFill *fill)
+{
+	TfwCacheTail *t, *tmp;
+	unsigned long filled = fill->ce->filled;
+
+	tfw_cache_fill_readers(fill, false);
+	list_for_each_entry_safe(t, tmp, &fill->readers, list) {
+		if (tfw_cache_tail_send(fill->ce, t, filled))
+			continue;
+		list_del(&t->list);
+		tfw_cache_tail_free(t, false);
+	}
+}
+
+/**
+ * Unlink the filled entry and send the rest of the body to its clients if
+ * the entry is completed, @done is true, or close the clients connections.
+ */
+static void
+tfw_cache_fill_release(TfwCacheFill *fill, bool done)
+{
+	TfwCacheEntry *ce = fill->ce;
+	TfwCacheTail *t, *tmp;
+
+	tfw_cache_fill_readers(fill, true);
+	list_for_each_entry_safe(t, tmp, &fill->readers, list) {
+		list_del(&t->list);
+		tfw_cache_tail_free(t, done && tfw_cache_tail_send(ce, t,
+								ce->body_len));
+	}
+}
+
+/**
+ * Copy skbs of the filled response @resp received since the previous call.
+ */
+static int
+tfw_cache_fill_copy(TfwCacheFill *fill, TfwHttpResp *resp)
+{
+	struct sk_buff *skb;
+
+	skb = fill->skb ? ss_skb_next(&resp->msg.skb_list, fill->skb)
+			: ss_skb_peek(&resp->msg.skb_list);
+	for ( ; skb && fill->ctx.len;
+	     skb = ss_skb_next(&resp->msg.skb_list, skb))
+	{
+		if (tfw_cache_copy_skb(&fill->ctx, skb))
+			return -ENOMEM;
+		fill->skb = skb;
+	}
+
+	return 0;
+}
+
+/**
+ * Make the copied data of the filled entry visible for readers: the entry
+ * is found by readers when the headers are written and the following
+ * requests get already written body part.
+ */
+static void
+tfw_cache_fill_publish(TfwCacheFill *fill)
+{
+	TfwCacheEntry *ce = fill->ce;
+	TfwCacheCopyCtx *ctx = &fill->ctx;
+
+	if (ctx->copied < ctx->hdr_len + 2)
+		return;
+
+	/* Readers check @hdr_len and @filled before the data. */
+	smp_wmb();
+	if (!ce->hdr_len) {
+		tdb_rec_write_begin();
+		ce->hdr_len = ctx->hdr_len;
+		tfw_cache_entry_written(ce);
+	}
+	ACCESS_ONCE(ce->filled) = ctx->copied - ctx->hdr_len - 2;
+}
+
+/**
+ * Remove the filled entry since the response can't be written.
+ * Clients which got a part of the entry body are disconnected.
+ */
+static void
+tfw_cache_fill_drop(TfwCacheFill *fill)
+{
+	tfw_cache_fill_release(fill, false);
+	tdb_rec_remove(db, fill->ce);
+	tfw_cache_uri_remove(fill->ce->trec.key);
+	fill->ce = NULL;
+}
+
+/**
+ * Start writing response @resp to @req with received headers to the cache.
+ */
+static int
+tfw_cache_fill_start(TfwCacheFill *fill, TfwHttpResp *resp,
+		     TfwHttpReq *req)
+{
+	TfwCacheEntry *ce;
+	TfwCacheCopyCtx *ctx = &fill->ctx;
+
+	fill->key = tfw_cache_key_calc(req);
+	ce = tfw_cache_entry_new(resp, req, fill->key);
+	if (!ce)
+		return 0;
+	tdb_rec_write_begin();
+	ce->flags |= TFW_CE_F_FILLING;
+	ce->body_len = resp->content_length;
+	tfw_cache_entry_written(ce);
+	fill->ce = ce;
+
+	/*
+	 * Copy all the received data: the headers and probably first part
+	 * of the body. The message length isn't known until the headers
+	 * are copied, so next chunks are allocated for the rest of the body.
+	 */
+	ctx->crlf = resp->crlf;
+	ctx->len = resp->msg.len;
+	ctx->trec = tdb_entry_add(db, (TdbVRec *)ce, ctx->len);
+	if (!ctx->trec) {
+		TFW_WARN("Cannot allocate memory to cache HTTP response."
+			 " Probably TDB cache is exhausted.\n");
+		return -ENOMEM;
+	}
+	ctx->p = ctx->trec->data;
+	tdb_rec_write_begin();
+	ce->hdrs = (char *)TDB_OFF(db->hdr, ctx->p);
+	tfw_cache_entry_written(ce);
+
+	if (tfw_cache_fill_copy(fill, resp)) {
+		TFW_ERR("Cache: cannot copy HTTP response\n");
+		return -ENOMEM;
+	}
+	if (!ctx->hdr_len
+	    || ctx->copied > ctx->hdr_len + 2 + ce->body_len)
+	{
+		TFW_ERR("Cache: bad HTTP response layout\n");
+		return -EINVAL;
+	}
+	ctx->len = ctx->hdr_len + 2 + ce->body_len - ctx->copied;
+	/* The skb with the headers end is the last one. */
+	fill->hdr_skb = fill->skb;
+
+	tfw_cache_fill_publish(fill);
+	tfw_cache_fill_link(fill);
+	/* Requests waiting for the response can use the entry now. */
+	tfw_cache_fetch_done(fill->key);
+
+	return 0;
+}
+
+/**
+ * Write next received part of response @resp to @req to the cache.
+ * Responses with known body length not less than cache_stream_min are
+ * written as they're received, so requests for the same resource can get
+ * ranges of already received body part and other requests get the written
+ * body part at once and the rest of the body as it's written
+ * (see tfw_cache_tail_join()).
+ *
+ * The function is called for each received response chunk, the response
+ * is completed by tfw_cache_add() or dropped by tfw_cache_fill_abort().
+ */
+void
+tfw_cache_fill(TfwHttpResp *resp, TfwHttpReq *req)
+{
+	TfwCacheFill *fill = resp->cache_fill;
+
+	if (!cache_cfg.cache || !cache_cfg.stream_min)
+		return;
+
+	if (!fill) {
+		/* Wait for the headers to decide whether to fill the cache. */
+		if (!resp->crlf)
+			return;
+		fill = tfw_pool_alloc(resp->pool, sizeof(*fill));
+		if (!fill)
+			return;
+		memset(fill, 0, sizeof(*fill));
+		INIT_HLIST_NODE(&fill->hentry);
+		INIT_LIST_HEAD(&fill->tails);
+		INIT_LIST_HEAD(&fill->readers);
+		resp->cache_fill = fill;
+
+		if ((resp->flags & (TFW_HTTP_CHUNKED | TFW_HTTP_VOID_BODY))
+		    || resp->content_length < cache_cfg.stream_min
+		    || tfw_cache_neg_ttl(resp->status))
+			return;
+		if (tfw_cache_fill_start(fill, resp, req))
+			goto err;
+		return;
+	}
+	if (!fill->ce)
+		return;
+
+	if (tfw_cache_fill_copy(fill, resp)) {
+		TFW_ERR("Cache: cannot copy HTTP response\n");
+		goto err;
+	}
+	tfw_cache_fill_publish(fill);
+	tfw_cache_fill_send(fill);
+	return;
+err:
+	tfw_cache_fill_drop(fill);
+	tfw_cache_stat_inc(TFW_CACHE_STAT_FILL_ERRS);
+}
+
+/**
+ * Drop the entry filled by response @resp which won't be completed.
+ */
+void
+tfw_cache_fill_abort(TfwHttpResp *resp)
+{
+	TfwCacheFill *fill = resp->cache_fill;
+	unsigned long key;
+
+	if (!fill || !fill->ce)
+		return;
+
+	key = fill->key;
+	tfw_cache_fill_drop(fill);
+	/* Requests waiting for the response are processed w/o it. */
+	tfw_cache_fetch_done(key);
+}
+
+/**
+ * Free body skbs of streamed response @resp which are already written to
+ * the cache and sent to the client, so large responses don't stay in memory
+ * until they're fully received. The skbs with the headers are kept for
+ * the response processing, as well as the last written and the last sent
+ * skbs since the next received skbs are written and sent after them.
+ */
+void
+tfw_cache_fill_free_skbs(TfwHttpResp *resp)
+{
+	TfwCacheFill *fill = resp->cache_fill;
+	SsSkbList *skb_list = &resp->msg.skb_list;
+	struct sk_buff *skb, *next;
+
+	if (!fill || !fill->ce || !(resp->flags & TFW_HTTP_STREAM)
+	    || !resp->stream_skb)
+		return;
+
+	for (skb = ss_skb_next(skb_list, fill->hdr_skb);
+	     skb && skb != fill->skb && skb != resp->stream_skb; skb = next)
+	{
+		next = ss_skb_next(skb_list, skb);
+		ss_skb_unlink(skb_list, skb);
+		kfree_skb(skb);
+	}
+}
+
+/**
+ * Whether the cache needs whole response @resp to @req before the response
+ * is sent to the client. Responses stored in the cache are copied when
+ * they're fully received, see tfw_cache_add(), while responses written to
+ * the cache as they're received are copied before the received parts are
+ * sent (see tfw_cache_fill()).
+ */
+bool
+tfw_cache_resp_buffered(TfwHttpResp *resp, TfwHttpReq *req)
+{
+	TfwCacheFill *fill = resp->cache_fill;
+
+	if (!cache_cfg.cache)
+		return false;
+	if (fill && fill->ce)
+		return false;
+
+	return tfw_cache_storable(req, resp);
+}
+
+/**
+ * Write the rest of fully received response @resp to the filled entry.
+ */
+static void
+tfw_cache_fill_finish(TfwHttpResp *resp, TfwHttpReq *req)
+{
+	TfwCacheFill *fill = resp->cache_fill;
+	TfwCacheEntry *ce = fill->ce;
+	u64 start = local_clock();
+
+	if (tfw_cache_fill_copy(fill, resp) || fill->ctx.len) {
+		TFW_ERR("Cache: cannot copy HTTP response\n");
+		tfw_cache_fill_drop(fill);
+		tfw_cache_stat_inc(TFW_CACHE_STAT_FILL_ERRS);
+	} else {
+		tfw_cache_fill_publish(fill);
+		/*
+		 * The whole body is visible for readers now, clients joining
+		 * the entry after it's unlinked send the rest of the body
+		 * by themselves.
+		 */
+		tdb_rec_write_begin();
+		ce->flags &= ~TFW_CE_F_FILLING;
+		tfw_cache_entry_written(ce);
+		tfw_cache_fill_release(fill, true);
+		tfw_cache_stat_inc(TFW_CACHE_STAT_FILLS);
+		tfw_cache_stat_time(TFW_CACHE_HIST_FILL, start);
+	}
+
+	/* Process requests waiting for the response. */
+	tfw_cache_fetch_done(fill->key);
+
+	tfw_http_msg_free((TfwHttpMsg *)req);
+	tfw_http_msg_free((TfwHttpMsg *)resp);
+}
+
+void
+tfw_cache_add(TfwHttpResp *resp, TfwHttpReq *req)
+{
+	TfwCWork *cw;
+	TfwCacheEntry *ce;
+	TfwCacheFill *fill = resp->cache_fill;
+	unsigned long key;
+
+	if (!cache_cfg.cache)
+		goto out;
+
+	/* The response has been written while it was received. */
+	if (fill && fill->ce) {
+		tfw_cache_fill_finish(resp, req);
+		return;
+	}
+
+	key = tfw_cache_key_calc(req);
+	ce = tfw_cache_entry_new(resp, req, key);
+	if (!ce) {
+		/* The response is freed by the work. */
+		if (tfw_cache_cold_demote(req, resp, key)) {
+			tfw_http_msg_free((TfwHttpMsg *)req);
+			return;
+		}
+		goto done;
+	}
+	/* The cold tier response is replaced by the new one. */
+	tfw_cache_cold_drop(key);
+
+	cw = kmem_cache_alloc(c_cache, GFP_ATOMIC);
+	if (!cw)
+		goto err_ce;
+	INIT_WORK(&cw->work, tfw_cache_copy_resp);
+	cw->cw_ce = ce;
+	cw->cw_resp = resp;
+	cw->cw_key = key;
+	queue_work_on(tfw_cache_sched_work_cpu(numa_node_id()), cache_wq,
+		      (struct work_struct *)cw);
+
+	/* The response is freed by the work. */
+	tfw_http_msg_free((TfwHttpMsg *)req);
+	return;
+err_ce:
+	tdb_rec_remove(db, ce);
+	tfw_cache_uri_remove(ce->trec.key);
+done:
+	/* Requests waiting for the response are processed w/o it. */
+	tfw_cache_fetch_done(key);
+out:
+	/* Now we don't need the request and the reponse anymore. */
+	tfw_http_msg_free((TfwHttpMsg *)req);
+	tfw_http_msg_free((TfwHttpMsg *)resp);
+}
+
+/**
+ * Build a response template from @ce with first @len bytes of the body
+ * that it can be sent via TCP socket.
+ *
+ * Cache entry body is set as paged fragments of skb.
+ * See do_tcp_sendpages() as reference.
+ *
+ * We return skbs in the cache entry response w/o setting any
+ * network headers - tcp_transmit_skb() will do it for us.
+ */
+static TfwHttpResp *
+tfw_cache_build_resp(TfwCacheEntry *ce, size_t len)
+{
+	TdbVRec *trec;
+	char *data;
+	TfwHttpResp *resp;
+
+	resp = tfw_cache_tmpl_alloc(ce, ce->hdr_len, &trec, &data);
+	if (!resp)
+		return NULL;
+
+	if (tfw_cache_resp_add_data(resp, trec, data, len)) {
+		tfw_http_msg_free((TfwHttpMsg *)resp);
+		return NULL;
+	}
+
+	return resp;
+}
+
+/**
+ * Allocate a response to a cache hit with linear data for @len bytes of
+ * headers and generated Age header in the first skb @skb.
+ */
+static TfwHttpResp *
+tfw_cache_resp_alloc(size_t len, struct sk_buff **skb)
+{
+	TfwHttpResp *resp;
+
+	resp = (TfwHttpResp *)tfw_http_msg_alloc(Conn_Srv);
+	if (!resp)
+		return NULL;
+
+	*skb = alloc_skb(SKB_HDR_SZ + len + TFW_CACHE_AGE_HDR_MAX, GFP_ATOMIC);
+	if (!*skb) {
+		tfw_http_msg_free((TfwHttpMsg *)resp);
+		return NULL;
+	}
+	skb_reserve(*skb, SKB_HDR_SZ);
+	ss_skb_queue_tail(&resp->msg.skb_list, *skb);
+
+	return resp;
+}
+
+/**
+ * Finish headers of @resp in @skb by Age header and the final CRLF.
+ * Stale responses are marked by Warning header, RFC 7234 5.5.1.
+ */
+static void
+tfw_cache_resp_age(TfwHttpResp *resp, struct sk_buff *skb, unsigned int age,
+		   bool stale)
+{
+	skb_put(skb, snprintf(skb_tail_pointer(skb), TFW_CACHE_AGE_HDR_MAX,
+			      "Age: %u\r\n%s\r\n", age,
+			      stale ? TFW_CACHE_STALE_HDR : ""));
+	resp->msg.len = skb->len;
+}
+
+/**
+ * Build 304 (Not Modified) response to a conditional request for @ce.
+ */
+static TfwHttpResp *
+tfw_cache_nm_resp(TfwCacheEntry *ce, unsigned int age)
+{
+	struct sk_buff *skb;
+	TfwHttpResp *resp;
+
+	resp = tfw_cache_resp_alloc(ce->nm_len, &skb);
+	if (!resp)
+		return NULL;
+
+	memcpy(skb_put(skb, ce->nm_len), TFW_CE_NM(ce), ce->nm_len);
+	tfw_cache_resp_age(resp, skb, age, age >= ce->lifetime);
+
+	return resp;
+}
+
+/**
+ * Build a response to HEAD request hitting @ce: only the headers of
+ * response template @body with generated Age header are sent.
+ */
+static TfwHttpResp *
+tfw_cache_head_resp(TfwCacheEntry *ce, TfwHttpResp *body, unsigned int age)
+{
+	struct sk_buff *skb, *b_skb = ss_skb_peek(&body->msg.skb_list);
+	TfwHttpResp *resp;
+
+	/* The template headers can differ from the stored ones. */
+	resp = tfw_cache_resp_alloc(b_skb->len, &skb);
+	if (!resp)
+		return NULL;
+
+	memcpy(skb_put(skb, b_skb->len), b_skb->data, b_skb->len);
+	tfw_cache_resp_age(resp, skb, age, age >= ce->lifetime);
+
+	return resp;
+}
+
+/**
+ * Build a response to a cache hit on @ce from response template @body
+ * built by tfw_cache_build_resp(): the template headers with generated Age
+ * header are copied to linear data of the first skb while the response body
+ * is shared with the template. The body skbs are cloned, so the response is
+ * independent from the template.
+ */
+static TfwHttpResp *
+tfw_cache_hit_resp(TfwCacheEntry *ce, TfwHttpResp *body, unsigned int age)
+{
+	struct sk_buff *skb, *b_skb;
+	TfwHttpResp *resp;
+
+	resp = tfw_cache_head_resp(ce, body, age);
+	if (!resp)
+		return NULL;
+
+	/* The first template skb keeps the headers only. */
+	b_skb = ss_skb_peek(&body->msg.skb_list);
+	for (b_skb = ss_skb_next(&body->msg.skb_list, b_skb); b_skb;
+	     b_skb = ss_skb_next(&body->msg.skb_list, b_skb))
+	{
+		skb = skb_clone(b_skb, GFP_ATOMIC);
+		if (!skb)
+			goto err;
+		/* The clone inherits links of @body skb list, reset them. */
+		TFW_SKB_CB(skb)->next = TFW_SKB_CB(skb)->prev = NULL;
+		ss_skb_queue_tail(&resp->msg.skb_list, skb);
+		resp->msg.len += skb->len;
+	}
+
+	return resp;
+err:
+	tfw_http_msg_free((TfwHttpMsg *)resp);
+	return NULL;
+}
+
+/**
+ * Entries of responses to HEAD requests have no body to send to others.
+ */
+static inline bool
+tfw_cache_entry_usable(TfwCacheEntry *ce, TfwHttpReq *req)
+{
+	return !(ce->flags & TFW_CE_F_HEAD)
+	       || req->method == TFW_HTTP_METH_HEAD;
+}
+
+static inline bool
+tfw_cache_entry_has_resp(TfwCacheEntry *ce)
+{
+	return ce->tmpl && ce->epoch == cache_epoch;
+}
+
+/**
+ * Move template @t to the LRU list head if it wasn't moved for
+ * TFW_CACHE_LRU_TOUCH.
+ */
+void
+tfw_cache_lru_touch(TfwCacheTmpl *t)
+{
+	if (time_before(jiffies, ACCESS_ONCE(t->lru_touch)
+				 + TFW_CACHE_LRU_TOUCH))
+		return;
+
+	spin_lock_bh(&cache_lru_lock);
+	/* Released templates aren't in the LRU list anymore. */
+	if (!t->dead) {
+		list_move(&t->list, &cache_lru);
+		t->lru_touch = jiffies;
+	}
+	spin_unlock_bh(&cache_lru_lock);
+}
+DEBUG_EXPORT_SYMBOL(tfw_cache_lru_touch);
+
+/**
+ * Get already built template of @ce or NULL.
+ * Must be called under rcu_read_lock_bh(), see tfw_cache_shrink_lru().
+ *
+ * Built templates are immutable and released after RCU-bh grace period, so
+ * they're read w/o the LRU lock: @tmpl is written before @epoch and only
+ * templates of the current epoch are used.
+ */
+static TfwCacheTmpl *
+__tfw_cache_entry_tmpl(TfwCacheEntry *ce)
+{
+	if (ACCESS_ONCE(ce->epoch) != cache_epoch)
+		return NULL;
+	smp_rmb();
+
+	return ACCESS_ONCE(ce->tmpl);
+}
+
+/**
+ * Get already built response template for @ce or NULL.
+ */
+static TfwHttpResp *
+tfw_cache_entry_tmpl(TfwCacheEntry *ce)
+{
+	TfwCacheTmpl *t = __tfw_cache_entry_tmpl(ce);
+
+	if (!t)
+		return NULL;
+	tfw_cache_lru_touch(t);
+
+	return t->resp;
+}
+
+/**
+ * Get already built response template for @ce or build a new one.
+ * Must be called under rcu_read_lock_bh(), see tfw_cache_shrink_lru().
+ * Responses aren't linked with removed entries since the entry memory can be
+ * reused.
+ */
+static TfwHttpResp *
+tfw_cache_entry_resp(TfwCacheEntry *ce)
+{
+	TfwHttpResp *resp;
+	TfwCacheTmpl *t;
+
+	resp = tfw_cache_entry_tmpl(ce);
+	if (resp)
+		return resp;
+
+	/*
+	 * Adopted body has been released, the entry can't be used anymore.
+	 * Adopted entries have no gzip variant.
+	 */
+	if (ce->flags & TFW_CE_F_ADOPTED) {
+		tfw_cache_entry_remove(ce);
+		return NULL;
+	}
+
+	resp = tfw_cache_build_resp(ce, ce->body_len);
+	if (!resp)
+		return NULL;
+	t = tfw_cache_tmpl_new(ce, resp);
+	if (!t) {
+		tfw_http_msg_free((TfwHttpMsg *)resp);
+		return NULL;
+	}
+
+	spin_lock_bh(&cache_lru_lock);
+	if (unlikely(tfw_cache_entry_has_resp(ce))) {
+		/* The response has been built concurrently. */
+		resp = ce->tmpl->resp;
+		spin_unlock_bh(&cache_lru_lock);
+		tfw_cache_tmpl_put(t);
+		return resp;
+	}
+	if (unlikely(tdb_rec_removed(db, ce))) {
+		spin_unlock_bh(&cache_lru_lock);
+		tfw_cache_tmpl_put(t);
+		return NULL;
+	}
+	__tfw_cache_tmpl_link(ce, t);
+	spin_unlock_bh(&cache_lru_lock);
+
+	return resp;
+}
+
+/**
+ * Release built response template of @ce after RCU-bh grace period.
+ * Also called when freshness of the entry is updated, so the front caches
+ * don't use the template with the outdated copy of the entry.
+ */
+static void
+tfw_cache_entry_release(TfwCacheEntry *ce)
+{
+	bool free_resp = false;
+
+	spin_lock_bh(&cache_lru_lock);
+	if (tfw_cache_entry_has_resp(ce)) {
+		__tfw_cache_tmpl_unlink(ce, &cache_free);
+		free_resp = true;
+	}
+	spin_unlock_bh(&cache_lru_lock);
+
+	if (free_resp)
+		schedule_work(&cache_free_work);
+}
+
+/**
+ * Remove @ce acquired by tdb_rec_get() from the cache.
+ * @return true if the entry has gzip variant. The variant isn't used w/o
+ * the entry, so it must be removed by tfw_cache_gzip_remove() when @ce is
+ * released: the variant can be in the same bucket as @ce.
+ */
+static bool
+tfw_cache_entry_remove(TfwCacheEntry *ce)
+{
+	/* Mark the entry removed before tfw_cache_entry_resp() checks it. */
+	tdb_rec_remove(db, ce);
+	tfw_cache_entry_release(ce);
+	tfw_cache_uri_remove(ce->trec.key);
+
+	return ce->flags & TFW_CE_F_GZIP;
+}
+
+/**
+ * Remove gzip variant of entry with primary key @key.
+ * No cache entry must be acquired by the caller.
+ */
+static void
+tfw_cache_gzip_remove(unsigned long key)
+{
+	TfwCacheEntry *gz;
+
+	rcu_read_lock_bh();
+	gz = tdb_rec_get(db, tfw_cache_gzip_key(key));
+	if (gz) {
+		if (gz->flags & TFW_CE_F_GZIPPED)
+			tfw_cache_entry_remove(gz);
+		tdb_rec_put(gz);
+	}
+	rcu_read_unlock_bh();
+}
+
+/**
+ * Remove @ce acquired by tdb_rec_get() from the cache and release it.
+ */
+static void
+tfw_cache_entry_drop(TfwCacheEntry *ce)
+{
+	unsigned long key = ce->trec.key;
+	bool gzip = tfw_cache_entry_remove(ce);
+
+	tdb_rec_put(ce);
+	if (gzip)
+		tfw_cache_gzip_remove(key);
+}
+
+/**
+ * Release built responses of up to @nr least recently used cache entries
+ * and responses of removed entries.
+ * The cache entries themselves are left in TDB, so the responses are just
+ * rebuilt on next cache hits.
+ * @return number of released responses of cache entries.
+ *
+ * Sleeps, so must be called from process context.
+ */
+unsigned long
+tfw_cache_shrink_lru(unsigned long nr)
+{
+	unsigned long n = 0;
+	TfwCacheTmpl *t, *tmp;
+	LIST_HEAD(free_list);
+
+	spin_lock_bh(&cache_lru_lock);
+	list_splice_init(&cache_free, &free_list);
+	while (n < nr && !list_empty(&cache_lru)) {
+		t = list_entry(cache_lru.prev, TfwCacheTmpl, list);
+		__tfw_cache_tmpl_unlink(t->owner, &free_list);
+		++n;
+	}
+	spin_unlock_bh(&cache_lru_lock);
+
+	if (list_empty(&free_list))
+		return 0;
+	tfw_cache_stat_add(TFW_CACHE_STAT_EVICTIONS, n);
+
+	/* Wait for cache readers which could get the responses. */
+	synchronize_rcu_bh();
+
+	list_for_each_entry_safe(t, tmp, &free_list, list) {
+		list_del(&t->list);
+		tfw_cache_tmpl_put(t);
+	}
+
+	TFW_DBG("Cache: released %lu built responses\n", n);
+
+	return n;
+}
+DEBUG_EXPORT_SYMBOL(tfw_cache_shrink_lru);
+
+/**
+ * Get key @key of the entry which is evicted first, i.e. the entry of the
+ * least recently used response template.
+ * @return false if there are no built templates.
+ */
+bool
+tfw_cache_lru_victim(unsigned long *key)
+{
+	bool victim = false;
+	TfwCacheTmpl *t;
+
+	spin_lock_bh(&cache_lru_lock);
+	if (!list_empty(&cache_lru)) {
+		t = list_entry(cache_lru.prev, TfwCacheTmpl, list);
+		*key = t->ce.trec.key;
+		victim = true;
+	}
+	spin_unlock_bh(&cache_lru_lock);
+
+	return victim;
+}
+DEBUG_EXPORT_SYMBOL(tfw_cache_lru_victim);
+
+static void
+tfw_cache_shrink_work(struct work_struct *work)
+{
+	tfw_cache_shrink_lru(TFW_CACHE_SHRINK_BATCH);
+}
+
+static DECLARE_WORK(cache_shrink_work, tfw_cache_shrink_work);
+
+static void
+tfw_cache_free_work(struct work_struct *work)
+{
+	tfw_cache_shrink_lru(0);
+}
+
+/**
+ * Called on local system overload, see tfw_stress_account_sys().
+ * The function can be called from softirq, so the responses are
+ * released by a work.
+ */
+void
+tfw_cache_shrink(void)
+{
+	if (!cache_cfg.cache)
+		return;
+
+	schedule_work(&cache_shrink_work);
+}
+
+/**
+ * Kernel memory shrinker callback.
+ * Report number of built responses or release a batch of them.
+ */
+static int
+tfw_cache_shrinker_cb(struct shrinker *s, struct shrink_control *sc)
+{
+	if (sc->nr_to_scan) {
+		if (!(sc->gfp_mask & __GFP_WAIT))
+			return -1;
+		tfw_cache_shrink_lru(min_t(unsigned long, sc->nr_to_scan,
+					   TFW_CACHE_SHRINK_BATCH));
+	}
+
+	return min_t(unsigned long, ACCESS_ONCE(cache_lru_n), INT_MAX);
+}
+
+static struct shrinker tfw_cache_shrinker = {
+	.shrink	= tfw_cache_shrinker_cb,
+	.seeks	= DEFAULT_SEEKS,
+	.batch	= TFW_CACHE_SHRINK_BATCH,
+};
+
+/**
+ * Get cache entry for @req by primary key @key: one probe for the primary
+ * key and one more probe for secondary key if the stored response varies
+ * on request headers.
+ * The entry must be released by tdb_rec_put().
+ */
+static TfwCacheEntry *
+tfw_cache_entry_get(TfwHttpReq *req, unsigned long key)
+{
+	bool found;
+	unsigned long skey;
+	TfwCacheEntry *ce = tdb_rec_get(db, key);
+
+	if (!ce || !ce->vary_len)
+		return ce;
+
+	found = tfw_cache_vary_key(req, key, TFW_CE_VARY(ce), ce->vary_len,
+				   &skey);
+	tdb_rec_put(ce);
+
+	return found ? tdb_rec_get(db, skey) : NULL;
+}
+
+/**
+ * Check that fresh entry @ce of age @age satisfies request @req
+ * Cache-Control directives, RFC 7234 5.2.1.
+ */
+bool
+tfw_cache_entry_acceptable(TfwCacheEntry *ce, TfwHttpReq *req,
+			   unsigned int age)
+{
+	TfwCacheControl *cc = &req->cache_ctl;
+
+	/* The entry must be validated, just forward the request. */
+	if (cc->flags & TFW_HTTP_CC_NO_CACHE)
+		return false;
+	if ((cc->flags & TFW_HTTP_CC_MAX_AGE) && age > cc->max_age)
+		return false;
+	if ((cc->flags & TFW_HTTP_CC_MIN_FRESH)
+	    && ce->lifetime - age < cc->max_fresh)
+		return false;
+
+	return true;
+}
+DEBUG_EXPORT_SYMBOL(tfw_cache_entry_acceptable);
+
+static inline bool
+tfw_cache_entry_validators(TfwCacheEntry *ce)
+{
+	return ce->etag_len || ce->lm_len;
+}
+
+static inline bool
+tfw_cache_req_conditional(TfwHttpReq *req)
+{
+	return tfw_http_msg_hdr_find((TfwHttpMsg *)req, "if-none-match", 13)
+	       || tfw_http_msg_hdr_find((TfwHttpMsg *)req,
+					"if-modified-since", 17);
+}
+
+/**
+ * Whether ETag of @ce matches one of entity tags in If-None-Match header
+ * value @inm of length @len using weak comparison, RFC 7232 2.3.2, 3.2.
+ */
+static bool
+tfw_cache_etag_match(TfwCacheEntry *ce, const char *inm, size_t len)
+{
+	const char *tag, *etag = TFW_CE_ETAG(ce), *end = inm + len;
+	size_t n, etag_len = ce->etag_len;
+
+	if (len == 1 && *inm == '*')
+		return true;
+	if (!etag_len)
+		return false;
+
+	/* Weak comparison ignores the weakness indicator. */
+	if (etag_len > 2 && etag[0] == 'W' && etag[1] == '/') {
+		etag += 2;
+		etag_len -= 2;
+	}
+
+	while (inm < end) {
+		while (inm < end && (isspace(*inm) || *inm == ','))
+			++inm;
+		if (end - inm > 2 && inm[0] == 'W' && inm[1] == '/')
+			inm += 2;
+		tag = inm;
+		if (inm < end && *inm == '"') {
+			/* Opaque tag can contain commas. */
+			const char *q = memchr(inm + 1, '"', end - inm - 1);
+			inm = q ? q + 1 : end;
+		} else {
+			while (inm < end && *inm != ',' && !isspace(*inm))
+				++inm;
+		}
+		n = inm - tag;
+		if (n == etag_len && !memcmp(tag, etag, n))
+			return true;
+	}
+
+	return false;
+}
+
+/**
+ * Evaluate conditional headers of @req against fresh entry @ce, RFC 7232 6.
+ * @return true if the stored response isn't modified, so 304 response can be
+ * sent to the client.
+ *
+ * If-Modified-Since matches only if it's exactly the same as Last-Modified
+ * of the stored response, i.e. the client sends back the date received from
+ * us. The dates aren't parsed in the fast path, while a different date just
+ * leads to full response.
+ */
+static bool
+tfw_cache_not_modified(TfwCacheEntry *ce, TfwHttpReq *req)
+{
+	size_t n;
+	char *v;
+
+	if (!tfw_cache_entry_validators(ce) || !tfw_cache_req_conditional(req))
+		return false;
+
+	v = tfw_pool_alloc(req->pool, TFW_CACHE_COND_MAX);
+	if (!v)
+		return false;
+
+	/* If-Modified-Since is ignored if If-None-Match is present. */
+	if (tfw_http_msg_hdr_find((TfwHttpMsg *)req, "if-none-match", 13)) {
+		n = tfw_http_msg_hdr_val((TfwHttpMsg *)req, "if-none-match", 13,
+					 v, TFW_CACHE_COND_MAX);
+		return n && tfw_cache_etag_match(ce, v, n);
+	}
+
+	n = tfw_http_msg_hdr_val((TfwHttpMsg *)req, "if-modified-since", 17,
+				 v, TFW_CACHE_COND_MAX);
+	return n && n == ce->lm_len && !memcmp(v, TFW_CE_LM(ce), n);
+}
+
+/**
+ * Whether Range header of @req should be applied to fresh entry @ce,
+ * RFC 7233 3.1 and 3.2. Ranges of successful responses only are served,
+ * the full response is sent for chunked entries since the stored body
+ * contains the chunk framing. If-Range entity tag is compared with the stored
+ * one by strong comparison and If-Range date must be exactly the same as
+ * the stored Last-Modified.
+ */
+static bool
+tfw_cache_range_applicable(TfwCacheEntry *ce, TfwHttpReq *req)
+{
+	size_t n;
+	char *v;
+
+	if (!req->range_n || ce->status != 200
+	    || (ce->flags & TFW_CE_F_CHUNKED)
+	    || ce->body_len >= TFW_HTTP_RANGE_NONE)
+		return false;
+	if (!tfw_http_msg_hdr_find((TfwHttpMsg *)req, "if-range", 8))
+		return true;
+
+	v = tfw_pool_alloc(req->pool, TFW_CACHE_COND_MAX);
+	if (!v)
+		return false;
+	n = tfw_http_msg_hdr_val((TfwHttpMsg *)req, "if-range", 8, v,
+				 TFW_CACHE_COND_MAX);
+	if (!n)
+		return false;
+	if (*v == '"')
+		return n == ce->etag_len && !memcmp(v, TFW_CE_ETAG(ce), n);
+	return n == ce->lm_len && !memcmp(v, TFW_CE_LM(ce), n);
+}
+
+/**
+ * Resolve byte ranges of @req against body of @ce to @rng.
+ * @return number of satisfiable ranges.
+ */
+int
+tfw_cache_ranges(TfwCacheEntry *ce, TfwHttpReq *req, TfwHttpRange *rng)
+{
+	int i, n = 0;
+	unsigned int len = ce->body_len;
+
+	for (i = 0; i < req->range_n; ++i) {
+		unsigned int first = req->range[i].first;
+		unsigned int last = req->range[i].last;
+
+		if (first == TFW_HTTP_RANGE_NONE) {
+			if (!last || !len)
+				continue;
+			first = last < len ? len - last : 0;
+			last = len - 1;
+		} else {
+			if (first >= len)
+				continue;
+			if (last >= len)
+				last = len - 1;
+		}
+		rng[n].first = first;
+		rng[n].last = last;
+		++n;
+	}
+
+	return n;
+}
+DEBUG_EXPORT_SYMBOL(tfw_cache_ranges);
+
+/**
+ * Find value of header @name of length @n in headers of response template
+ * @t_skb. @return pointer to the trimmed value and set @len to its length
+ * or return NULL if there is no such header.
+ */
+static const char *
+tfw_cache_tmpl_hdr_val(struct sk_buff *t_skb, const char *name, int n,
+		       size_t *len)
+{
+	char *p = t_skb->data, *end = p + t_skb->len, *eol, *v;
+
+	for ( ; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			break;
+		if (!tfw_cache_hdr_line_eq(p, eol - p, name, n))
+			continue;
+		for (v = p + n + 1; v < eol && isspace(*v); ++v)
+			;
+		while (eol > v && isspace(*(eol - 1)))
+			--eol;
+		*len = eol - v;
+		return v;
+	}
+
+	return NULL;
+}
+
+/**
+ * Copy headers of response template @t_skb w/o the status line, Content-Length
+ * and also Content-Type if @no_ct is true to @dst.
+ * @return the copied data end.
+ */
+static char *
+tfw_cache_tmpl_hdrs_copy(struct sk_buff *t_skb, char *dst, bool no_ct)
+{
+	char *p = t_skb->data, *end = p + t_skb->len, *eol;
+
+	/* Skip the status line. */
+	eol = memchr(p, '\n', end - p);
+	p = eol ? eol + 1 : end;
+
+	for ( ; p < end; p = eol) {
+		eol = memchr(p, '\n', end - p);
+		eol = eol ? eol + 1 : end;
+		if (tfw_cache_hdr_line_eq(p, eol - p, "content-length", 14)
+		    || (no_ct && tfw_cache_hdr_line_eq(p, eol - p,
+						       "content-type", 12)))
+			continue;
+		memcpy(dst, p, eol - p);
+		dst += eol - p;
+	}
+
+	return dst;
+}
+
+/**
+ * Add bytes from @first to @last of the template @body to @resp as paged
+ * fragments referencing the template pages.
+ */
+static int
+tfw_cache_range_body(TfwHttpResp *resp, TfwHttpResp *body, unsigned int first,
+		     unsigned int last)
+{
+	int i;
+	unsigned long pos = 0;
+	struct sk_buff *skb = ss_skb_peek(&body->msg.skb_list);
+
+	/* The first template skb contains the headers only. */
+	for (skb = ss_skb_next(&body->msg.skb_list, skb); skb && pos <= last;
+	     skb = ss_skb_next(&body->msg.skb_list, skb))
+	{
+		for (i = 0; i < skb_shinfo(skb)->nr_frags && pos <= last; ++i)
+		{
+			const skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+			unsigned long s, e, size = skb_frag_size(frag);
+			struct page *page = skb_frag_page(frag);
+
+			if (pos + size > first) {
+				s = max_t(unsigned long, first, pos);
+				e = min_t(unsigned long, last + 1, pos + size);
+				get_page(page);
+				if (tfw_cache_resp_add_frag(resp, page,
+							    frag->page_offset
+							    + s - pos, e - s))
+				{
+					put_page(page);
+					return -ENOMEM;
+				}
+			}
+			pos += size;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Add linear skb with @len bytes of data to @resp.
+ * @return pointer to the data or NULL on allocation failure.
+ */
+static char *
+tfw_cache_resp_add_data(TfwHttpResp *resp, size_t len)
+{
+	struct sk_buff *skb;
+
+	/* Reserve a byte for terminating zero written by snprintf(). */
+	skb = alloc_skb(SKB_HDR_SZ + len + 1, GFP_ATOMIC);
+	if (!skb)
+		return NULL;
+	skb_reserve(skb, SKB_HDR_SZ);
+	ss_skb_queue_tail(&resp->msg.skb_list, skb);
+	resp->msg.len += len;
+
+	return skb_put(skb, len);
+}
+
+static int
+tfw_cache_part_hdr(char *buf, size_t size, const char *ct, size_t ct_len,
+		   TfwHttpRange *rng, unsigned long len)
+{
+	if (ct)
+		return snprintf(buf, size, "\r\n--%016lx\r\n"
+				"Content-Type: %.*s\r\n"
+				"Content-Range: bytes %u-%u/%lu\r\n\r\n",
+				cache_epoch, (int)ct_len, ct,
+				rng->first, rng->last, len);
+	return snprintf(buf, size, "\r\n--%016lx\r\n"
+			"Content-Range: bytes %u-%u/%lu\r\n\r\n",
+			cache_epoch, rng->first, rng->last, len);
+}
+
+#define TFW_CACHE_PARTS_END	"\r\n--%016lx--\r\n"
+#define TFW_CACHE_PARTS_END_LEN	(sizeof("\r\n----\r\n") - 1 + 16)
+
+/**
+ * Build 416 (Range Not Satisfiable) response for @ce, RFC 7233 4.4.
+ */
+static TfwHttpResp *
+tfw_cache_ns_resp(TfwCacheEntry *ce, unsigned int age)
+{
+	size_t len = sizeof(TFW_CACHE_NS_STATUS) + TFW_CACHE_RANGE_HDR_MAX;
+	struct sk_buff *skb;
+	TfwHttpResp *resp;
+
+	resp = tfw_cache_resp_alloc(len, &skb);
+	if (!resp)
+		return NULL;
+
+	skb_put(skb, snprintf(skb_tail_pointer(skb), len,
+			      TFW_CACHE_NS_STATUS
+			      "Content-Range: bytes */%lu\r\n"
+			      "Content-Length: 0\r\n", ce->body_len));
+	tfw_cache_resp_age(resp, skb, age, false);
+
+	return resp;
+}
+
+/**
+ * Build 206 (Partial Content) response to Range request @req from template
+ * @body of entry @ce, RFC 7233 4.1. Single range is sent as the response
+ * body and multiple ranges are sent as multipart/byteranges body. The stored
+ * headers are sent except Content-Length (and Content-Type for multipart
+ * body) while the body fragments reference the template pages.
+ */
+static TfwHttpResp *
+tfw_cache_range_resp(TfwCacheEntry *ce, TfwHttpResp *body, TfwHttpReq *req,
+		     unsigned int age)
+{
+	int i, n;
+	size_t ct_len = 0, len;
+	unsigned long b_len = 0;
+	const char *ct = NULL;
+	char *p;
+	TfwHttpRange *rng;
+	struct sk_buff *skb, *t_skb = ss_skb_peek(&body->msg.skb_list);
+	TfwHttpResp *resp;
+
+	rng = tfw_pool_alloc(req->pool, sizeof(*rng) * req->range_n);
+	if (!rng)
+		return NULL;
+	n = tfw_cache_ranges(ce, req, rng);
+	if (!n)
+		return tfw_cache_ns_resp(ce, age);
+
+	if (n > 1) {
+		ct = tfw_cache_tmpl_hdr_val(t_skb, "content-type", 12, &ct_len);
+		for (i = 0; i < n; ++i)
+			b_len += tfw_cache_part_hdr(NULL, 0, ct, ct_len,
+						    &rng[i], ce->body_len)
+				 + rng[i].last - rng[i].first + 1;
+		b_len += TFW_CACHE_PARTS_END_LEN;
+	} else {
+		b_len = rng[0].last - rng[0].first + 1;
+	}
+
+	len = sizeof(TFW_CACHE_RANGE_STATUS) + t_skb->len
+	      + TFW_CACHE_RANGE_HDR_MAX;
+	resp = tfw_cache_resp_alloc(len, &skb);
+	if (!resp)
+		return NULL;
+
+	p = (char *)skb_tail_pointer(skb);
+	memcpy(p, TFW_CACHE_RANGE_STATUS, sizeof(TFW_CACHE_RANGE_STATUS) - 1);
+	p = tfw_cache_tmpl_hdrs_copy(t_skb, p + sizeof(TFW_CACHE_RANGE_STATUS)
+					    - 1, n > 1);
+	if (n > 1)
+		p += snprintf(p, TFW_CACHE_RANGE_HDR_MAX,
+			      "Content-Type: multipart/byteranges;"
+			      " boundary=%016lx\r\n", cache_epoch);
+	else
+		p += snprintf(p, TFW_CACHE_RANGE_HDR_MAX,
+			      "Content-Range: bytes %u-%u/%lu\r\n",
+			      rng[0].first, rng[0].last, ce->body_len);
+	p += sprintf(p, "Content-Length: %lu\r\n", b_len);
+	skb_put(skb, p - (char *)skb_tail_pointer(skb));
+	tfw_cache_resp_age(resp, skb, age, age >= ce->lifetime);
+
+	for (i = 0; i < n; ++i) {
+		if (n > 1) {
+			len = tfw_cache_part_hdr(NULL, 0, ct, ct_len, &rng[i],
+						 ce->body_len);
+			p = tfw_cache_resp_add_data(resp, len);
+			if (!p)
+				goto err;
+			tfw_cache_part_hdr(p, len + 1, ct, ct_len, &rng[i],
+					   ce->body_len);
+		}
+		if (tfw_cache_range_body(resp, body, rng[i].first,
+					 rng[i].last))
+			goto err;
+	}
+	if (n > 1) {
+		p = tfw_cache_resp_add_data(resp, TFW_CACHE_PARTS_END_LEN);
+		if (!p)
+			goto err;
+		snprintf(p, TFW_CACHE_PARTS_END_LEN + 1, TFW_CACHE_PARTS_END,
+			 cache_epoch);
+	}
+
+	return resp;
+err:
+	tfw_http_msg_free((TfwHttpMsg *)resp);
+	return NULL;
+}
+
+/**
+ * Whether gzip content coding is acceptable for client of @req, RFC 7231
+ * 5.3.4. Only explicit "gzip" coding is considered.
+ */
+static bool
+tfw_cache_req_gzip(TfwHttpReq *req)
+{
+	size_t n;
+	char *v, *p, *q, *next, *end;
+
+	v = tfw_pool_alloc(req->pool, TFW_CACHE_COND_MAX);
+	if (!v)
+		return false;
+	n = tfw_http_msg_hdr_val((TfwHttpMsg *)req, "accept-encoding", 15, v,
+				 TFW_CACHE_COND_MAX);
+
+	for (p = v, end = v + n; p < end; p = next + 1) {
+		next = memchr(p, ',', end - p);
+		if (!next)
+			next = end;
+		while (p < next && isspace(*p))
+			++p;
+		if (next - p < 4 || strncasecmp(p, "gzip", 4)
+		    || (p + 4 < next && p[4] != ';' && !isspace(p[4])))
+			continue;
+		/* Zero quality value means "not acceptable". */
+		q = strnstr(p + 4, "q=", next - p - 4);
+		if (!q)
+			return true;
+		for (q += 2; q < next && (*q == '0' || *q == '.'); ++q)
+			;
+		return q < next && isdigit(*q);
+	}
+
+	return false;
+}
+
+/**
+ * Build a response to @req from gzip variant of fresh entry @ce with age
+ * @age if the client accepts it. Ranges are served from the identity entry.
+ * Both the templates are offered to the local front cache if @front is true.
+ * @return the response or NULL if the identity response must be sent.
+ */
+static TfwHttpResp *
+tfw_cache_gzip_resp(TfwCacheEntry *ce, TfwHttpReq *req, unsigned int age,
+		    bool front)
+{
+	TfwCacheEntry *gz;
+	TfwHttpResp *body, *resp = NULL;
+
+	if (!(ce->flags & TFW_CE_F_GZIP) || req->range_n
+	    || !tfw_cache_req_gzip(req))
+		return NULL;
+
+	gz = tdb_rec_get(db, tfw_cache_gzip_key(ce->trec.key));
+	if (!gz)
+		return NULL;
+	if (!(gz->flags & TFW_CE_F_GZIPPED) || !ACCESS_ONCE(gz->hdr_len))
+		goto put;
+	smp_rmb();
+
+	/* The identity entry can be refreshed by revalidation. */
+	tdb_rec_write_begin();
+	gz->lifetime = ce->lifetime;
+	tfw_cache_entry_written(gz);
+	body = tfw_cache_entry_resp(gz);
+	if (!body)
+		goto put;
+	resp = req->method == TFW_HTTP_METH_HEAD
+	       ? tfw_cache_head_resp(gz, body, age)
+	       : tfw_cache_hit_resp(gz, body, age);
+	if (resp && front)
+		tfw_cache_front_add(ce->trec.key, ce,
+				    __tfw_cache_entry_tmpl(gz));
+put:
+	tdb_rec_put(gz);
+
+	return resp;
+}
+
+/**
+ * Build a response to @req from template @body of fresh entry @ce.
+ */
+static TfwHttpResp *
+tfw_cache_req_resp(TfwCacheEntry *ce, TfwHttpResp *body, TfwHttpReq *req,
+		   unsigned int age)
+{
+	if (req->method == TFW_HTTP_METH_HEAD)
+		return tfw_cache_head_resp(ce, body, age);
+	if (tfw_cache_range_applicable(ce, req))
+		return tfw_cache_range_resp(ce, body, req, age);
+	return tfw_cache_hit_resp(ce, body, age);
+}
+
+/**
+ * Build a response to Range request @req from entry @ce which is still being
+ * filled. The response is built only if all the requested ranges are already
+ * written, so the template for the written body part is built just for
+ * the request. HEAD requests get the headers as soon as they're written.
+ * @return the response or NULL if the request must wait for the whole entry.
+ */
+static TfwHttpResp *
+tfw_cache_filling_resp(TfwCacheEntry *ce, TfwHttpReq *req, unsigned int age)
+{
+	int i, n;
+	unsigned long filled = ACCESS_ONCE(ce->filled);
+	TfwHttpRange *rng;
+	TfwHttpResp *body, *resp;
+
+	/* HEAD requests need the written headers only. */
+	if (req->method == TFW_HTTP_METH_HEAD) {
+		body = tfw_cache_build_resp(ce, 0);
+		if (!body)
+			return NULL;
+		resp = tfw_cache_head_resp(ce, body, age);
+		tfw_http_msg_free((TfwHttpMsg *)body);
+		return resp;
+	}
+	if (!tfw_cache_range_applicable(ce, req))
+		return NULL;
+	/* Read the body data after @filled, see tfw_cache_fill_publish(). */
+	smp_rmb();
+
+	rng = tfw_pool_alloc(req->pool, sizeof(*rng) * req->range_n);
+	if (!rng)
+		return NULL;
+	n = tfw_cache_ranges(ce, req, rng);
+	for (i = 0; i < n; ++i)
+		if (rng[i].last >= filled)
+			return NULL;
+
+	body = tfw_cache_build_resp(ce, filled);
+	if (!body)
+		return NULL;
+	resp = tfw_cache_range_resp(ce, body, req, age);
+	tfw_http_msg_free((TfwHttpMsg *)body);
+
+	return resp;
+}
+
+/**
+ * Serve GET request @req for primary key @key from entry @ce which is still
+ * being filled: the headers and the written body part are passed to @action
+ * at once and the client joins the entry fill to get the rest of the body
+ * as it's written (see tfw_cache_fill_send()). If the fill is already
+ * finished, then the rest of the body is sent from the completed entry.
+ * @return true if @req is served.
+ */
+static bool
+tfw_cache_tail_join(TfwCacheEntry *ce, TfwHttpReq *req, unsigned long key,
+		    unsigned int age, tfw_http_req_cache_cb_t action,
+		    void *data)
+{
+	unsigned long filled = ACCESS_ONCE(ce->filled);
+	TfwCacheFill *fill;
+	TfwCacheFetchBucket *b;
+	TfwCacheTail *t;
+	TfwHttpResp *body, *resp;
+
+	if (req->method != TFW_HTTP_METH_GET
+	    || (req->cache_ctl.flags
+		& (TFW_HTTP_CC_NO_CACHE | TFW_HTTP_CC_NO_STORE)))
+		return false;
+	/* Read the body data after @filled, see tfw_cache_fill_publish(). */
+	smp_rmb();
+
+	t = kmalloc(sizeof(*t), GFP_ATOMIC);
+	if (!t)
+		return false;
+	body = tfw_cache_build_resp(ce, filled);
+	if (!body)
+		goto err;
+	resp = tfw_cache_hit_resp(ce, body, age);
+	tfw_http_msg_free((TfwHttpMsg *)body);
+	if (!resp)
+		goto err;
+
+	t->sk = ((TfwClient *)req->conn->peer)->sock;
+	t->sent = filled;
+	sock_hold(t->sk);
+
+	tfw_cache_stat_hit(TFW_CACHE_STAT_HITS, resp);
+	action(req, resp, data);
+	tfw_http_msg_free((TfwHttpMsg *)resp);
+
+	b = &fetch_hash[hash_min(key, TFW_CACHE_FETCH_HASH_BITS)];
+	spin_lock_bh(&b->lock);
+	hlist_for_each_entry(fill, &b->fills, hentry)
+		if (fill->ce == ce) {
+			list_add_tail(&t->list, &fill->tails);
+			break;
+		}
+	spin_unlock_bh(&b->lock);
+
+	/*
+	 * The fill is unlinked after the entry is completed or removed,
+	 * see tfw_cache_fill_release().
+	 */
+	if (!fill) {
+		bool done = !(ACCESS_ONCE(ce->flags) & TFW_CE_F_FILLING);
+
+		tfw_cache_tail_free(t, done && tfw_cache_tail_send(ce, t,
+								ce->body_len));
+	}
+
+	return true;
+err:
+	kfree(t);
+	return false;
+}
+
+/**
+ * Make @req conditional by validators of @ce, so upstream server can respond
+ * by 304 if the stored response is still valid, RFC 7234 4.3.1.
+ */
+static void
+tfw_cache_validate_req(TfwCacheEntry *ce, TfwHttpReq *req)
+{
+	int n = 0;
+	size_t len = ce->etag_len + ce->lm_len
+		     + sizeof("If-None-Match: \r\nIf-Modified-Since: \r\n");
+	char *hdrs = tfw_pool_alloc(req->pool, len);
+
+	if (!hdrs)
+		return;
+	if (ce->etag_len)
+		n += snprintf(hdrs, len, "If-None-Match: %.*s\r\n",
+			      ce->etag_len, TFW_CE_ETAG(ce));
+	if (ce->lm_len)
+		n += snprintf(hdrs + n, len - n, "If-Modified-Since: %.*s\r\n",
+			      ce->lm_len, TFW_CE_LM(ce));
+
+	if (tfw_http_msg_hdr_add((TfwHttpMsg *)req, hdrs, n))
+		return;
+	req->flags |= TFW_HTTP_CACHE_VALIDATE;
+}
+
+/**
+ * Whether stale entry @ce of age @age is still usable for @req during
+ * @window seconds after it became stale, RFC 5861.
+ * Clients requiring fresh responses don't get stale ones.
+ */
+static bool
+tfw_cache_entry_stale_ok(TfwCacheEntry *ce, TfwHttpReq *req,
+			 unsigned int age, unsigned int window)
+{
+	TfwCacheControl *cc = &req->cache_ctl;
+
+	/* Stale error responses are useless. */
+	if (ce->flags & TFW_CE_F_NEGATIVE)
+		return false;
+	if (age - ce->lifetime >= window)
+		return false;
+	if (cc->flags & (TFW_HTTP_CC_NO_CACHE | TFW_HTTP_CC_MIN_FRESH))
+		return false;
+	if ((cc->flags & TFW_HTTP_CC_MAX_AGE) && age > cc->max_age)
+		return false;
+
+	return true;
+}
+
+/* How long stale entries can be used. */
+static inline unsigned int
+tfw_cache_stale_max(void)
+{
+	return max(cache_cfg.stale_while_revalidate, cache_cfg.stale_if_error);
+}
+
+static void __cache_req_process_node(TfwHttpReq *req, unsigned long key,
+				     tfw_http_req_cache_cb_t action,
+				     void *data);
+
+/**
+ * Process requests waiting for fetch @f and free the fetch.
+ * The requests don't wait for other fetches, so they're forwarded to upstream
+ * servers if they miss the cache again.
+ */
+static void
+tfw_cache_fetch_release(TfwCacheFetch *f)
+{
+	TfwCWork *cw, *tmp;
+
+	list_for_each_entry_safe(cw, tmp, &f->waiters, cw_list) {
+		list_del(&cw->cw_list);
+		cw->cw_req->flags |= TFW_HTTP_CACHE_FOLLOWER;
+		__cache_req_process_node(cw->cw_req, f->key, cw->cw_act,
+					 cw->cw_data);
+		kmem_cache_free(c_cache, cw);
+	}
+	kmem_cache_free(fetch_cache, f);
+}
+
+/**
+ * The fetch response doesn't come in time, probably the request or
+ * the response was dropped. The fetch is owned by whoever unlinks it from
+ * the hash table, so the fetch can't be freed concurrently while we're here.
+ */
+static void
+tfw_cache_fetch_timeout(unsigned long data)
+{
+	bool own;
+	TfwCacheFetch *f = (TfwCacheFetch *)data;
+	TfwCacheFetchBucket *b;
+
+	b = &fetch_hash[hash_min(f->key, TFW_CACHE_FETCH_HASH_BITS)];
+
+	spin_lock_bh(&b->lock);
+	own = !hlist_unhashed(&f->hentry);
+	if (own)
+		hlist_del_init(&f->hentry);
+	spin_unlock_bh(&b->lock);
+
+	if (own) {
+		TFW_DBG("Cache: fetch for key %#lx timed out\n", f->key);
+		tfw_cache_fetch_release(f);
+	}
+}
+
+static TfwCacheFetch *
+__cache_fetch_lookup(TfwCacheFetchBucket *b, unsigned long key)
+{
+	TfwCacheFetch *f;
+
+	hlist_for_each_entry(f, &b->list, hentry)
+		if (f->key == key)
+			return f;
+
+	return NULL;
+}
+
+/**
+ * Create in-flight fetch for @key in bucket @b, the bucket must be locked.
+ */
+static bool
+__cache_fetch_create(TfwCacheFetchBucket *b, unsigned long key)
+{
+	unsigned int tmt = cache_cfg.collapse_timeout
+			   ? : TFW_CACHE_FETCH_TIMEOUT;
+	TfwCacheFetch *f = kmem_cache_alloc(fetch_cache, GFP_ATOMIC);
+
+	if (!f)
+		return false;
+
+	f->key = key;
+	INIT_LIST_HEAD(&f->waiters);
+	setup_timer(&f->timer, tfw_cache_fetch_timeout, (unsigned long)f);
+	hlist_add_head(&f->hentry, &b->list);
+	mod_timer(&f->timer, jiffies + msecs_to_jiffies(tmt));
+
+	return true;
+}
+
+/**
+ * Finish in-flight fetch for @key if any and process its waiting requests.
+ * Called when the fetched response is stored in the cache or it's found that
+ * the response can't be stored.
+ */
+static void
+tfw_cache_fetch_done(unsigned long key)
+{
+	TfwCacheFetch *f;
+	TfwCacheFetchBucket *b;
+
+	b = &fetch_hash[hash_min(key, TFW_CACHE_FETCH_HASH_BITS)];
+
+	spin_lock_bh(&b->lock);
+	f = __cache_fetch_lookup(b, key);
+	if (f)
+		hlist_del_init(&f->hentry);
+	spin_unlock_bh(&b->lock);
+
+	if (!f)
+		return;
+
+	/* Wait for the timer callback which saw the fetch linked. */
+	del_timer_sync(&f->timer);
+	tfw_cache_fetch_release(f);
+}
+
+/**
+ * Collapse request @req missed the cache with in-flight fetch for @key.
+ * If there is no fetch for the key, then a new one is created and @req is
+ * forwarded to upstream server as the fetch request.
+ * @return true if @req waits for the fetch and mustn't be processed further.
+ */
+static bool
+tfw_cache_fetch_join(TfwHttpReq *req, unsigned long key,
+		     tfw_http_req_cache_cb_t action, void *data)
+{
+	TfwCWork *cw = NULL;
+	TfwCacheFetch *f;
+	TfwCacheFetchBucket *b;
+
+	if (!cache_cfg.collapse_timeout
+	    || (req->flags & TFW_HTTP_CACHE_FOLLOWER)
+	    || req->method != TFW_HTTP_METH_GET
+	    || (req->cache_ctl.flags
+		& (TFW_HTTP_CC_NO_CACHE | TFW_HTTP_CC_NO_STORE)))
+		return false;
+
+	b = &fetch_hash[hash_min(key, TFW_CACHE_FETCH_HASH_BITS)];
+
+	spin_lock_bh(&b->lock);
+
+	f = __cache_fetch_lookup(b, key);
+	if (f) {
+		cw = kmem_cache_alloc(c_cache, GFP_ATOMIC);
+		if (cw) {
+			cw->cw_req = req;
+			cw->cw_act = action;
+			cw->cw_data = data;
+			cw->cw_key = key;
+			list_add_tail(&cw->cw_list, &f->waiters);
+		}
+	} else {
+		__cache_fetch_create(b, key);
+	}
+
+	spin_unlock_bh(&b->lock);
+
+	return cw != NULL;
+}
+
+/**
+ * Start in-flight fetch for @key w/o waiting requests, so only one request
+ * revalidates a stale entry in background.
+ * @return true if the fetch is started and false if there is already one.
+ */
+static bool
+tfw_cache_fetch_start(unsigned long key)
+{
+	bool r = false;
+	TfwCacheFetchBucket *b;
+
+	b = &fetch_hash[hash_min(key, TFW_CACHE_FETCH_HASH_BITS)];
+
+	spin_lock_bh(&b->lock);
+	if (!__cache_fetch_lookup(b, key))
+		r = __cache_fetch_create(b, key);
+	spin_unlock_bh(&b->lock);
+
+	return r;
+}
+
+/**
+ * Drop all in-flight fetches and free waiting requests on shutdown.
+ */
+static void
+tfw_cache_fetch_cleanup(void)
+{
+	int i;
+	TfwCWork *cw, *tmp;
+	TfwCacheFetch *f;
+
+	for (i = 0; i < (1 << TFW_CACHE_FETCH_HASH_BITS); ++i) {
+		TfwCacheFetchBucket *b = &fetch_hash[i];
+		LIST_HEAD(fetches);
+
+		spin_lock_bh(&b->lock);
+		while (!hlist_empty(&b->list)) {
+			/* Timers unlink fetches while the lock is released. */
+			f = hlist_entry(b->list.first, TfwCacheFetch, hentry);
+			hlist_del_init(&f->hentry);
+			list_splice_init(&f->waiters, &fetches);
+			spin_unlock_bh(&b->lock);
+			del_timer_sync(&f->timer);
+			kmem_cache_free(fetch_cache, f);
+			spin_lock_bh(&b->lock);
+		}
+		spin_unlock_bh(&b->lock);
+
+		list_for_each_entry_safe(cw, tmp, &fetches, cw_list) {
+			list_del(&cw->cw_list);
+			tfw_http_msg_free((TfwHttpMsg *)cw->cw_req);
+			kmem_cache_free(c_cache, cw);
+		}
+	}
+}
+
+/*
+ * Per-CPU front cache of the hottest cache entries.
+ *
+ * Cache hits on hot entries are served in softirq w/o the HTrie descent,
+ * the bucket locks and inter-node work scheduling: the front table maps
+ * keys of locally requested entries to references to the entry templates,
+ * identity and gzip ones, so the response is built from a template and
+ * the entry copy in it. The table is set associative, each bucket of
+ * TFW_CACHE_FRONT_WAYS entries occupies one cache line.
+ *
+ * Request frequencies are estimated by per-CPU count-min sketch with small
+ * saturating counters which are halved each TFW_CACHE_SKETCH_RESET requests,
+ * so old popularity fades out. An entry found in TDB replaces the least
+ * frequently requested entry of the bucket if the new one is requested more
+ * often (TinyLFU-like admission). The sketches are also used by the cache
+ * admission filter, see tfw_cache_admit().
+ *
+ * Front entries aren't invalidated: templates released by their entries,
+ * i.e. removed, replaced, refreshed or evicted ones, are marked dead and
+ * a front entry is dropped on the next hit if its identity template is dead.
+ * A dead gzip template just isn't used.
+ *
+ * The tables are accessed with disabled softirqs on local CPU only, so no
+ * locking is required.
+ */
+#define TFW_CACHE_FRONT_BITS	11
+#define TFW_CACHE_FRONT_WAYS	(L1_CACHE_BYTES / (3 * sizeof(long)))
+/* Minimum frequency of entries admitted to the front cache. */
+#define TFW_CACHE_FRONT_ADMIT	2
+/*
+ * Requests for entries of other nodes with at least this frequency are
+ * processed locally to fill the front cache.
+ */
+#define TFW_CACHE_FRONT_HOT	4
+
+typedef struct {
+	unsigned long	key[TFW_CACHE_FRONT_WAYS];
+	TfwCacheTmpl	*t[TFW_CACHE_FRONT_WAYS];
+	TfwCacheTmpl	*gz[TFW_CACHE_FRONT_WAYS];
+} ____cacheline_aligned TfwCacheFrontBucket;
+
+typedef struct {
+	TfwCacheFrontBucket	b[1 << TFW_CACHE_FRONT_BITS];
+	TfwCacheSketch		sketch;
+} TfwCacheFront;
+
+static DEFINE_PER_CPU(TfwCacheFront *, cache_front);
+
+static inline unsigned int
+tfw_cache_sketch_idx(unsigned long key, int row)
+{
+	return (key >> (row * TFW_CACHE_SKETCH_BITS))
+	       & ((1 << TFW_CACHE_SKETCH_BITS) - 1);
+}
+
+/**
+ * Estimate number of requests for @key accounted by sketch @sk.
+ */
+unsigned int
+tfw_cache_sketch_estimate(TfwCacheSketch *sk, unsigned long key)
+{
+	int r;
+	unsigned int n = TFW_CACHE_SKETCH_MAX;
+
+	for (r = 0; r < TFW_CACHE_SKETCH_ROWS; ++r)
+		n = min_t(unsigned int, n,
+			  sk->cnt[r][tfw_cache_sketch_idx(key, r)]);
+
+	return n;
+}
+DEBUG_EXPORT_SYMBOL(tfw_cache_sketch_estimate);
+
+/**
+ * Account a request for @key and age the sketch if it's time.
+ */
+void
+tfw_cache_sketch_inc(TfwCacheSketch *sk, unsigned long key)
+{
+	int r, i;
+
+	for (r = 0; r < TFW_CACHE_SKETCH_ROWS; ++r) {
+		unsigned char *c = &sk->cnt[r][tfw_cache_sketch_idx(key, r)];
+		if (*c < TFW_CACHE_SKETCH_MAX)
+			++*c;
+	}
+
+	if (++sk->samples < TFW_CACHE_SKETCH_RESET)
+		return;
+	sk->samples = 0;
+	for (r = 0; r < TFW_CACHE_SKETCH_ROWS; ++r)
+		for (i = 0; i < (1 << TFW_CACHE_SKETCH_BITS); ++i)
+			sk->cnt[r][i] >>= 1;
+}
+DEBUG_EXPORT_SYMBOL(tfw_cache_sketch_inc);
+
+static inline TfwCacheFrontBucket *
+tfw_cache_front_bucket(TfwCacheFront *f, unsigned long key)
+{
+	return &f->b[hash_min(key, TFW_CACHE_FRONT_BITS)];
+}
+
+/**
+ * Replace template reference @old by @t.
+ */
+static void
+tfw_cache_front_set(TfwCacheTmpl **old, TfwCacheTmpl *t)
+{
+	if (*old == t)
+		return;
+	if (t)
+		atomic_inc(&t->refcnt);
+	if (*old)
+		tfw_cache_tmpl_put(*old);
+	*old = t;
+}
+
+/**
+ * Offer entry @ce found in TDB by @key to the local front cache along with
+ * template @gz of its gzip variant if it's known.
+ * Must be called under rcu_read_lock_bh(), so the templates are alive.
+ */
+static void
+tfw_cache_front_add(unsigned long key, TfwCacheEntry *ce, TfwCacheTmpl *gz)
+{
+	int i, v = 0;
+	unsigned int n, v_n = UINT_MAX;
+	TfwCacheTmpl *t;
+	TfwCacheFront *f = __this_cpu_read(cache_front);
+	TfwCacheFrontBucket *b = tfw_cache_front_bucket(f, key);
+
+	n = tfw_cache_sketch_estimate(&f->sketch, key);
+	if (n < TFW_CACHE_FRONT_ADMIT)
+		return;
+	/* Gzip hits don't build the identity template. */
+	if (!tfw_cache_entry_resp(ce))
+		return;
+	t = __tfw_cache_entry_tmpl(ce);
+	if (!t)
+		return;
+
+	for (i = 0; i < TFW_CACHE_FRONT_WAYS; ++i) {
+		unsigned int w_n;
+
+		if (b->key[i] == key && b->t[i]) {
+			tfw_cache_front_set(&b->t[i], t);
+			if (gz)
+				tfw_cache_front_set(&b->gz[i], gz);
+			return;
+		}
+		w_n = b->t[i]
+		      ? tfw_cache_sketch_estimate(&f->sketch, b->key[i])
+		      : 0;
+		if (w_n < v_n) {
+			v = i;
+			v_n = w_n;
+		}
+	}
+	if (b->t[v] && n <= v_n)
+		return;
+
+	b->key[v] = key;
+	tfw_cache_front_set(&b->t[v], t);
+	tfw_cache_front_set(&b->gz[v], gz);
+}
+
+/**
+ * Whether requests for @key are frequent enough to fill the front cache.
+ * Must be called with disabled softirqs.
+ */
+static bool
+tfw_cache_front_hot(unsigned long key)
+{
+	TfwCacheFront *f = __this_cpu_read(cache_front);
+
+	return tfw_cache_sketch_estimate(&f->sketch, key)
+	       >= TFW_CACHE_FRONT_HOT;
+}
+
+/**
+ * Account @req for @key and build a response to it if the local front cache
+ * has fresh entry for the key satisfying the request.
+ * @return the response or NULL if the request must be processed through TDB.
+ */
+static TfwHttpResp *
+tfw_cache_front_hit(TfwHttpReq *req, unsigned long key)
+{
+	int i;
+	unsigned long now;
+	unsigned int age;
+	TfwCacheEntry *ce;
+	TfwCacheTmpl *t;
+	TfwCacheFront *f;
+	TfwCacheFrontBucket *b;
+	TfwHttpResp *resp = NULL;
+
+	local_bh_disable();
+
+	f = __this_cpu_read(cache_front);
+	tfw_cache_sketch_inc(&f->sketch, key);
+
+	b = tfw_cache_front_bucket(f, key);
+	for (i = 0; i < TFW_CACHE_FRONT_WAYS; ++i)
+		if (b->key[i] == key && b->t[i])
+			break;
+	if (i == TFW_CACHE_FRONT_WAYS)
+		goto out;
+	t = b->t[i];
+
+	/* The entry is removed, replaced or its template is evicted. */
+	if (ACCESS_ONCE(t->dead)) {
+		tfw_cache_front_set(&b->t[i], NULL);
+		tfw_cache_front_set(&b->gz[i], NULL);
+		goto out;
+	}
+
+	ce = &t->ce;
+	now = get_seconds();
+	age = now > ce->date ? now - ce->date : 0;
+	if (age >= ce->lifetime || !tfw_cache_entry_usable(ce, req)
+	    || !tfw_cache_entry_acceptable(ce, req, age)
+	    || tfw_cache_not_modified(ce, req))
+		goto out;
+
+	if ((ce->flags & TFW_CE_F_GZIP) && !req->range_n
+	    && tfw_cache_req_gzip(req))
+	{
+		/* The gzip variant has the same freshness as the entry. */
+		t = b->gz[i];
+		if (!t || ACCESS_ONCE(t->dead))
+			goto out;
+		resp = req->method == TFW_HTTP_METH_HEAD
+		       ? tfw_cache_head_resp(ce, t->resp, age)
+		       : tfw_cache_hit_resp(ce, t->resp, age);
+		goto out;
+	}
+	resp = tfw_cache_req_resp(ce, t->resp, req, age);
+out:
+	local_bh_enable();
+
+	return resp;
+}
+
+/**
+ * Estimate frequency of requests for @key on all CPUs.
+ * The sketches are read w/o synchronization, so the estimation is rough.
+ */
+static unsigned int
+tfw_cache_sketch_freq(unsigned long key)
+{
+	int cpu;
+	unsigned int n = 0;
+
+	for_each_possible_cpu(cpu) {
+		TfwCacheFront *f = per_cpu(cache_front, cpu);
+		n += tfw_cache_sketch_estimate(&f->sketch, key);
+	}
+
+	return n;
+}
+
+/**
+ * TinyLFU admission filter: a new entry for @key is stored only if it's
+ * requested more often than the eviction victim, i.e. the entry of the least
+ * recently used response template. The victim key is read from the template
+ * copy of the entry, so TDB records aren't accessed w/o the bucket locks.
+ * Responses for already cached keys are always stored since they replace
+ * the cached ones.
+ */
+static bool
+tfw_cache_admit(unsigned long key)
+{
+	unsigned long v_key;
+	TfwCacheEntry *ce;
+
+	if (!cache_cfg.admission)
+		return true;
+
+	ce = tdb_rec_get(db, key);
+	if (ce) {
+		tdb_rec_put(ce);
+		return true;
+	}
+
+	if (!tfw_cache_lru_victim(&v_key))
+		return true;
+
+	return tfw_cache_sketch_freq(key) > tfw_cache_sketch_freq(v_key);
+}
+
+static int
+tfw_cache_front_init(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		TfwCacheFront *f = kzalloc_node(sizeof(*f), GFP_KERNEL,
+						cpu_to_node(cpu));
+		if (!f)
+			return -ENOMEM;
+		per_cpu(cache_front, cpu) = f;
+	}
+
+	return 0;
+}
+
+static void
+tfw_cache_front_exit(void)
+{
+	int cpu, i, w;
+
+	for_each_possible_cpu(cpu) {
+		TfwCacheFront *f = per_cpu(cache_front, cpu);
+
+		if (!f)
+			continue;
+		for (i = 0; i < (1 << TFW_CACHE_FRONT_BITS); ++i)
+			for (w = 0; w < TFW_CACHE_FRONT_WAYS; ++w) {
+				tfw_cache_front_set(&f->b[i].t[w], NULL);
+				tfw_cache_front_set(&f->b[i].gz[w], NULL);
+			}
+		kfree(f);
+		per_cpu(cache_front, cpu) = NULL;
+	}
+}
+
+/*
+ * Cold tier of the cache.
+ *
+ * TDB table is mapped to memory as a whole, so its size is limited by the
+ * reserved memory. Responses which aren't admitted to the table or don't fit
+ * it are demoted to much larger ring file written through the page cache.
+ * The file is written sequentially by cache workers and the oldest responses
+ * are overwritten when the file is full. Only the index of the file contents
+ * is kept in memory, so the cold tier is empty after restart.
+ *
+ * The file is read in process context, so cold hits are served by a cache
+ * work. Responses getting TFW_CACHE_COLD_PROMOTE hits are promoted to TDB.
+ */
+#define TFW_CACHE_COLD_HASH_BITS	16
+#define TFW_CACHE_COLD_PROMOTE		2
+/* A response can take at most 1/16 of the cold tier file. */
+#define TFW_CACHE_COLD_REC_SHIFT	4
+
+/*
+ * Response stored in the cold tier.
+ *
+ * @hnode	- link in the index hash table;
+ * @list	- link in the list of responses ordered by writing time;
+ * @key		- primary cache key of the response;
+ * @gen		- unique number of the written response;
+ * @off		- offset of the response in the cold tier file;
+ * @len		- length of the whole response;
+ * @hdr_len	- length of the response headers w/o the final CRLF;
+ * @date	- time when the response was received;
+ * @lifetime	- freshness lifetime of the response;
+ * @status	- response status code;
+ * @flags	- TFW_CE_F_* flags of the cache entry;
+ * @hits	- number of hits since the response was written;
+ */
+typedef struct {
+	struct hlist_node	hnode;
+	struct list_head	list;
+	unsigned long		key;
+	unsigned long		gen;
+	loff_t			off;
+	size_t			len;
+	unsigned int		hdr_len;
+	unsigned long		date;
+	unsigned int		lifetime;
+	unsigned short		status;
+	unsigned short		flags;
+	unsigned int		hits;
+} TfwCacheCold;
+
+/*
+ * Context of response writing to the cold tier file.
+ * See TfwCacheCopyCtx for the members description.
+ */
+typedef struct {
+	loff_t		off;
+	unsigned char	*crlf;
+	size_t		len;
+	size_t		copied;
+	size_t		hdr_len;
+} TfwCacheColdCtx;
+
+static struct file *cold_fp;
+static loff_t cold_size;
+/* Write position in the file, protected by @cold_mtx. */
+static loff_t cold_pos;
+static unsigned long cold_gen;
+static struct hlist_head *cold_hash;
+static LIST_HEAD(cold_fifo);
+static struct kmem_cache *cold_cache;
+/* Protects the index, i.e. @cold_hash and @cold_fifo. */
+static DEFINE_SPINLOCK(cold_lock);
+/* Serializes the file writers. */
+static DEFINE_MUTEX(cold_mtx);
+
+static TfwCacheCold *
+tfw_cache_cold_find(unsigned long key)
+{
+	TfwCacheCold *c;
+	struct hlist_head *h = &cold_hash[hash_64(key,
+						  TFW_CACHE_COLD_HASH_BITS)];
+
+	hlist_for_each_entry(c, h, hnode)
+		if (c->key == key)
+			return c;
+
+	return NULL;
+}
+
+static void
+tfw_cache_cold_unlink(TfwCacheCold *c)
+{
+	hlist_del(&c->hnode);
+	list_del(&c->list);
+	kmem_cache_free(cold_cache, c);
+}
+
+/**
+ * Forget the cold tier response with primary key @key, e.g. if it's replaced
+ * by a new response or purged.
+ * @return true if the response was in the cold tier.
+ */
+static bool
+tfw_cache_cold_drop(unsigned long key)
+{
+	TfwCacheCold *c;
+
+	if (!cold_fp)
+		return false;
+
+	spin_lock_bh(&cold_lock);
+	c = tfw_cache_cold_find(key);
+	if (c)
+		tfw_cache_cold_unlink(c);
+	spin_unlock_bh(&cold_lock);
+
+	return c;
+}
+
+/**
+ * Copy the index entry of cold tier response with key @key to @c and count
+ * the hit.
+ */
+static bool
+tfw_cache_cold_get(unsigned long key, TfwCacheCold *c)
+{
+	TfwCacheCold *e;
+
+	spin_lock_bh(&cold_lock);
+	e = tfw_cache_cold_find(key);
+	if (e) {
+		++e->hits;
+		*c = *e;
+	}
+	spin_unlock_bh(&cold_lock);
+
+	return e;
+}
+
+/**
+ * Whether the data of response @c read from the file isn't overwritten yet.
+ * Writers drop responses from the index before overwriting them, so the data
+ * read before the call is consistent if the response is still in the index.
+ */
+static bool
+tfw_cache_cold_valid(TfwCacheCold *c)
+{
+	TfwCacheCold *e;
+	bool r;
+
+	spin_lock_bh(&cold_lock);
+	e = tfw_cache_cold_find(c->key);
+	r = e && e->gen == c->gen;
+	spin_unlock_bh(&cold_lock);
+
+	return r;
+}
+
+/**
+ * Reserve @len bytes at the current write position of the cold tier file.
+ * The position wraps around to the file beginning if there is no room at
+ * the end. The oldest responses overlapping the reserved area are dropped.
+ */
+static loff_t
+tfw_cache_cold_reserve(size_t len)
+{
+	TfwCacheCold *c, *tmp;
+	loff_t off = cold_pos;
+
+	spin_lock_bh(&cold_lock);
+	if (off + len > cold_size) {
+		/* Responses beyond the position are the oldest ones. */
+		list_for_each_entry_safe(c, tmp, &cold_fifo, list) {
+			if (c->off < off)
+				break;
+			tfw_cache_cold_unlink(c);
+			tfw_cache_stat_inc(TFW_CACHE_STAT_COLD_EVICTIONS);
+		}
+		off = 0;
+	}
+	list_for_each_entry_safe(c, tmp, &cold_fifo, list) {
+		if (c->off < off || c->off >= off + len)
+			break;
+		tfw_cache_cold_unlink(c);
+		tfw_cache_stat_inc(TFW_CACHE_STAT_COLD_EVICTIONS);
+	}
+	spin_unlock_bh(&cold_lock);
+
+	cold_pos = off + len;
+
+	return off;
+}
+
+/**
+ * Write @len bytes of message data at @data to the cold tier file.
+ * Position of @ctx->crlf in the message is saved if it's found in @data.
+ */
+static int
+tfw_cache_cold_write_data(TfwCacheColdCtx *ctx, unsigned char *data,
+			  size_t len)
+{
+	ssize_t r;
+	loff_t off = ctx->off + ctx->copied;
+	mm_segment_t oldfs = get_fs();
+
+	len = min(len, ctx->len);
+	if (!len)
+		return 0;
+
+	if (ctx->crlf >= data && ctx->crlf < data + len)
+		ctx->hdr_len = ctx->copied + (ctx->crlf - data);
+
+	set_fs(get_ds());
+	r = vfs_write(cold_fp, (char *)data, len, &off);
+	set_fs(oldfs);
+	if (r != len)
+		return r < 0 ? r : -EIO;
+
+	ctx->copied += len;
+	ctx->len -= len;
+
+	return 0;
+}
+
+/**
+ * Write linear, paged and fragmented data of @skb to the cold tier file.
+ * See tfw_cache_copy_skb().
+ */
+static int
+tfw_cache_cold_write_skb(TfwCacheColdCtx *ctx, struct sk_buff *skb)
+{
+	int i, r;
+	struct sk_buff *frag_i;
+
+	r = tfw_cache_cold_write_data(ctx, skb->data, skb_headlen(skb));
+	if (r)
+		return r;
+
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; ++i) {
+		const skb_frag_t *frag = &skb_shinfo(skb)->frags[i];
+		r = tfw_cache_cold_write_data(ctx, skb_frag_address(frag),
+					      skb_frag_size(frag));
+		if (r)
+			return r;
+	}
+
+	skb_walk_frags(skb, frag_i) {
+		r = tfw_cache_cold_write_skb(ctx, frag_i);
+		if (r)
+			return r;
+	}
+
+	return 0;
+}
+
+/**
+ * Write response @resp with primary key @key received at @date to the cold
+ * tier. The response replaces the older one with the same key.
+ * The function must be called in process context.
+ */
+static void
+tfw_cache_cold_store(TfwHttpResp *resp, unsigned long key, unsigned long date,
+		     unsigned int lifetime)
+{
+	TfwCacheCold *c, *old;
+	TfwCacheColdCtx ctx = { .crlf = resp->crlf, .len = resp->msg.len };
+	struct sk_buff *skb;
+
+	if (!cold_fp || ctx.len > cold_size >> TFW_CACHE_COLD_REC_SHIFT)
+		return;
+
+	c = kmem_cache_alloc(cold_cache, GFP_KERNEL);
+	if (!c)
+		return;
+
+	mutex_lock(&cold_mtx);
+
+	ctx.off = tfw_cache_cold_reserve(ctx.len);
+	for (skb = ss_skb_peek(&resp->msg.skb_list); skb && ctx.len;
+	     skb = ss_skb_next(&resp->msg.skb_list, skb))
+	{
+		if (tfw_cache_cold_write_skb(&ctx, skb)) {
+			TFW_WARN("Cache: cannot write HTTP response to cold"
+				 " tier file %s\n", cache_cfg.cold_path);
+			goto err;
+		}
+	}
+	if (ctx.len || !ctx.hdr_len) {
+		TFW_ERR("Cache: bad HTTP response layout\n");
+		goto err;
+	}
+
+	c->key = key;
+	c->off = ctx.off;
+	c->len = ctx.copied;
+	c->hdr_len = ctx.hdr_len;
+	c->date = date;
+	c->lifetime = lifetime;
+	c->status = resp->status;
+	c->flags = resp->flags & TFW_HTTP_CHUNKED ? TFW_CE_F_CHUNKED : 0;
+	c->hits = 0;
+
+	spin_lock_bh(&cold_lock);
+	old = tfw_cache_cold_find(key);
+	if (old)
+		tfw_cache_cold_unlink(old);
+	c->gen = ++cold_gen;
+	hlist_add_head(&c->hnode,
+		       &cold_hash[hash_64(key, TFW_CACHE_COLD_HASH_BITS)]);
+	list_add_tail(&c->list, &cold_fifo);
+	spin_unlock_bh(&cold_lock);
+	tfw_cache_stat_inc(TFW_CACHE_STAT_DEMOTIONS);
+
+	mutex_unlock(&cold_mtx);
+	return;
+err:
+	mutex_unlock(&cold_mtx);
+	kmem_cache_free(cold_cache, c);
+}
+
+static void
+tfw_cache_cold_store_work(struct work_struct *work)
+{
+	TfwCWork *cw = (TfwCWork *)work;
+	TfwHttpResp *resp = cw->cw_resp;
+	unsigned long now = get_seconds();
+	unsigned int lifetime = tfw_cache_lifetime(resp, now);
+
+	if (lifetime)
+		tfw_cache_cold_store(resp, cw->cw_key, now, lifetime);
+
+	/* Process requests waiting for the response. */
+	tfw_cache_fetch_done(cw->cw_key);
+	tfw_http_msg_free((TfwHttpMsg *)resp);
+	kmem_cache_free(c_cache, cw);
+}
+
+/**
+ * Demote response @resp to @req with primary key @key, which isn't stored
+ * in TDB table, to the cold tier. Varying and negative responses as well as
+ * responses to HEAD requests are kept in TDB only.
+ * @return true if the response is written and freed by a work.
+ */
+static bool
+tfw_cache_cold_demote(TfwHttpReq *req, TfwHttpResp *resp, unsigned long key)
+{
+	TfwCWork *cw;
+
+	if (!cold_fp || req->method != TFW_HTTP_METH_GET
+	    || resp->msg.len > cold_size >> TFW_CACHE_COLD_REC_SHIFT
+	    || !tfw_cache_storable(req, resp)
+	    || tfw_cache_neg_ttl(resp->status)
+	    || tfw_http_msg_hdr_find((TfwHttpMsg *)resp, "vary", 4))
+		return false;
+
+	cw = kmem_cache_alloc(c_cache, GFP_ATOMIC);
+	if (!cw)
+		return false;
+	INIT_WORK(&cw->work, tfw_cache_cold_store_work);
+	cw->cw_ce = NULL;
+	cw->cw_resp = resp;
+	cw->cw_key = key;
+	queue_work_on(tfw_cache_sched_work_cpu(numa_node_id()), cache_wq,
+		      (struct work_struct *)cw);
+
+	tfw_cache_uri_add(req, key);
+
+	return true;
+}
+
+/**
+ * Build a response from cold tier response @c: the headers with generated
+ * Age header are read to linear data of the first skb while the body is
+ * read to new pages.
+ */
+static TfwHttpResp *
+tfw_cache_cold_resp(TfwCacheCold *c)
+{
+	int n;
+	size_t off = c->hdr_len + 2;
+	unsigned long now = get_seconds();
+	struct sk_buff *skb;
+	struct page *page;
+	TfwHttpResp *resp;
+
+	resp = tfw_cache_resp_alloc(c->hdr_len, &skb);
+	if (!resp)
+		return NULL;
+
+	n = kernel_read(cold_fp, c->off, skb_tail_pointer(skb), c->hdr_len);
+	if (n != c->hdr_len)
+		goto err;
+	skb_put(skb, n);
+	tfw_cache_resp_age(resp, skb, now > c->date ? now - c->date : 0,
+			   false);
+
+	while (off < c->len) {
+		page = alloc_page(GFP_KERNEL);
+		if (!page)
+			goto err;
+		n = kernel_read(cold_fp, c->off + off, page_address(page),
+				min_t(size_t, c->len - off, PAGE_SIZE));
+		if (n <= 0 || tfw_cache_resp_add_frag(resp, page, 0, n)) {
+			put_page(page);
+			goto err;
+		}
+		off += n;
+	}
+
+	return resp;
+err:
+	TFW_WARN("Cache: cannot read HTTP response from cold tier file %s\n",
+		 cache_cfg.cold_path);
+	tfw_http_msg_free((TfwHttpMsg *)resp);
+	return NULL;
+}
+
+/**
+ * Move cold tier response @c to TDB table. The response stays in the cold
+ * tier if the table has no room for it.
+ */
+static void
+tfw_cache_cold_promote(TfwCacheCold *c)
+{
+	int n;
+	size_t off = 0;
+	TfwCacheEntry *ce, cdata = {
+		.date		= c->date,
+		.lifetime	= c->lifetime,
+		.status		= c->status,
+		.flags		= c->flags,
+	};
+	TdbVRec *trec;
+	char *p, *buf;
+	TfwStr s = { .ptr = NULL };
+
+	buf = (char *)__get_free_page(GFP_KERNEL);
+	if (!buf)
+		return;
+	s.ptr = buf;
+
+	/* The table can already have a new response. */
+	rcu_read_lock_bh();
+	ce = tdb_rec_get(db, c->key);
+	if (ce)
+		tdb_rec_put(ce);
+	rcu_read_unlock_bh();
+	if (ce)
+		goto drop;
+
+	ce = tfw_cache_entry_create(c->key, &cdata, 0);
+	if (!ce)
+		goto out;
+	trec = tdb_entry_add(db, (TdbVRec *)ce, c->len);
+	if (!trec)
+		goto err;
+	p = trec->data;
+	tdb_rec_write_begin();
+	ce->hdrs = (char *)TDB_OFF(db->hdr, p);
+	tfw_cache_entry_written(ce);
+
+	while (off < c->len) {
+		n = kernel_read(cold_fp, c->off + off, buf,
+				min_t(size_t, c->len - off, PAGE_SIZE));
+		if (n <= 0)
+			goto err;
+		s.len = n;
+		if (tfw_cache_copy_str(&p, &trec, &s, c->len - off) != n)
+			goto err;
+		off += n;
+		cond_resched();
+	}
+	if (!tfw_cache_cold_valid(c))
+		goto err;
+
+	tdb_rec_write_begin();
+	ce->body_len = c->len - c->hdr_len - 2;
+	/* Readers don't use the entry until @hdr_len is set. */
+	smp_wmb();
+	ce->hdr_len = c->hdr_len;
+	tfw_cache_entry_written(ce);
+drop:
+	tfw_cache_cold_drop(c->key);
+	goto out;
+err:
+	tdb_rec_remove(db, ce);
+out:
+	free_page((unsigned long)buf);
+}
+
+static void
+tfw_cache_cold_work(struct work_struct *work)
+{
+	TfwCWork *cw = (TfwCWork *)work;
+	TfwHttpResp *resp = NULL;
+	TfwCacheCold c;
+	bool hit = tfw_cache_cold_get(cw->cw_key, &c);
+
+	if (hit) {
+		resp = tfw_cache_cold_resp(&c);
+		if (resp && !tfw_cache_cold_valid(&c)) {
+			tfw_http_msg_free((TfwHttpMsg *)resp);
+			resp = NULL;
+		}
+	}
+
+	/* The client gets the upstream response on failure. */
+	if (resp)
+		tfw_cache_stat_hit(TFW_CACHE_STAT_COLD_HITS, resp);
+	else
+		tfw_cache_stat_inc(TFW_CACHE_STAT_MISSES);
+	local_bh_disable();
+	cw->cw_act(cw->cw_req, resp, cw->cw_data);
+	local_bh_enable();
+
+	if (resp) {
+		tfw_http_msg_free((TfwHttpMsg *)resp);
+		if (c.hits >= TFW_CACHE_COLD_PROMOTE)
+			tfw_cache_cold_promote(&c);
+	}
+
+	kmem_cache_free(c_cache, cw);
+}
+
+/**
+ * Look up the cold tier for request @req with primary key @key which missed
+ * TDB table. Conditional requests and requests restricting the response
+ * freshness are forwarded to upstream.
+ * @return true if the request is processed by a cache work.
+ */
+static bool
+tfw_cache_cold_req(TfwHttpReq *req, unsigned long key,
+		   tfw_http_req_cache_cb_t action, void *data)
+{
+	TfwCacheCold *c;
+	TfwCWork *cw;
+	bool fresh;
+
+	if (!cold_fp || req->method != TFW_HTTP_METH_GET
+	    || (req->cache_ctl.flags & (TFW_HTTP_CC_NO_CACHE
+					| TFW_HTTP_CC_MAX_AGE
+					| TFW_HTTP_CC_MIN_FRESH))
+	    || tfw_cache_req_conditional(req))
+		return false;
+
+	spin_lock_bh(&cold_lock);
+	c = tfw_cache_cold_find(key);
+	fresh = c && get_seconds() < c->date + c->lifetime;
+	/* Stale responses aren't validated in the cold tier. */
+	if (c && !fresh)
+		tfw_cache_cold_unlink(c);
+	spin_unlock_bh(&cold_lock);
+	if (!fresh)
+		return false;
+
+	cw = kmem_cache_alloc(c_cache, GFP_ATOMIC);
+	if (!cw)
+		return false;
+	INIT_WORK(&cw->work, tfw_cache_cold_work);
+	cw->cw_req = req;
+	cw->cw_act = action;
+	cw->cw_data = data;
+	cw->cw_key = key;
+	queue_work_on(tfw_cache_sched_work_cpu(numa_node_id()), cache_wq,
+		      (struct work_struct *)cw);
+
+	return true;
+}
+
+static int
+tfw_cache_cold_init(void)
+{
+	int i, r;
+
+	cold_fp = filp_open(cache_cfg.cold_path, O_CREAT | O_RDWR | O_LARGEFILE,
+			    0600);
+	if (IS_ERR(cold_fp)) {
+		r = PTR_ERR(cold_fp);
+		TFW_ERR("Cannot open cache cold tier file %s, %d\n",
+			cache_cfg.cold_path, r);
+		goto err;
+	}
+	cold_size = (loff_t)cache_cfg.cold_size << 20;
+	r = vfs_truncate(&cold_fp->f_path, cold_size);
+	if (r) {
+		TFW_ERR("Cannot set cache cold tier file %s size\n",
+			cache_cfg.cold_path);
+		goto err_file;
+	}
+
+	r = -ENOMEM;
+	cold_hash = vmalloc(sizeof(*cold_hash) << TFW_CACHE_COLD_HASH_BITS);
+	if (!cold_hash)
+		goto err_file;
+	for (i = 0; i < 1 << TFW_CACHE_COLD_HASH_BITS; ++i)
+		INIT_HLIST_HEAD(&cold_hash[i]);
+
+	cold_cache = kmem_cache_create("tfw_cache_cold", sizeof(TfwCacheCold),
+				       0, 0, NULL);
+	if (!cold_cache)
+		goto err_hash;
+
+	cold_pos = 0;
+
+	return 0;
+err_hash:
+	vfree(cold_hash);
+err_file:
+	filp_close(cold_fp, NULL);
+err:
+	cold_fp = NULL;
+	return r;
+}
+
+/**
+ * Release the cold tier. Cache workers must be stopped.
+ */
+static void
+tfw_cache_cold_exit(void)
+{
+	TfwCacheCold *c, *tmp;
+
+	if (!cold_fp)
+		return;
+
+	list_for_each_entry_safe(c, tmp, &cold_fifo, list)
+		tfw_cache_cold_unlink(c);
+	kmem_cache_destroy(cold_cache);
+	vfree(cold_hash);
+	filp_close(cold_fp, NULL);
+	cold_fp = NULL;
+}
+
+/**
+ * Process @req for entry @key through TDB. Found entries are offered to
+ * the local front cache if @front is true, i.e. we're running on the CPU
+ * which received the request.
+ */
+static void
+__cache_req_process_node(TfwHttpReq *req, unsigned long key,
+			 tfw_http_req_cache_cb_t action, void *data,
+			 bool front)
+{
+	bool validate = false, gzip = false;
+	unsigned long now;
+	unsigned int age;
+	u64 start = local_clock();
+	TfwCacheEntry *ce;
+	TfwHttpResp *body, *resp = NULL;
+
+	rcu_read_lock_bh();
+
+	ce = tfw_cache_entry_get(req, key);
+	tfw_cache_stat_time(TFW_CACHE_HIST_LOOKUP, start);
+	start = local_clock();
+	if (!ce) {
+		/* The request is processed by a work on cold tier hit. */
+		if (tfw_cache_cold_req(req, key, action, data))
+			goto put;
+		goto finish_req_processing;
+	}
+
+	/* TODO process collisions. */
+
+	/* The response is still being written. */
+	if (!ACCESS_ONCE(ce->hdr_len))
+		goto finish_req_processing;
+	smp_rmb();
+	/* The entry is replaced by the upstream response. */
+	if (!tfw_cache_entry_usable(ce, req))
+		goto finish_req_processing;
+
+	/* Current age of the response, RFC 7234 4.2.3. */
+	now = get_seconds();
+	age = now > ce->date ? now - ce->date : 0;
+
+	/* The body is sent as it's received. */
+	if (ce->flags & TFW_CE_F_FILLING) {
+		resp = tfw_cache_filling_resp(ce, req, age);
+		if (!resp && tfw_cache_tail_join(ce, req, key, age, action,
+						  data))
+			goto put;
+		goto finish_req_processing;
+	}
+
+	if (age >= ce->lifetime
+	    && tfw_cache_entry_stale_ok(ce, req, age,
+					cache_cfg.stale_while_revalidate))
+	{
+		/*
+		 * Send the stale response, the first such request is also
+		 * forwarded to upstream server to refresh the entry.
+		 */
+		if (!(req->flags & TFW_HTTP_CACHE_FOLLOWER)
+		    && tfw_cache_fetch_start(key))
+		{
+			req->flags |= TFW_HTTP_CACHE_BACKGROUND;
+			validate = tfw_cache_entry_validators(ce)
+				   && !tfw_cache_req_conditional(req);
+		}
+	}
+	else if (age >= ce->lifetime
+		 || !tfw_cache_entry_acceptable(ce, req, age))
+	{
+		if (tfw_cache_entry_validators(ce)) {
+			/*
+			 * Validate the entry by upstream server unless
+			 * the client validates its own cached response.
+			 */
+			validate = !tfw_cache_req_conditional(req);
+		}
+		else if ((ce->flags & TFW_CE_F_NEGATIVE)
+			 || age >= ce->lifetime + tfw_cache_stale_max())
+		{
+			/* The entry is replaced by the upstream response. */
+			gzip = tfw_cache_entry_remove(ce);
+		}
+		goto finish_req_processing;
+	}
+
+	if (tfw_cache_not_modified(ce, req)) {
+		resp = tfw_cache_nm_resp(ce, age);
+		goto finish_req_processing;
+	}
+
+	/* Entries of varying responses have secondary keys. */
+	front = front && ce->trec.key == key;
+	resp = tfw_cache_gzip_resp(ce, req, age, front);
+	if (resp)
+		goto finish_req_processing;
+
+	/*
+	 * If there are memory issues, then try to send the request
+	 * to backend in hope that we have memory when we get an answer.
+	 */
+	body = tfw_cache_entry_resp(ce);
+	if (body) {
+		resp = tfw_cache_req_resp(ce, body, req, age);
+		if (front && resp)
+			tfw_cache_front_add(key, ce, NULL);
+	}
+
+finish_req_processing:
+
+	if (!resp) {
+		/*
+		 * Background request didn't get the stale response, so
+		 * the client gets the upstream response.
+		 * Other requests wait for the response if it's already
+		 * requested from upstream.
+		 */
+		if (req->flags & TFW_HTTP_CACHE_BACKGROUND)
+			req->flags &= ~TFW_HTTP_CACHE_BACKGROUND;
+		else if (tfw_cache_fetch_join(req, key, action, data))
+			goto put;
+		/* Joined requests are accounted when they're processed. */
+		tfw_cache_stat_inc(TFW_CACHE_STAT_MISSES);
+	} else {
+		tfw_cache_stat_time(TFW_CACHE_HIST_BUILD, start);
+		tfw_cache_stat_hit(age >= ce->lifetime
+				   ? TFW_CACHE_STAT_STALE_HITS
+				   : TFW_CACHE_STAT_HITS, resp);
+	}
+	if (validate)
+		tfw_cache_validate_req(ce, req);
+
+	/*
+	 * TODO perform the call on original CPU to avoid inter-node
+	 * memory transfers.
+	 */
+	action(req, resp, data);
+
+	/* The response is built for the hit only. */
+	if (resp)
+		tfw_http_msg_free((TfwHttpMsg *)resp);
+put:
+	if (ce) {
+		unsigned long ce_key = ce->trec.key;
+
+		tdb_rec_put(ce);
+		if (gzip)
+			tfw_cache_gzip_remove(ce_key);
+	}
+
+	rcu_read_unlock_bh();
+}
+
+/**
+ * Refresh the entry validated by @req with 304 response @resp, RFC 7234 4.3.4.
+ * Freshness lifetime of the entry is updated only if @resp explicitly
+ * specifies it.
+ * @return response built from the refreshed entry or NULL if the entry isn't
+ * available or the client already has it.
+ */
+TfwHttpResp *
+tfw_cache_update(TfwHttpResp *resp, TfwHttpReq *req)
+{
+	unsigned long key, now = get_seconds();
+	TfwCacheEntry *ce;
+	TfwHttpResp *body, *c_resp = NULL;
+
+	if (!cache_cfg.cache)
+		return NULL;
+
+	key = tfw_cache_key_calc(req);
+
+	rcu_read_lock_bh();
+
+	ce = tfw_cache_entry_get(req, key);
+	if (!ce)
+		goto out;
+	if (!ACCESS_ONCE(ce->hdr_len))
+		goto put;
+	smp_rmb();
+	if (ce->flags & TFW_CE_F_FILLING)
+		goto put;
+
+	tdb_rec_write_begin();
+	if ((resp->cache_ctl.flags
+	     & (TFW_HTTP_CC_MAX_AGE | TFW_HTTP_CC_S_MAXAGE))
+	    || resp->expires)
+		ce->lifetime = tfw_cache_lifetime(resp, now);
+	ce->date = now;
+	tfw_cache_entry_written(ce);
+	tfw_cache_entry_release(ce);
+
+	/* The client has already got the stale response. */
+	if (req->flags & TFW_HTTP_CACHE_BACKGROUND)
+		goto put;
+
+	body = tfw_cache_entry_resp(ce);
+	if (body)
+		c_resp = tfw_cache_req_resp(ce, body, req, 0);
+put:
+	tdb_rec_put(ce);
+out:
+	rcu_read_unlock_bh();
+
+	/* Requests waiting for the validation can use the entry now. */
+	tfw_cache_fetch_done(key);
+
+	return c_resp;
+}
+
+/**
+ * Get stale response for @req if upstream server isn't available or responds
+ * with an error, RFC 5861 4.
+ * @return the response built from cache entry or NULL.
+ */
+TfwHttpResp *
+tfw_cache_stale_resp(TfwHttpReq *req)
+{
+	unsigned int age;
+	unsigned long now = get_seconds();
+	TfwCacheEntry *ce;
+	TfwHttpResp *body, *resp = NULL;
+
+	if (!cache_cfg.cache || !cache_cfg.stale_if_error)
+		return NULL;
+
+	rcu_read_lock_bh();
+
+	ce = tfw_cache_entry_get(req, tfw_cache_key_calc(req));
+	if (!ce)
+		goto out;
+	if (!ACCESS_ONCE(ce->hdr_len))
+		goto put;
+	smp_rmb();
+	/* Cached error isn't better than the upstream one. */
+	if ((ce->flags & (TFW_CE_F_FILLING | TFW_CE_F_NEGATIVE))
+	    || !tfw_cache_entry_usable(ce, req))
+		goto put;
+
+	age = now > ce->date ? now - ce->date : 0;
+	if (age >= ce->lifetime
+	    && !tfw_cache_entry_stale_ok(ce, req, age,
+					 cache_cfg.stale_if_error))
+		goto put;
+
+	body = tfw_cache_entry_resp(ce);
+	if (body)
+		resp = tfw_cache_req_resp(ce, body, req, age);
+	if (resp)
+		tfw_cache_stat_hit(TFW_CACHE_STAT_STALE_HITS, resp);
+put:
+	tdb_rec_put(ce);
+out:
+	rcu_read_unlock_bh();
+
+	return resp;
+}
+
+/**
+ * Remove entry with primary key @key.
+ * @return true if the entry was in the cache.
+ */
+static bool
+tfw_cache_purge_key(unsigned long key)
+{
+	TfwCacheEntry *ce;
+	bool cold = tfw_cache_cold_drop(key);
+
+	rcu_read_lock_bh();
+	ce = tdb_rec_get(db, key);
+	if (ce)
+		tfw_cache_entry_drop(ce);
+	rcu_read_unlock_bh();
+
+	return ce || cold;
+}
+
+static void
+tfw_cache_purge_work(struct work_struct *work)
+{
+	TfwCachePurge *pw = container_of(work, TfwCachePurge, work);
+	TfwCacheUri *u, *tmp;
+
+	list_for_each_entry_safe(u, tmp, &pw->uris, list) {
+		tfw_cache_purge_key(u->key);
+		kfree(u);
+		cond_resched();
+	}
+
+	kfree(pw);
+}
+
+/**
+ * Detach all URIs with prefix @uri of length @len from the index and remove
+ * their entries in a work, so large subtrees don't stall softirq.
+ * @return number of purged URIs.
+ */
+static unsigned long
+tfw_cache_purge_prefix(const char *uri, size_t len)
+{
+	unsigned long n = 0;
+	struct rb_node *node, *next;
+	TfwCachePurge *pw;
+
+	pw = kmalloc(sizeof(*pw), GFP_ATOMIC);
+	if (!pw)
+		return 0;
+	INIT_WORK(&pw->work, tfw_cache_purge_work);
+	INIT_LIST_HEAD(&pw->uris);
+
+	spin_lock_bh(&cache_uri_lock);
+	for (node = tfw_cache_uri_lower_bound(uri, len); node; node = next) {
+		TfwCacheUri *u = rb_entry(node, TfwCacheUri, node);
+		if (u->len < len || memcmp(u->uri, uri, len))
+			break;
+		next = rb_next(node);
+		__tfw_cache_uri_detach(u);
+		list_add_tail(&u->list, &pw->uris);
+		++n;
+	}
+	spin_unlock_bh(&cache_uri_lock);
+
+	if (n)
+		queue_work(cache_wq, &pw->work);
+	else
+		kfree(pw);
+
+	return n;
+}
+
+/**
+ * Remove entry for URI @uri of length @len requested by @req.
+ * @return true if the entry was in the cache.
+ */
+static bool
+tfw_cache_purge_uri(TfwHttpReq *req, const char *uri, size_t len)
+{
+	struct rb_node *node;
+	TfwCacheUri *u = NULL;
+	unsigned long key = tfw_cache_key_calc(req);
+
+	spin_lock_bh(&cache_uri_lock);
+	node = len ? tfw_cache_uri_lower_bound(uri, len) : NULL;
+	if (node && !tfw_cache_uri_cmp(rb_entry(node, TfwCacheUri, node),
+				       uri, len))
+	{
+		u = rb_entry(node, TfwCacheUri, node);
+		__tfw_cache_uri_detach(u);
+	}
+	spin_unlock_bh(&cache_uri_lock);
+
+	if (u) {
+		key = u->key;
+		kfree(u);
+	}
+
+	return tfw_cache_purge_key(key);
+}
+
+/**
+ * Whether PURGE request @req came from an allowed address.
+ */
+static bool
+tfw_cache_purge_allowed(TfwHttpReq *req)
+{
+	int i;
+	struct in6_addr addr;
+	struct sock *sk = req->conn->peer->sock;
+
+#if IS_ENABLED(CONFIG_IPV6)
+	if (sk->sk_family == AF_INET6)
+		addr = inet6_sk(sk)->daddr;
+	else
+#endif
+	ipv6_addr_set_v4mapped(inet_sk(sk)->inet_daddr, &addr);
+
+	for (i = 0; i < cache_cfg.purge_acl_n; ++i)
+		if (ipv6_addr_equal(&addr, &cache_cfg.purge_acl[i]))
+			return true;
+
+	return false;
+}
+
+/**
+ * Build response with status line @status and empty body.
+ */
+static TfwHttpResp *
+tfw_cache_status_resp(const char *status)
+{
+	size_t len = strlen(status) + sizeof(TFW_CACHE_NEG_CL "\r\n");
+	struct sk_buff *skb;
+	TfwHttpResp *resp;
+
+	resp = tfw_cache_resp_alloc(len, &skb);
+	if (!resp)
+		return NULL;
+
+	skb_put(skb, snprintf(skb_tail_pointer(skb), len,
+			      "%s" TFW_CACHE_NEG_CL "\r\n", status));
+	resp->msg.len = skb->len;
+
+	return resp;
+}
+
+/**
+ * Process PURGE request @req: remove the entry for the request URI or all
+ * the entries with URI prefix if the request URI ends with '*'.
+ * @return response to the request or NULL on memory allocation failure.
+ */
+TfwHttpResp *
+tfw_cache_purge(TfwHttpReq *req)
+{
+	size_t len;
+	char *uri;
+	bool purged;
+
+	if (!tfw_cache_purge_allowed(req))
+		return tfw_cache_status_resp(TFW_CACHE_PURGE_DENIED);
+	if (!cache_cfg.cache)
+		return tfw_cache_status_resp(TFW_CACHE_PURGE_NF);
+
+	uri = tfw_pool_alloc(req->pool, TFW_CACHE_URI_MAX);
+	if (!uri)
+		return NULL;
+	len = tfw_cache_req_uri(req, uri);
+
+	if (len && uri[len - 1] == '*')
+		purged = tfw_cache_purge_prefix(uri, len - 1);
+	else
+		purged = tfw_cache_purge_uri(req, uri, len);
+
+	TFW_DBG("Cache: purge %.*s: %s\n", (int)len, uri,
+		purged ? "done" : "not found");
+
+	return tfw_cache_status_resp(purged ? TFW_CACHE_PURGE_OK
+					    : TFW_CACHE_PURGE_NF);
+}
+
+static void
+tfw_cache_req_process_node(struct work_struct *work)
+{
+	TfwCWork *cw = (TfwCWork *)work;
+	TfwHttpReq *req = cw->cw_req;
+	tfw_http_req_cache_cb_t action = cw->cw_act;
+	void *data = cw->cw_data;
+
+	__cache_req_process_node(req, cw->cw_key, action, data, false);
+
+	kmem_cache_free(c_cache, cw);
+}
+
+/**
+ * Process @req at node which possesses the cached data required to fulfill
+ * the request. In worse case the request can be assembled in softirq at
+ * one node, the cached response can be prepared at the second node while
+ * the final response is sent by third node (see dev_queue_xmit()).
+ */
+void
+tfw_cache_req_process(TfwHttpReq *req, tfw_http_req_cache_cb_t action,
+		      void *data)
+{
+	int node;
+	unsigned long key;
+	TfwHttpResp *resp;
+
+	if (!cache_cfg.cache) {
+		action(req, NULL, data);
+		return;
+	}
+
+	key = tfw_cache_key_calc(req);
+
+	resp = tfw_cache_front_hit(req, key);
+	if (resp) {
+		tfw_cache_stat_hit(TFW_CACHE_STAT_HITS, resp);
+		action(req, resp, data);
+		tfw_http_msg_free((TfwHttpMsg *)resp);
+		return;
+	}
+
+	/* Hot entries of other nodes are read remotely to fill the front. */
+	node = tfw_cache_key_node(key);
+	if (node != numa_node_id() && !tfw_cache_front_hot(key)) {
+		/*
+		 * Schedule the cache entry to the right node.
+		 *
+		 * TODO work queues are slow, use common kernel threads.
+		 * Probably threading should be at TDB side...
+		 */
+		TfwCWork *cw = kmem_cache_alloc(c_cache, GFP_ATOMIC);
+		if (!cw)
+			goto process_locally;
+		INIT_WORK(&cw->work, tfw_cache_req_process_node);
+		cw->cw_req = req;
+		cw->cw_act = action;
+		cw->cw_data = data;
+		cw->cw_key = key;
+		queue_work_on(tfw_cache_sched_work_cpu(node), cache_wq,
+			      (struct work_struct *)cw);
+		return;
+	}
+
+process_locally:
+	__cache_req_process_node(req, key, action, data, true);
+}
+
+/*
+ * Static content of the document root is loaded to the cache at start and
+ * the changed files are reloaded on each rescan. Rescans compare modification
+ * times of the files w/o opening them, so unchanged files aren't read again.
+ * Loaded entries are refreshed by rescans when a half of their lifetime
+ * passes, so they expire in TFW_CACHE_DOCROOT_TTL after the file is deleted
+ * or rescans are disabled.
+ *
+ * The kernel doesn't export fsnotify to modules, so changes can't be watched.
+ */
+#define TFW_CACHE_DOCROOT_TTL		86400
+#define TFW_CACHE_DOCROOT_DEPTH		16
+#define TFW_CACHE_DOCROOT_INDEX		"index.html"
+/* Maximum length of generated headers of preloaded responses. */
+#define TFW_CACHE_DOCROOT_HDR_MAX	256
+#define TFW_CACHE_DOCROOT_HOST_MAX	255
+
+/* Directory entry collected by tfw_cache_docroot_filldir(). */
+typedef struct {
+	struct list_head	list;
+	unsigned int		type;
+	int			len;
+	char			name[0];
+} TfwCacheDirent;
+
+static const struct {
+	const char	*ext;
+	const char	*type;
+} tfw_cache_mime[] = {
+	{ "css",	"text/css" },
+	{ "gif",	"image/gif" },
+	{ "htm",	"text/html" },
+	{ "html",	"text/html" },
+	{ "ico",	"image/x-icon" },
+	{ "jpeg",	"image/jpeg" },
+	{ "jpg",	"image/jpeg" },
+	{ "js",		"application/javascript" },
+	{ "json",	"application/json" },
+	{ "pdf",	"application/pdf" },
+	{ "png",	"image/png" },
+	{ "svg",	"image/svg+xml" },
+	{ "txt",	"text/plain" },
+	{ "woff",	"application/font-woff" },
+	{ "xml",	"text/xml" },
+};
+
+static const char *tfw_cache_wday[] = {
+	"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+};
+static const char *tfw_cache_month[] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+	"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+static const char *
+tfw_cache_docroot_mime(const char *name, int len)
+{
+	int i;
+	const char *ext = name + len;
+
+	while (ext > name && ext[-1] != '.')
+		--ext;
+	if (ext > name) {
+		len -= ext - name;
+		for (i = 0; i < ARRAY_SIZE(tfw_cache_mime); ++i)
+			if (strlen(tfw_cache_mime[i].ext) == len
+			    && !strncasecmp(tfw_cache_mime[i].ext, ext, len))
+				return tfw_cache_mime[i].type;
+	}
+
+	return "application/octet-stream";
+}
+
+/**
+ * Write HTTP-date (RFC 7231 7.1.1.1) of @t to @buf of size @size.
+ */
+static int
+tfw_cache_http_date(unsigned long t, char *buf, size_t size)
+{
+	struct tm tm;
+
+	time_to_tm(t, 0, &tm);
+
+	return snprintf(buf, size, "%s, %02d %s %04ld %02d:%02d:%02d GMT",
+			tfw_cache_wday[tm.tm_wday], tm.tm_mday,
+			tfw_cache_month[tm.tm_mon], tm.tm_year + 1900,
+			tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+/**
+ * Primary key of preloaded file with URI path @path, see
+ * tfw_cache_key_calc().
+ */
+static unsigned long
+tfw_cache_docroot_key(const char *path, size_t len)
+{
+	char host[sizeof("Host: ") + TFW_CACHE_DOCROOT_HOST_MAX];
+	TfwStr h = { .ptr = host }, u = { .ptr = (void *)path, .len = len };
+
+	h.len = snprintf(host, sizeof(host), "Host: %s",
+			 cache_cfg.docroot_host);
+
+	return (cache_cfg.key_host ? tfw_cache_key_host(&h) : tfw_hash_str(&h))
+	       ^ tfw_cache_key_uri(&u);
+}
+
+/**
+ * Add URI path @path of preloaded file to the purge index.
+ */
+static void
+tfw_cache_docroot_uri_add(const char *path, size_t len, unsigned long key)
+{
+	size_t i, n = strlen(cache_cfg.docroot_host);
+	char *uri;
+
+	if (n + len >= TFW_CACHE_URI_MAX)
+		return;
+	uri = kmalloc(n + len, GFP_KERNEL);
+	if (!uri)
+		return;
+	for (i = 0; i < n; ++i)
+		uri[i] = tolower(cache_cfg.docroot_host[i]);
+	memcpy(uri + n, path, len);
+
+	tfw_cache_uri_insert(uri, n + len, key);
+
+	kfree(uri);
+}
+
+/**
+ * Write headers of response with file @name of size @size modified at
+ * @mtime to @buf and the file validators following @cdata.
+ * @return length of the headers including the final CRLF.
+ */
+static int
+tfw_cache_docroot_hdrs(TfwCacheEntry *cdata, const char *name, int len,
+		       loff_t size, unsigned long mtime, char *buf)
+{
+	char *lm = TFW_CE_ETAG(cdata), *nm;
+
+	cdata->lm_len = tfw_cache_http_date(mtime, lm, 32);
+	nm = lm + cdata->lm_len;
+	cdata->nm_len = sprintf(nm, TFW_CACHE_NM_STATUS
+				"Last-Modified: %.*s\r\n", cdata->lm_len, lm);
+
+	return snprintf(buf, TFW_CACHE_DOCROOT_HDR_MAX,
+		     "HTTP/1.1 200 OK\r\n"
+		     "Content-Type: %s\r\n"
+		     "Content-Length: %lld\r\n"
+		     "Last-Modified: %.*s\r\n"
+		     "\r\n",
+		     tfw_cache_docroot_mime(name, len), size,
+		     cdata->lm_len, lm);
+}
+
+/**
+ * Copy body of file @fp of size @size to the entry record @trec at @p
+ * using @buf of PAGE_SIZE bytes.
+ */
+static int
+tfw_cache_docroot_body(struct file *fp, loff_t size, char *p, TdbVRec *trec,
+		       char *buf)
+{
+	int n;
+	loff_t off = 0;
+	TfwStr s = { .ptr = buf };
+
+	while (off < size) {
+		n = kernel_read(fp, off, buf,
+				min_t(loff_t, size - off, PAGE_SIZE));
+		if (n <= 0)
+			return n ? n : -EIO;
+		s.len = n;
+		if (tfw_cache_copy_str(&p, &trec, &s, size - off) != n)
+			return -ENOMEM;
+		off += n;
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/**
+ * Store file @path with URI path @uri of length @len to the cache.
+ * The file is loaded if it's modified at or after @since or if it isn't
+ * in the cache yet, otherwise the preloaded entry is just refreshed if
+ * it's aged enough.
+ */
+static void
+tfw_cache_docroot_file(const char *path, const char *uri, size_t len,
+		       const char *name, int nlen, unsigned long since,
+		       char *buf)
+{
+	int r, hdr_len;
+	loff_t size;
+	unsigned long mtime, now = get_seconds();
+	unsigned long key = tfw_cache_docroot_key(uri, len);
+	bool fresh = false;
+	TfwCacheEntry *ce, *cdata;
+	TdbVRec *trec;
+	struct file *fp;
+	struct path fpath;
+	struct kstat st;
+	char *p;
+	TfwStr s = { .ptr = buf };
+
+	if (kern_path(path, LOOKUP_FOLLOW, &fpath)) {
+		TFW_WARN("Cannot find cached file %s\n", path);
+		return;
+	}
+	r = vfs_getattr(&fpath, &st);
+	path_put(&fpath);
+	if (r) {
+		TFW_WARN("Cannot stat cached file %s, %d\n", path, r);
+		return;
+	}
+	/* Don't open files which aren't modified since the last scan. */
+	mtime = st.mtime.tv_sec;
+
+	rcu_read_lock_bh();
+	ce = tdb_rec_get(db, key);
+	if (ce) {
+		fresh = (ce->flags & TFW_CE_F_STATIC) && mtime < since;
+		/*
+		 * Refreshing releases the entry template, so it's done
+		 * rarely to keep the template across rescans.
+		 */
+		if (fresh) {
+			if (now - ce->date >= TFW_CACHE_DOCROOT_TTL / 2) {
+				tdb_rec_write_begin();
+				ce->date = now;
+				tfw_cache_entry_written(ce);
+				tfw_cache_entry_release(ce);
+			}
+			tdb_rec_put(ce);
+		} else {
+			tfw_cache_entry_drop(ce);
+		}
+	}
+	rcu_read_unlock_bh();
+	if (fresh)
+		return;
+
+	fp = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+	if (IS_ERR(fp)) {
+		TFW_WARN("Cannot open cached file %s\n", path);
+		return;
+	}
+	mtime = file_inode(fp)->i_mtime.tv_sec;
+	size = i_size_read(file_inode(fp));
 
-		skb_fill_page_desc(skb, f, virt_to_page(data), off, size);
+	/* Buffer for the response headers is followed by the 304 headers. */
+	cdata = kzalloc(sizeof(*cdata) + TFW_CACHE_VALIDATORS_MAX, GFP_KERNEL);
+	if (!cdata)
+		goto out;
+	hdr_len = tfw_cache_docroot_hdrs(cdata, name, nlen, size, mtime, buf);
+	if (hdr_len >= TFW_CACHE_DOCROOT_HDR_MAX)
+		goto out_free;
+	cdata->date = get_seconds();
+	cdata->status = 200;
+	cdata->lifetime = TFW_CACHE_DOCROOT_TTL;
+	cdata->flags = TFW_CE_F_STATIC;
+	ce = tfw_cache_entry_create(key, cdata, cdata->lm_len
+						     + cdata->nm_len);
+	if (!ce)
+		goto out_free;
 
-		++f;
+	trec = tdb_entry_add(db, (TdbVRec *)ce, hdr_len + size);
+	if (!trec) {
+		TFW_WARN("Cannot allocate memory to cache file %s."
+			 " Probably TDB cache is exhausted.\n", path);
+		goto err;
 	}
+	p = trec->data;
+	tdb_rec_write_begin();
+	ce->hdrs = (char *)TDB_OFF(db->hdr, p);
+	tfw_cache_entry_written(ce);
+	s.len = hdr_len;
+	if (tfw_cache_copy_str(&p, &trec, &s, hdr_len + size) != hdr_len)
+		goto err;
+	r = tfw_cache_docroot_body(fp, size, p, trec, buf);
+	if (r) {
+		TFW_WARN("Cannot load file %s to cache, %d\n", path, r);
+		goto err;
+	}
+	tdb_rec_write_begin();
+	ce->body_len = size;
+	/* Readers don't use the entry until @hdr_len is set. */
+	smp_wmb();
+	ce->hdr_len = hdr_len - 2;
+	tfw_cache_entry_written(ce);
 
-	return 0;
-err_skb:
-	tfw_http_msg_free((TfwHttpMsg *)ce->resp);
-	return -ENOMEM;
+	tfw_cache_docroot_uri_add(uri, len, key);
+	goto out_free;
+err:
+	tdb_rec_remove(db, ce);
+out_free:
+	kfree(cdata);
+out:
+	filp_close(fp, NULL);
 }
 
-static void
-__cache_req_process_node(TfwHttpReq *req, unsigned long key,
-			 void (*action)(TfwHttpReq *, TfwHttpResp *, void *),
-			 void *data)
+static int
+tfw_cache_docroot_filldir(void *data, const char *name, int len, loff_t off,
+			  u64 ino, unsigned int type)
 {
-	TfwCacheEntry *ce;
-	TfwHttpResp *resp = NULL;
+	struct list_head *ents = data;
+	TfwCacheDirent *de;
 
-	ce = tdb_rec_get(db, key);
-	if (!ce)
-		goto finish_req_processing;
-
-	/* TODO process collisions. */
-
-	if (!ce->resp)
-		if (tfw_cache_build_resp(ce))
-			/*
-			 * It seems we have the cache entry,
-			 * but there is memory issues.
-			 * Try to send send the request to backend in hope
-			 * that we have memory when we get an answer.
-			 */
-			goto finish_req_processing;
-
-	/* We have already assembled response. */
-	resp = ce->resp;
-
-finish_req_processing:
-
-	/*
-	 * TODO perform the call on original CPU to avoid inter-node
-	 * memory transfers.
-	 */
-	action(req, resp, data);
+	/* Skip hidden files as well as "." and "..". */
+	if (name[0] == '.' || (type != DT_REG && type != DT_DIR))
+		return 0;
 
-	tfw_http_msg_free((TfwHttpMsg *)req);
+	de = kmalloc(sizeof(*de) + len, GFP_KERNEL);
+	if (!de)
+		return -ENOMEM;
+	de->type = type;
+	de->len = len;
+	memcpy(de->name, name, len);
+	list_add_tail(&de->list, ents);
 
-	tdb_rec_put(ce);
+	return 0;
 }
 
+/**
+ * Load files of directory @path of length @plen and its subdirectories.
+ * The directory entries are collected first since files can't be opened
+ * under the directory lock held by vfs_readdir().
+ */
 static void
-tfw_cache_req_process_node(struct work_struct *work)
+tfw_cache_docroot_dir(char *path, size_t plen, size_t root_len, int depth,
+		      unsigned long since, char *buf)
 {
-	TfwCWork *cw = (TfwCWork *)work;
-	TfwHttpReq *req = cw->cw_req;
-	tfw_http_req_cache_cb_t action = cw->cw_act;
-	void *data = cw->cw_data;
+	size_t n, ilen = sizeof(TFW_CACHE_DOCROOT_INDEX) - 1;
+	struct file *dir;
+	TfwCacheDirent *de, *tmp;
+	LIST_HEAD(ents);
+
+	dir = filp_open(path, O_RDONLY | O_DIRECTORY, 0);
+	if (IS_ERR(dir)) {
+		TFW_WARN("Cannot open cached directory %s\n", path);
+		return;
+	}
+	vfs_readdir(dir, tfw_cache_docroot_filldir, &ents);
+	filp_close(dir, NULL);
 
-	__cache_req_process_node(req, cw->cw_key, action, data);
+	list_for_each_entry_safe(de, tmp, &ents, list) {
+		n = plen + 1 + de->len;
+		if (n >= PATH_MAX || kthread_should_stop())
+			goto next;
+		path[plen] = '/';
+		memcpy(path + plen + 1, de->name, de->len);
+		path[n] = '\0';
+
+		if (de->type == DT_DIR) {
+			if (depth < TFW_CACHE_DOCROOT_DEPTH)
+				tfw_cache_docroot_dir(path, n, root_len,
+						      depth + 1, since, buf);
+			goto next;
+		}
+		tfw_cache_docroot_file(path, path + root_len, n - root_len,
+				       de->name, de->len, since, buf);
+		/* Directory index is also served for the directory URI. */
+		if (de->len == ilen
+		    && !memcmp(de->name, TFW_CACHE_DOCROOT_INDEX, ilen))
+			tfw_cache_docroot_file(path, path + root_len,
+					       n - root_len - ilen, de->name,
+					       de->len, since, buf);
+next:
+		list_del(&de->list);
+		kfree(de);
+	}
+	path[plen] = '\0';
 }
 
 /**
- * Process @req at node which possesses the cached data required to fulfill
- * the request. In worse case the request can be assembled in softirq at
- * one node, the cached response can be prepared at the second node while
- * the final response is sent by third node (see dev_queue_xmit()).
+ * Load files of the document root modified since @since to the cache.
  */
-void
-tfw_cache_req_process(TfwHttpReq *req, tfw_http_req_cache_cb_t action,
-		      void *data)
+static void
+tfw_cache_docroot_load(unsigned long since)
 {
-	int node;
-	unsigned long key;
-
-	if (!cache_cfg.cache) {
-		action(req, NULL, data);
-		return;
-	}
+	size_t len = strlen(cache_cfg.docroot);
+	char *path, *buf;
 
-	key = tfw_cache_key_calc(req);
+	path = kmalloc(PATH_MAX, GFP_KERNEL);
+	buf = (char *)__get_free_page(GFP_KERNEL);
+	if (!path || !buf)
+		goto out;
 
-	node = tfw_cache_key_node(key);
-	if (node != numa_node_id()) {
-		/*
-		 * Schedule the cache entry to the right node.
-		 *
-		 * TODO work queues are slow, use common kernel threads.
-		 * Probably threading should be at TDB side...
-		 */
-		TfwCWork *cw = kmem_cache_alloc(c_cache, GFP_ATOMIC);
-		if (!cw)
-			goto process_locally;
-		INIT_WORK(&cw->work, tfw_cache_req_process_node);
-		cw->cw_req = req;
-		cw->cw_act = action;
-		cw->cw_data = data;
-		cw->cw_key = key;
-		queue_work_on(tfw_cache_sched_work_cpu(node), cache_wq,
-			      (struct work_struct *)cw);
-	}
+	/* URI paths of the files begin from the slash after the root. */
+	while (len > 1 && cache_cfg.docroot[len - 1] == '/')
+		--len;
+	memcpy(path, cache_cfg.docroot, len);
+	path[len] = '\0';
 
-process_locally:
-	__cache_req_process_node(req, key, action, data);
+	tfw_cache_docroot_dir(path, len, len, 0, since, buf);
+out:
+	free_page((unsigned long)buf);
+	kfree(path);
 }
 
 /**
  * Cache management thread.
- * The thread loads and preprcess static Web content using inotify (TODO).
+ * The thread loads static Web content of the document root to the cache
+ * in background at start, so clients are served while the files are being
+ * loaded, and reloads changed files each cache_docroot_rescan seconds.
  */
 static int
 tfw_cache_mgr(void *arg)
 {
-	do {
-		/*
-		 * TODO wait while the thread is propagating disk Web data
-		 * to the cache when the server starts.
-		 */
+	unsigned long now, since = get_seconds();
+	bool rescan = cache_cfg.docroot && cache_cfg.docroot_rescan;
+
+	if (cache_cfg.docroot)
+		tfw_cache_docroot_load(0);
 
+	do {
 		if (!freezing(current)) {
 			set_current_state(TASK_INTERRUPTIBLE);
-			schedule();
+			if (rescan)
+				schedule_timeout(cache_cfg.docroot_rescan * HZ);
+			else
+				schedule();
 			__set_current_state(TASK_RUNNING);
 		}
 		else
 			try_to_freeze();
+
+		if (rescan && !kthread_should_stop()) {
+			now = get_seconds();
+			tfw_cache_docroot_load(since);
+			since = now;
+		}
 	} while (!kthread_should_stop());
 
 	return 0;
 }
 
+static const char *tfw_cache_stat_names[] = {
+	[TFW_CACHE_STAT_HITS]		= "hits",
+	[TFW_CACHE_STAT_STALE_HITS]	= "stale_hits",
+	[TFW_CACHE_STAT_MISSES]		= "misses",
+	[TFW_CACHE_STAT_FILLS]		= "fills",
+	[TFW_CACHE_STAT_FILL_ERRS]	= "fill_errors",
+	[TFW_CACHE_STAT_BYTES]		= "bytes_served",
+	[TFW_CACHE_STAT_EVICTIONS]	= "evictions",
+	[TFW_CACHE_STAT_COLD_HITS]	= "cold_hits",
+	[TFW_CACHE_STAT_DEMOTIONS]	= "demotions",
+	[TFW_CACHE_STAT_COLD_EVICTIONS]	= "cold_evictions",
+	[TFW_CACHE_STAT_FROZEN_DROPS]	= "frozen_drops",
+};
+
+static const char *tfw_cache_hist_names[] = {
+	[TFW_CACHE_HIST_LOOKUP]		= "lookup_ns",
+	[TFW_CACHE_HIST_BUILD]		= "build_ns",
+	[TFW_CACHE_HIST_FILL]		= "fill_ns",
+};
+
+/**
+ * Print the cache statistics summed over all CPUs on read of debugfs file
+ * /cache/stats. Counters are printed as "NAME VALUE" lines. Non-empty
+ * buckets of latency histograms are printed as "NAME BOUND COUNT" lines,
+ * where COUNT operations took less than BOUND, but at least BOUND / 2
+ * nanoseconds. The last bucket has no upper bound and is printed as "inf".
+ * Any write to the file resets the statistics.
+ */
+static int
+tfw_cache_stat_debugfs(bool input, char *buf, size_t size)
+{
+	int cpu, i, b, pos = 0;
+	unsigned long n;
+
+	if (input) {
+		for_each_possible_cpu(cpu)
+			memset(&per_cpu(cache_stat, cpu), 0,
+			       sizeof(TfwCacheStat));
+		return 0;
+	}
+
+	for (i = 0; i < TFW_CACHE_STAT_N; ++i) {
+		n = 0;
+		for_each_possible_cpu(cpu)
+			n += per_cpu(cache_stat, cpu).cnt[i];
+		pos += scnprintf(buf + pos, size - pos, "%s %lu\n",
+				 tfw_cache_stat_names[i], n);
+	}
+
+	for (i = 0; i < TFW_CACHE_HIST_N; ++i)
+		for (b = 0; b < TFW_CACHE_HIST_BUCKETS; ++b) {
+			n = 0;
+			for_each_possible_cpu(cpu)
+				n += per_cpu(cache_stat, cpu).hist[i][b];
+			if (!n)
+				continue;
+			if (b == TFW_CACHE_HIST_BUCKETS - 1)
+				pos += scnprintf(buf + pos, size - pos,
+						 "%s inf %lu\n",
+						 tfw_cache_hist_names[i], n);
+			else
+				pos += scnprintf(buf + pos, size - pos,
+						 "%s %lu %lu\n",
+						 tfw_cache_hist_names[i],
+						 1UL << b, n);
+		}
+
+	return pos;
+}
+
 static int
 tfw_cache_start(void)
 {
@@ -520,12 +5998,19 @@ tfw_cache_start(void)
 	if (!cache_cfg.cache)
 		return 0;
 
+	if (cache_cfg.docroot && !cache_cfg.docroot_host) {
+		TFW_ERR("cache_docroot_host must be specified for"
+			" cache_docroot\n");
+		return -EINVAL;
+	}
+
 	/* TODO open db for each node. */
 	db = tdb_open(cache_cfg.db_path, cache_cfg.db_size, 0, numa_node_id());
 	if (!db)
 		return 1;
 
-	cache_mgr_thr = kthread_run(tfw_cache_mgr, NULL, "tfw_cache_mgr");
+	/* The thread is woken up when the cache is ready to store files. */
+	cache_mgr_thr = kthread_create(tfw_cache_mgr, NULL, "tfw_cache_mgr");
 	if (IS_ERR(cache_mgr_thr)) {
 		r = PTR_ERR(cache_mgr_thr);
 		TFW_ERR("Can't start cache manager, %d\n", r);
@@ -536,12 +6021,50 @@ tfw_cache_start(void)
 	if (!c_cache)
 		goto err_cache;
 
+	fetch_cache = kmem_cache_create("tfw_cache_fetch",
+					sizeof(TfwCacheFetch), 0, 0, NULL);
+	if (!fetch_cache)
+		goto err_fetch;
+
 	cache_wq = alloc_workqueue("tfw_cache_wq", WQ_MEM_RECLAIM, 0);
 	if (!cache_wq)
 		goto err_wq;
 
+	r = tfw_cache_front_init();
+	if (r)
+		goto err_front;
+
+	if (cache_cfg.compress) {
+		r = zlib_deflate_workspacesize(-MAX_WBITS, MAX_MEM_LEVEL);
+		cache_gzip_ws = vmalloc(r);
+		if (!cache_gzip_ws) {
+			r = -ENOMEM;
+			goto err_front;
+		}
+	}
+
+	if (cache_cfg.cold_path) {
+		r = tfw_cache_cold_init();
+		if (r)
+			goto err_cold;
+	}
+
+	get_random_bytes(&cache_epoch, sizeof(cache_epoch));
+	register_shrinker(&tfw_cache_shrinker);
+	tfw_debugfs_bind("/cache/stats", tfw_cache_stat_debugfs);
+
+	wake_up_process(cache_mgr_thr);
+
 	return 0;
+err_cold:
+	vfree(cache_gzip_ws);
+	cache_gzip_ws = NULL;
+err_front:
+	tfw_cache_front_exit();
+	destroy_workqueue(cache_wq);
 err_wq:
+	kmem_cache_destroy(fetch_cache);
+err_fetch:
 	kmem_cache_destroy(c_cache);
 err_cache:
 	kthread_stop(cache_mgr_thr);
@@ -556,9 +6079,142 @@ tfw_cache_stop(void)
 	if (!cache_cfg.cache)
 		return;
 
+	kthread_stop(cache_mgr_thr);
+	unregister_shrinker(&tfw_cache_shrinker);
+	cancel_work_sync(&cache_shrink_work);
+	cancel_work_sync(&cache_free_work);
+	tfw_cache_shrink_lru(ULONG_MAX);
+
 	destroy_workqueue(cache_wq);
+	vfree(cache_gzip_ws);
+	cache_gzip_ws = NULL;
+	tfw_cache_cold_exit();
+	tfw_cache_fetch_cleanup();
+	tfw_cache_front_exit();
+	tfw_cache_uri_cleanup();
+	kmem_cache_destroy(fetch_cache);
 	kmem_cache_destroy(c_cache);
-	kthread_stop(cache_mgr_thr);
+}
+
+/**
+ * Parse "cache_negative STATUS TTL" directive.
+ */
+static int
+tfw_cache_cfg_negative(TfwCfgSpec *cs, TfwCfgEntry *e)
+{
+	int status, ttl;
+
+	if (e->val_n != 2 || e->attr_n || e->have_children) {
+		TFW_ERR("cache_negative: status code and TTL are expected\n");
+		return -EINVAL;
+	}
+	if (tfw_cfg_parse_int(e->vals[0], &status)
+	    || tfw_cfg_check_range(status, TFW_CACHE_NEG_MIN,
+				   TFW_CACHE_NEG_MAX))
+	{
+		TFW_ERR("cache_negative: bad status code '%s'\n", e->vals[0]);
+		return -EINVAL;
+	}
+	if (tfw_cfg_parse_int(e->vals[1], &ttl)
+	    || tfw_cfg_check_range(ttl, 1, INT_MAX))
+	{
+		TFW_ERR("cache_negative: bad TTL '%s'\n", e->vals[1]);
+		return -EINVAL;
+	}
+
+	cache_cfg.neg_ttl[status - TFW_CACHE_NEG_MIN] = ttl;
+
+	return 0;
+}
+
+static void
+tfw_cache_cfg_negative_cleanup(TfwCfgSpec *cs)
+{
+	memset(cache_cfg.neg_ttl, 0, sizeof(cache_cfg.neg_ttl));
+}
+
+/**
+ * Parse "cache_purge_acl ADDR..." directive.
+ */
+static int
+tfw_cache_cfg_purge_acl(TfwCfgSpec *cs, TfwCfgEntry *e)
+{
+	int i;
+	TfwAddr addr;
+	struct in6_addr *a;
+
+	if (!e->val_n || e->attr_n || e->have_children) {
+		TFW_ERR("cache_purge_acl: addresses are expected\n");
+		return -EINVAL;
+	}
+
+	for (i = 0; i < e->val_n; ++i) {
+		if (cache_cfg.purge_acl_n == TFW_CACHE_PURGE_ACL_MAX) {
+			TFW_ERR("cache_purge_acl: too many addresses\n");
+			return -EINVAL;
+		}
+		if (tfw_addr_pton(e->vals[i], &addr)) {
+			TFW_ERR("cache_purge_acl: bad address '%s'\n",
+				e->vals[i]);
+			return -EINVAL;
+		}
+		a = &cache_cfg.purge_acl[cache_cfg.purge_acl_n++];
+		if (addr.family == AF_INET6)
+			*a = addr.v6.sin6_addr;
+		else
+			ipv6_addr_set_v4mapped(addr.v4.sin_addr.s_addr, a);
+	}
+
+	return 0;
+}
+
+static void
+tfw_cache_cfg_purge_acl_cleanup(TfwCfgSpec *cs)
+{
+	cache_cfg.purge_acl_n = 0;
+}
+
+/**
+ * Parse "cache_key_query_keep NAME..." and "cache_key_query_drop NAME..."
+ * directives. Names ending with '*' match all parameters with the prefix.
+ */
+static int
+tfw_cache_cfg_key_params(TfwCfgSpec *cs, TfwCfgEntry *e)
+{
+	int i;
+	size_t len;
+	TfwCacheKeyParams *kp = cs->dest;
+
+	if (!e->val_n || e->attr_n || e->have_children) {
+		TFW_ERR("%s: parameter names are expected\n", cs->name);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < e->val_n; ++i) {
+		if (kp->n == TFW_CACHE_KEY_PARAMS_MAX) {
+			TFW_ERR("%s: too many parameters\n", cs->name);
+			return -EINVAL;
+		}
+		len = strlen(e->vals[i]);
+		kp->p[kp->n].prefix = len && e->vals[i][len - 1] == '*';
+		if (kp->p[kp->n].prefix)
+			--len;
+		if (!len || len > TFW_CACHE_KEY_PARAM_LEN) {
+			TFW_ERR("%s: bad parameter name '%s'\n", cs->name,
+				e->vals[i]);
+			return -EINVAL;
+		}
+		memcpy(kp->p[kp->n].name, e->vals[i], len);
+		kp->p[kp->n++].len = len;
+	}
+
+	return 0;
+}
+
+static void
+tfw_cache_cfg_key_params_cleanup(TfwCfgSpec *cs)
+{
+	((TfwCacheKeyParams *)cs->dest)->n = 0;
 }
 
 static TfwCfgSpec tfw_cache_cfg_specs[] = {
@@ -576,6 +6232,144 @@ static TfwCfgSpec tfw_cache_cfg_specs[] = {
 			.range = { PAGE_SIZE, (1 << 30) },
 		}
 	},
+	{
+		"cache_default_ttl", "0",
+		tfw_cfg_set_int,
+		&cache_cfg.default_ttl,
+		&(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		}
+	},
+	{
+		"cache_collapse_timeout", "1000",
+		tfw_cfg_set_int,
+		&cache_cfg.collapse_timeout,
+		&(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		}
+	},
+	{
+		"cache_stale_while_revalidate", "0",
+		tfw_cfg_set_int,
+		&cache_cfg.stale_while_revalidate,
+		&(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		}
+	},
+	{
+		"cache_stale_if_error", "0",
+		tfw_cfg_set_int,
+		&cache_cfg.stale_if_error,
+		&(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		}
+	},
+	{
+		"cache_zero_copy", "off",
+		tfw_cfg_set_bool,
+		&cache_cfg.zero_copy
+	},
+	{
+		"cache_admission", "off",
+		tfw_cfg_set_bool,
+		&cache_cfg.admission
+	},
+	{
+		"cache_stream_min", "0",
+		tfw_cfg_set_int,
+		&cache_cfg.stream_min,
+		&(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		}
+	},
+	{
+		"cache_negative", NULL,
+		tfw_cache_cfg_negative,
+		.allow_none = true,
+		.allow_repeat = true,
+		.cleanup = tfw_cache_cfg_negative_cleanup
+	},
+	{
+		"cache_purge_acl", NULL,
+		tfw_cache_cfg_purge_acl,
+		.allow_none = true,
+		.allow_repeat = true,
+		.cleanup = tfw_cache_cfg_purge_acl_cleanup
+	},
+	{
+		"cache_compress", "off",
+		tfw_cfg_set_bool,
+		&cache_cfg.compress
+	},
+	{
+		"cache_key_host", "off",
+		tfw_cfg_set_bool,
+		&cache_cfg.key_host
+	},
+	{
+		"cache_key_query_sort", "off",
+		tfw_cfg_set_bool,
+		&cache_cfg.key_query_sort
+	},
+	{
+		"cache_key_query_keep", NULL,
+		tfw_cache_cfg_key_params,
+		&cache_cfg.key_query_keep,
+		.allow_none = true,
+		.allow_repeat = true,
+		.cleanup = tfw_cache_cfg_key_params_cleanup
+	},
+	{
+		"cache_key_query_drop", NULL,
+		tfw_cache_cfg_key_params,
+		&cache_cfg.key_query_drop,
+		.allow_none = true,
+		.allow_repeat = true,
+		.cleanup = tfw_cache_cfg_key_params_cleanup
+	},
+	{
+		"cache_docroot", NULL,
+		tfw_cfg_set_str,
+		&cache_cfg.docroot,
+		&(TfwCfgSpecStr) {
+			.len_range = { 1, PATH_MAX - 1 },
+		},
+		.allow_none = true
+	},
+	{
+		"cache_docroot_host", NULL,
+		tfw_cfg_set_str,
+		&cache_cfg.docroot_host,
+		&(TfwCfgSpecStr) {
+			.len_range = { 1, TFW_CACHE_DOCROOT_HOST_MAX },
+		},
+		.allow_none = true
+	},
+	{
+		"cache_docroot_rescan", "10",
+		tfw_cfg_set_int,
+		&cache_cfg.docroot_rescan,
+		&(TfwCfgSpecInt) {
+			.range = { 0, 86400 },
+		}
+	},
+	{
+		"cache_cold_file", NULL,
+		tfw_cfg_set_str,
+		&cache_cfg.cold_path,
+		&(TfwCfgSpecStr) {
+			.len_range = { 1, PATH_MAX - 1 },
+		},
+		.allow_none = true
+	},
+	{
+		"cache_cold_size", "16384",
+		tfw_cfg_set_int,
+		&cache_cfg.cold_size,
+		&(TfwCfgSpecInt) {
+			.range = { 16, INT_MAX },
+		}
+	},
 	{
 		"cache_dir", "/opt/tempesta/cache",
 		tfw_cfg_set_str,
@@ -21,10 +21,135 @@
 #ifndef __TFW_CACHE_H__
 #define __TFW_CACHE_H__
 
+#include "tdb.h"
+
 #include "http.h"
 
+/*
+ * @trec	- Database record descriptor.
+ * @key_len	- length of the entry key;
+ * @hdr_len	- length of the response status line and headers w/o the
+ *		  final CRLF, zero until the response is fully written;
+ * @body_len	- length of the response body;
+ * @date	- time (seconds since epoch) when the response was received;
+ * @lifetime	- freshness lifetime of the response in seconds;
+ * @etag_len	- length of ETag header value;
+ * @lm_len	- length of Last-Modified header value;
+ * @nm_len	- length of status line and headers of 304 response;
+ * @vary_len	- length of the list of request headers which the response
+ *		  varies on, non-zero for primary entries of varying
+ *		  responses only;
+ * @status	- response status code;
+ * @flags	- entry flags;
+ * @key		- the cache enty key (URI + Host header)
+ * @hdrs	- pointer to the stored response: status line and headers are
+ *		  followed by CRLF and the response body;
+ * @tmpl	- response template of the entry or NULL, see TfwCacheTmpl;
+ * @epoch	- cache epoch at which @tmpl was built, so runtime data of
+ *		  entries loaded from previous runs isn't used;
+ * @filled	- number of body bytes written to the entry which is still
+ *		  being filled, see tfw_cache_fill();
+ *
+ * Members from @trec to @flags are directly written to database file.
+ * Data pointers @key and @hdrs are stored as offsets from the database
+ * beginning. If the response has validators, then ETag and Last-Modified
+ * values and 304 response headers follow the structure in the same record,
+ * see tfw_cache_validators_copy(). Entries are always large TDB records,
+ * see tfw_cache_entry_create().
+ *
+ * Responses with Vary header are stored under secondary keys calculated
+ * from the primary key and values of the varied request headers. The primary
+ * key maps to an entry w/o response which keeps only the Vary header list,
+ * see tfw_cache_entry_get().
+ */
+typedef struct {
+	TdbVRec		trec;
+	/* TDB record body begins from the below. */
+	unsigned int	key_len;
+	unsigned int	hdr_len;
+	unsigned long	body_len;
+	unsigned long	date;
+	unsigned int	lifetime;
+	unsigned short	etag_len;
+	unsigned short	lm_len;
+	unsigned short	nm_len;
+	unsigned short	vary_len;
+	unsigned short	status;
+	unsigned int	flags;
+	/* db direct write bound */
+	char		*key;
+	char		*hdrs;
+	/* db conversion bound */
+	struct tfw_cache_tmpl_t *tmpl;
+	unsigned long	epoch;
+	unsigned long	filled;
+} TfwCacheEntry;
+
+/*
+ * Immutable response template of cache entry: the stored headers in linear
+ * data of the first skb and the entry body as paged fragments of next skbs.
+ * The body skbs are cloned for each cache hit and the template memory is
+ * reclaimed on memory pressure.
+ *
+ * @list	- entry in the LRU list of templates linked with entries or in
+ *		  the list of released templates;
+ * @owner	- the entry linked with the template, valid while the template
+ *		  is in the LRU list;
+ * @lru_touch	- time (jiffies) of the template last move in the LRU list;
+ * @refcnt	- references from the entry and the front caches;
+ * @dead	- the entry released the template, so the front caches must
+ *		  drop it;
+ * @resp	- the response template;
+ * @ce		- copy of the entry with its validators, so the front
+ *		  caches serve requests w/o access to TDB records;
+ */
+typedef struct tfw_cache_tmpl_t {
+	struct list_head list;
+	TfwCacheEntry	*owner;
+	unsigned long	lru_touch;
+	atomic_t	refcnt;
+	int		dead;
+	TfwHttpResp	*resp;
+	TfwCacheEntry	ce;
+} TfwCacheTmpl;
+
+/*
+ * Count-min sketch of request frequencies with saturating counters which
+ * are halved each TFW_CACHE_SKETCH_RESET accounted requests.
+ */
+#define TFW_CACHE_SKETCH_BITS	12
+#define TFW_CACHE_SKETCH_ROWS	4
+#define TFW_CACHE_SKETCH_MAX	15
+#define TFW_CACHE_SKETCH_RESET	(10 << TFW_CACHE_SKETCH_BITS)
+
+typedef struct {
+	unsigned char	cnt[TFW_CACHE_SKETCH_ROWS][1 << TFW_CACHE_SKETCH_BITS];
+	unsigned int	samples;
+} TfwCacheSketch;
+
 void tfw_cache_add(TfwHttpResp *resp, TfwHttpReq *req);
+void tfw_cache_fill(TfwHttpResp *resp, TfwHttpReq *req);
+void tfw_cache_fill_abort(TfwHttpResp *resp);
+void tfw_cache_fill_free_skbs(TfwHttpResp *resp);
+bool tfw_cache_resp_buffered(TfwHttpResp *resp, TfwHttpReq *req);
 void tfw_cache_req_process(TfwHttpReq *req, tfw_http_req_cache_cb_t action,
 			   void *data);
+TfwHttpResp *tfw_cache_update(TfwHttpResp *resp, TfwHttpReq *req);
+TfwHttpResp *tfw_cache_stale_resp(TfwHttpReq *req);
+TfwHttpResp *tfw_cache_purge(TfwHttpReq *req);
+void tfw_cache_shrink(void);
+
+/* Cache policy routines, exported for unit tests in debug builds. */
+unsigned int tfw_cache_lifetime(TfwHttpResp *resp, unsigned long now);
+bool tfw_cache_storable(TfwHttpReq *req, TfwHttpResp *resp);
+bool tfw_cache_entry_acceptable(TfwCacheEntry *ce, TfwHttpReq *req,
+				unsigned int age);
+int tfw_cache_ranges(TfwCacheEntry *ce, TfwHttpReq *req, TfwHttpRange *rng);
+unsigned int tfw_cache_sketch_estimate(TfwCacheSketch *sk, unsigned long key);
+void tfw_cache_sketch_inc(TfwCacheSketch *sk, unsigned long key);
+void __tfw_cache_tmpl_link(TfwCacheEntry *ce, TfwCacheTmpl *t);
+void tfw_cache_lru_touch(TfwCacheTmpl *t);
+bool tfw_cache_lru_victim(unsigned long *key);
+unsigned long tfw_cache_shrink_lru(unsigned long nr);
 
 #endif /* __TFW_CACHE_H__ */
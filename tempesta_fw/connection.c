@@ -138,6 +138,19 @@ tfw_connection_send_cli(TfwConnection *conn, TfwMsg *msg)
 	ss_send(clnt->sock, &msg->skb_list);
 }
 
+/**
+ * Send skbs of @msg to the client starting from @skb, the previous skbs
+ * of the message are already sent.
+ */
+void
+tfw_connection_send_cli_from(TfwConnection *conn, TfwMsg *msg,
+			     struct sk_buff *skb)
+{
+	TfwClient *clnt = (TfwClient *)conn->peer;
+
+	ss_send_from(clnt->sock, &msg->skb_list, skb);
+}
+
 void
 tfw_connection_send_srv(TfwConnection *conn, TfwMsg *msg)
 {
@@ -146,6 +159,50 @@ tfw_connection_send_srv(TfwConnection *conn, TfwMsg *msg)
 	ss_send(srv->sock, &msg->skb_list);
 }
 
+/**
+ * Send skbs of @msg to the server starting from @skb, the previous skbs
+ * of the message are already sent.
+ */
+void
+tfw_connection_send_srv_from(TfwConnection *conn, TfwMsg *msg,
+			     struct sk_buff *skb)
+{
+	TfwServer *srv = (TfwServer *)conn->peer;
+
+	ss_send_from(srv->sock, &msg->skb_list, skb);
+}
+
+/**
+ * Stop receiving data on client connection @conn, which data is forwarded to
+ * server connection @srv_conn, while the server connection has no room to
+ * send the data. See ss_throttle().
+ */
+void
+tfw_connection_throttle(TfwConnection *conn, TfwConnection *srv_conn)
+{
+	TfwClient *clnt = (TfwClient *)conn->peer;
+	TfwServer *srv = (TfwServer *)srv_conn->peer;
+
+	ss_throttle(clnt->sock, srv->sock);
+}
+
+/**
+ * Close server connection @conn which can't carry requests any more, e.g.
+ * the server waits for the rest of aborted request. The connection is freed
+ * by the call. The server socket is owned by its struct socket (see
+ * sock_srv.c), so the reference dropped by ss_close() is taken here.
+ */
+void
+tfw_connection_close_srv(TfwConnection *conn)
+{
+	TfwServer *srv = (TfwServer *)conn->peer;
+
+	if (!srv)
+		return;
+	sock_hold(srv->sock);
+	ss_close(srv->sock);
+}
+
 /*
  * ------------------------------------------------------------------------
  * 	Connection Upcalls
@@ -54,6 +54,8 @@ enum {
  * @msg		- currently processing (receiving) message;
  * @peer	- TfwClient or TfwServer handler;
  * @msg_queue	- messages queue to be sent over the connection;
+ * @stream	- message which is sent while it's being received, other
+ *		  messages of @msg_queue are sent after it;
  * @sk_destruct	- original sk->sk_destruct. Destructors passed to
  * 		  tfw_connection_new() must call it manually.
  */
@@ -63,6 +65,7 @@ typedef struct {
 	TfwMsg			*msg;
 	TfwPeer 		*peer;
 	struct list_head	msg_queue;
+	TfwMsg			*stream;
 
 	void (*sk_destruct)(struct sock *sk);
 } TfwConnection;
@@ -97,7 +100,13 @@ typedef struct {
 TfwConnection *tfw_connection_new(struct sock *sk, int type,
 				  void (*destructor)(struct sock *s));
 void tfw_connection_send_cli(TfwConnection *conn, TfwMsg *msg);
+void tfw_connection_send_cli_from(TfwConnection *conn, TfwMsg *msg,
+				  struct sk_buff *skb);
 void tfw_connection_send_srv(TfwConnection *conn, TfwMsg *msg);
+void tfw_connection_send_srv_from(TfwConnection *conn, TfwMsg *msg,
+				  struct sk_buff *skb);
+void tfw_connection_throttle(TfwConnection *conn, TfwConnection *srv_conn);
+void tfw_connection_close_srv(TfwConnection *conn);
 
 void tfw_connection_hooks_register(TfwConnHooks *hooks, int type);
 
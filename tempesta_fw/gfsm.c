@@ -220,6 +220,23 @@ tfw_gfsm_register_hook(int fsm_id, int prio, int state,
 }
 EXPORT_SYMBOL(tfw_gfsm_register_hook);
 
+/**
+ * Whether there is a hook registered for state @state of FSM @fsm_id.
+ */
+bool
+tfw_gfsm_hooked(int fsm_id, int state)
+{
+	int p;
+	unsigned int mask = 1 << (state & TFW_GFSM_STATE_MASK);
+
+	for (p = 0; p < TFW_GFSM_HOOK_PRIORITY_NUM; ++p)
+		if (fsm_hooks_bm[fsm_id][p] & mask)
+			return true;
+
+	return false;
+}
+EXPORT_SYMBOL(tfw_gfsm_hooked);
+
 int
 tfw_gfsm_register_fsm(int fsm_id, tfw_gfsm_handler_t handler)
 {
@@ -45,7 +45,7 @@ tfw_hash_str(const TfwStr *str)
 	const char *body_end;
 	const char *head_end;
 	const char *tail_end;
-	register unsigned long crc = 0xFFFFFFFF;
+	register unsigned long crc = TFW_HASH_INIT;
 	unsigned int len;
 
 	TFW_STR_FOR_EACH_CHUNK(chunk, str) {
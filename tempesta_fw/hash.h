@@ -22,6 +22,20 @@
 
 #include "str.h"
 
+/* Initial value of hash calculated by tfw_hash_chr(), see tfw_hash_str(). */
+#define TFW_HASH_INIT		0xFFFFFFFF
+
 unsigned long tfw_hash_str(const TfwStr *str);
 
+/**
+ * Add character @c to hash @crc. Hash of a string calculated character by
+ * character from TFW_HASH_INIT is equal to tfw_hash_str() of the string.
+ */
+static inline unsigned long
+tfw_hash_chr(unsigned long crc, unsigned char c)
+{
+	asm volatile("crc32b %2, %0" : "=r"(crc) : "0"(crc), "r"(c));
+	return crc;
+}
+
 #endif /* __TFW_HASH_H__ */
@@ -25,6 +25,7 @@
 #include <linux/string.h>
 
 #include "cache.h"
+#include "cfg.h"
 #include "classifier.h"
 #include "gfsm.h"
 #include "hash.h"
@@ -35,6 +36,14 @@
 
 #include "sync_socket.h"
 
+/*
+ * Minimum body length of requests which are forwarded to servers as they're
+ * received and of responses which are forwarded to clients in the same way,
+ * zero disables the forwarding of incomplete messages.
+ */
+static unsigned int tfw_http_req_stream_min;
+static unsigned int tfw_http_resp_stream_min;
+
 TfwMsg *
 tfw_http_conn_msg_alloc(TfwConnection *conn)
 {
@@ -45,6 +54,18 @@ tfw_http_conn_msg_alloc(TfwConnection *conn)
 	hm->conn = conn;
 	tfw_gfsm_state_init(&hm->msg.state, conn, TFW_HTTP_FSM_INIT);
 
+	/*
+	 * Responses come in the same order as requests, so the response
+	 * answers the first request in the queue. Responses to HEAD don't
+	 * have body regardless of Content-Length, RFC 7230 3.3.3.
+	 */
+	if ((TFW_CONN_TYPE(conn) & Conn_Srv) && !list_empty(&conn->msg_queue)) {
+		TfwMsg *req = list_first_entry(&conn->msg_queue, TfwMsg,
+					       msg_list);
+		if (((TfwHttpReq *)req)->method == TFW_HTTP_METH_HEAD)
+			hm->flags |= TFW_HTTP_VOID_BODY;
+	}
+
 	return (TfwMsg *)hm;
 }
 
@@ -57,15 +78,111 @@ tfw_http_conn_init(TfwConnection *conn)
 	return 0;
 }
 
+/**
+ * The streamed request is fully sent to server connection @srv_conn,
+ * send the requests held while the request was sent.
+ */
+static void
+tfw_http_req_stream_done(TfwConnection *srv_conn)
+{
+	TfwMsg *msg;
+
+	srv_conn->stream = NULL;
+	list_for_each_entry(msg, &srv_conn->msg_queue, msg_list) {
+		TfwHttpReq *req = (TfwHttpReq *)msg;
+
+		if (!(req->flags & TFW_HTTP_STREAM_HELD))
+			continue;
+		req->flags &= ~TFW_HTTP_STREAM_HELD;
+		tfw_connection_send_srv(srv_conn, msg);
+	}
+}
+
+/**
+ * The streamed request can't be completed, e.g. the client has closed its
+ * connection, so the server waits for the rest of the request body forever.
+ * Requests held on server connection @srv_conn aren't sent yet, so they're
+ * rescheduled to other server connections and @srv_conn is closed.
+ * The requests are dropped if there is no other server connection.
+ */
+static void
+tfw_http_req_stream_abort(TfwConnection *srv_conn)
+{
+	TfwMsg *msg, *tmp;
+	TfwConnection *conn;
+
+	srv_conn->stream = NULL;
+	list_for_each_entry_safe(msg, tmp, &srv_conn->msg_queue, msg_list) {
+		TfwHttpReq *req = (TfwHttpReq *)msg;
+
+		if (!(req->flags & TFW_HTTP_STREAM_HELD))
+			continue;
+		req->flags &= ~TFW_HTTP_STREAM_HELD;
+		list_del(&msg->msg_list);
+
+		conn = tfw_sched_get_srv_conn(msg);
+		if (!conn || conn == srv_conn) {
+			TFW_WARN("Drop request held by aborted streamed"
+				 " request\n");
+			tfw_http_msg_free((TfwHttpMsg *)req);
+			continue;
+		}
+		list_add_tail(&msg->msg_list, &conn->msg_queue);
+		if (conn->stream)
+			req->flags |= TFW_HTTP_STREAM_HELD;
+		else
+			tfw_connection_send_srv(conn, msg);
+	}
+
+	TFW_DBG("Close server conn=%p with aborted streamed request\n",
+		srv_conn);
+	tfw_connection_close_srv(srv_conn);
+}
+
 static void
 tfw_http_conn_destruct(TfwConnection *conn)
 {
 	TfwMsg *msg, *tmp;
 
+	/* Drop partially written cache entry of incomplete response. */
+	if (conn->msg && (TFW_CONN_TYPE(conn) & Conn_Srv))
+		tfw_cache_fill_abort((TfwHttpResp *)conn->msg);
+	/*
+	 * Partially received streamed request is already queued to the server
+	 * connection, so the server connection frees the request. The server
+	 * connection can't be used by other requests any more.
+	 */
+	if (conn->msg && (TFW_CONN_TYPE(conn) & Conn_Clnt)
+	    && (((TfwHttpReq *)conn->msg)->flags & TFW_HTTP_STREAM))
+	{
+		TfwHttpReq *req = (TfwHttpReq *)conn->msg;
+
+		req->flags &= ~TFW_HTTP_STREAM;
+		if (!list_empty(&req->msg.msg_list))
+			conn->msg = NULL;
+		if (req->stream_conn)
+			tfw_http_req_stream_abort(req->stream_conn);
+	}
 	tfw_http_msg_free((TfwHttpMsg *)conn->msg);
 
-	list_for_each_entry_safe(msg, tmp, &conn->msg_queue, msg_list)
+	/*
+	 * The streamed request which the server has already responded to
+	 * isn't queued, but it's still being sent to the connection.
+	 */
+	if (conn->stream)
+		((TfwHttpReq *)conn->stream)->stream_conn = NULL;
+
+	list_for_each_entry_safe(msg, tmp, &conn->msg_queue, msg_list) {
+		TfwHttpReq *req = (TfwHttpReq *)msg;
+
+		/* Streamed request is still being received by the client. */
+		if (req->flags & TFW_HTTP_STREAM) {
+			list_del_init(&msg->msg_list);
+			req->stream_conn = NULL;
+			continue;
+		}
 		tfw_http_msg_free((TfwHttpMsg *)msg);
+	}
 }
 
 /**
@@ -319,6 +436,16 @@ next_skb:
 						  hm->msg.skb_list.first, \
 						  hm->crlf)
 
+/**
+ * Add header @hdr of length @len, which must be terminated by CRLF,
+ * to @hm just before the message body.
+ */
+int
+tfw_http_msg_hdr_add(TfwHttpMsg *hm, const char *hdr, size_t len)
+{
+	return __hdr_add(hdr, len, hm->msg.skb_list.first, hm->crlf);
+}
+
 static int
 __hdr_delete(TfwStr *hdr, struct sk_buff *skb)
 {
@@ -736,6 +863,13 @@ tfw_http_adjust_resp(TfwHttpResp *resp)
 	return 0;
 }
 
+/**
+ * The cache owns @resp, so it must not be used after the call.
+ * @req is forwarded to the server connection @data on cache miss and freed
+ * on cache hit, so the caller of tfw_cache_req_process() must not use @req
+ * after the call: the callback can be called synchronously or from other
+ * context.
+ */
 static void
 tfw_http_req_cache_cb(TfwHttpReq *req, TfwHttpResp *resp, void *data)
 {
@@ -746,13 +880,123 @@ tfw_http_req_cache_cb(TfwHttpReq *req, TfwHttpResp *resp, void *data)
 		 * We have prepared response, send it as is.
 		 * TODO should we adjust it somehow?
 		 */
-		tfw_connection_send_cli(conn, (TfwMsg *)resp);
-	} else {
-		if (tfw_http_adjust_req(req))
+		tfw_connection_send_cli(req->conn, (TfwMsg *)resp);
+		if (!(req->flags & TFW_HTTP_CACHE_BACKGROUND)) {
+			/* The server won't respond to the request. */
+			list_del(&req->msg.msg_list);
+			tfw_http_msg_free((TfwHttpMsg *)req);
 			return;
-		/* Send the request to appropriate server. */
-		tfw_connection_send_srv(conn, (TfwMsg *)req);
+		}
+		/*
+		 * The stale response is sent, forward the request to
+		 * refresh the cache entry. The server response isn't sent
+		 * to the client.
+		 */
 	}
+
+	if (tfw_http_adjust_req(req))
+		return;
+	/*
+	 * The server connection carries body of streamed request,
+	 * so the request is sent after it.
+	 */
+	if (conn->stream) {
+		req->flags |= TFW_HTTP_STREAM_HELD;
+		return;
+	}
+	/* Send the request to appropriate server. */
+	tfw_connection_send_srv(conn, (TfwMsg *)req);
+}
+
+/**
+ * Send received skbs of streamed request @req which aren't sent yet.
+ * The client connection isn't read while the server connection has
+ * no room for more data.
+ */
+static void
+tfw_http_req_stream_send(TfwHttpReq *req)
+{
+	SsSkbList *skb_list = &req->msg.skb_list;
+	struct sk_buff *skb = req->stream_skb
+			      ? ss_skb_next(skb_list, req->stream_skb)
+			      : ss_skb_peek(skb_list);
+
+	if (!skb)
+		return;
+	tfw_connection_send_srv_from(req->stream_conn, (TfwMsg *)req, skb);
+	req->stream_skb = ss_skb_peek_tail(skb_list);
+	tfw_connection_throttle(req->conn, req->stream_conn);
+}
+
+/**
+ * Forward request @req with large body to a server while the body is being
+ * received. The function is called for each received request chunk: the
+ * server is chosen as soon as the headers are parsed, the adjusted headers
+ * and received part of the body are sent immediately and following chunks
+ * are sent as they're received. The request is queued to the server
+ * connection at once, but the client connection owns the request until
+ * it's fully received.
+ *
+ * Data received from the client is queued to the server socket regardless
+ * of its send buffer, so the client connection isn't read while the server
+ * socket has more data queued than its send buffer size. The client data is
+ * left in the receive queue, so the client receive window isn't reopened
+ * until the server socket sends the queued data.
+ *
+ * Requests which can be served from the cache (see tfw_cache_req_process())
+ * have no body, so streamed requests go to servers directly.
+ */
+static int
+tfw_http_req_stream(TfwHttpReq *req)
+{
+	TfwConnection *srv_conn;
+
+	if (req->flags & TFW_HTTP_STREAM) {
+		/* The server connection is closed. */
+		if (!req->stream_conn)
+			return TFW_BLOCK;
+		tfw_http_req_stream_send(req);
+		return TFW_PASS;
+	}
+
+	/* Wait for the headers. */
+	if (!tfw_http_req_stream_min || !req->crlf)
+		return TFW_PASS;
+	if (unlikely(req->method == TFW_HTTP_METH_PURGE))
+		return TFW_PASS;
+	if (!(req->flags & TFW_HTTP_CHUNKED)
+	    && req->content_length < tfw_http_req_stream_min)
+		return TFW_PASS;
+	/*
+	 * Hooks for the whole request are called when the request is already
+	 * forwarded, so they can't block it. Requests are buffered as usual
+	 * if there are such hooks, e.g. the request limiting classifier.
+	 */
+	if (tfw_gfsm_hooked(TFW_FSM_HTTP, TFW_HTTP_FSM_REQ_MSG))
+		return TFW_PASS;
+
+	/*
+	 * Just buffer the request if there is no server at the moment.
+	 * The server connection is used by the streamed request exclusively,
+	 * so only connections w/o queued requests are taken.
+	 */
+	srv_conn = tfw_sched_get_srv_conn((TfwMsg *)req);
+	if (!srv_conn || !list_empty(&srv_conn->msg_queue))
+		return TFW_PASS;
+
+	if (tfw_http_adjust_req(req))
+		return TFW_BLOCK;
+
+	TFW_DBG("Stream request %p with body length %u to server conn=%p\n",
+		req, req->content_length, srv_conn);
+
+	list_add_tail(&req->msg.msg_list, &srv_conn->msg_queue);
+	srv_conn->stream = (TfwMsg *)req;
+	req->stream_conn = srv_conn;
+	req->flags |= TFW_HTTP_STREAM;
+	tfw_http_req_stream_send(req);
+
+	return TFW_PASS;
 }
 
 /**
@@ -763,6 +1007,7 @@ tfw_http_req_process(TfwConnection *conn, unsigned char *data, size_t len)
 {
 	int r = TFW_BLOCK;
 	TfwHttpReq *req = (TfwHttpReq *)conn->msg;
+	TfwHttpMsg *hm, *done = NULL;
 	TfwConnection *srv_conn;
 
 	BUG_ON(!req);
@@ -772,9 +1017,11 @@ tfw_http_req_process(TfwConnection *conn, unsigned char *data, size_t len)
 
 	/* Process pipelined requests in a loop. */
 	while (1) {
-		TfwHttpMsg *hm;
+		bool pipelined;
 		int msg_off = req->parser.data_off;
 
+		hm = NULL;
+
 		r = tfw_http_parse_req(req, data, len);
 
 		req->msg.len += req->parser.data_off - msg_off;
@@ -795,6 +1042,8 @@ tfw_http_req_process(TfwConnection *conn, unsigned char *data, size_t len)
 					  TFW_HTTP_FSM_REQ_CHUNK, data, len);
 			if (r == TFW_BLOCK)
 				goto block;
+			if (tfw_http_req_stream(req))
+				goto block;
 			return TFW_POSTPONE;
 		case TFW_PASS:
 			/*
@@ -804,12 +1053,72 @@ tfw_http_req_process(TfwConnection *conn, unsigned char *data, size_t len)
 			;
 		}
 
+		/*
+		 * Pipelined requests: create new sibling message before
+		 * the request is passed further, since the cache callback
+		 * can free the request (see tfw_http_req_cache_cb()), even
+		 * concurrently if the request is processed at other node.
+		 */
+		pipelined = req->parser.data_off && req->parser.data_off != len;
+		if (pipelined) {
+			hm = tfw_http_msg_create_sibling((TfwHttpMsg *)req,
+							 Conn_Clnt);
+			if (hm) {
+				tfw_http_parser_msg_inherit((TfwHttpMsg *)req,
+							    hm);
+				/* @req can be freed before the sibling. */
+				hm->msg.prev = NULL;
+			}
+		}
+
+		/* Send the rest of streamed request. */
+		if (req->flags & TFW_HTTP_STREAM) {
+			if (!req->stream_conn)
+				goto block;
+			r = tfw_gfsm_move(&req->msg.state, TFW_HTTP_FSM_REQ_MSG,
+					  data, len);
+			if (r == TFW_BLOCK)
+				goto block;
+			tfw_http_req_stream_send(req);
+			tfw_http_req_stream_done(req->stream_conn);
+			req->flags &= ~TFW_HTTP_STREAM;
+			conn->msg = NULL;
+			/* The server has already responded to the request. */
+			if (list_empty(&req->msg.msg_list))
+				done = (TfwHttpMsg *)req;
+			goto next_req;
+		}
+
+		/*
+		 * PURGE requests are served by the cache. The request is
+		 * freed when the next pipelined request is created from it.
+		 */
+		if (unlikely(req->method == TFW_HTTP_METH_PURGE)) {
+			TfwHttpResp *resp = tfw_cache_purge(req);
+			if (!resp)
+				goto block;
+			conn->msg = NULL;
+			tfw_connection_send_cli(conn, (TfwMsg *)resp);
+			tfw_http_msg_free((TfwHttpMsg *)resp);
+			done = (TfwHttpMsg *)req;
+			goto next_req;
+		}
+
 		/* Dispatch the request to appropriate server. */
 		srv_conn = tfw_sched_get_srv_conn((TfwMsg *)req);
 		if (!srv_conn) {
+			TfwHttpResp *resp;
+
 			TFW_ERR("Can't get an appropriate server connection"
 				" for a session\n");
-			goto block;
+			/* Serve stale response from the cache if we can. */
+			resp = tfw_cache_stale_resp(req);
+			if (!resp)
+				goto block;
+			conn->msg = NULL;
+			tfw_http_req_cache_cb(req, resp, NULL);
+			tfw_http_msg_free((TfwHttpMsg *)resp);
+			goto next_req;
 		}
 
 		/* Request is fully parsed, add it to the connection. */
@@ -823,26 +1132,127 @@ tfw_http_req_process(TfwConnection *conn, unsigned char *data, size_t len)
 		if (r == TFW_BLOCK)
 			goto block;
 
+		/* @req must not be used after the call. */
 		tfw_cache_req_process(req, tfw_http_req_cache_cb, srv_conn);
-
-		if (!req->parser.data_off || req->parser.data_off == len)
+next_req:
+		tfw_http_msg_free(done);
+		done = NULL;
+		if (!pipelined)
 			/* There is no more pending data in skbs. */
 			break;
-
-		/* Pipelined requests: create new sibling message. */
-		hm = tfw_http_msg_create_sibling((TfwHttpMsg *)req, Conn_Clnt);
 		if (!hm)
 			/* Bad... Let's wait little bit... */
 			return TFW_POSTPONE;
-		tfw_http_parser_msg_inherit((TfwHttpMsg *)req, hm);
 		req = (TfwHttpReq *)hm;
 	}
 
 	return r;
 block:
+	tfw_http_msg_free(hm);
 	return TFW_BLOCK;
 }
 
+/**
+ * Get a response from the cache to send instead of upstream response @resp
+ * to @req: refreshed stored response if @resp validates it or stale stored
+ * response if @resp is a server error (RFC 7234 4.3.4, RFC 5861 4).
+ */
+static TfwHttpResp *
+tfw_http_resp_cached(TfwHttpResp *resp, TfwHttpReq *req)
+{
+	if ((req->flags & TFW_HTTP_CACHE_VALIDATE) && resp->status == 304)
+		return tfw_cache_update(resp, req);
+	if (req->flags & TFW_HTTP_CACHE_BACKGROUND)
+		return NULL;
+
+	switch (resp->status) {
+	case 500: case 502: case 503: case 504:
+		return tfw_cache_stale_resp(req);
+	default:
+		return NULL;
+	}
+}
+
+/**
+ * Send response @resp to the client of @req. Only the skbs which aren't
+ * sent yet are sent for streamed response.
+ */
+static void
+tfw_http_resp_send(TfwHttpResp *resp, TfwHttpReq *req)
+{
+	SsSkbList *skb_list = &resp->msg.skb_list;
+	struct sk_buff *skb;
+
+	if (!(resp->flags & TFW_HTTP_STREAM)) {
+		tfw_connection_send_cli(req->conn, (TfwMsg *)resp);
+		return;
+	}
+
+	skb = resp->stream_skb ? ss_skb_next(skb_list, resp->stream_skb)
+			       : ss_skb_peek(skb_list);
+	if (!skb)
+		return;
+	tfw_connection_send_cli_from(req->conn, (TfwMsg *)resp, skb);
+	resp->stream_skb = ss_skb_peek_tail(skb_list);
+}
+
+/**
+ * Forward response @resp to @req with large body to the client while the body
+ * is being received. The function is called for each received response
+ * chunk: when the headers are parsed, the response filters are run for the
+ * headers and the headers with received part of the body are sent to the
+ * client, following chunks are sent as they're received.
+ *
+ * The response is buffered as usual if it can be replaced by a cached one
+ * (see tfw_http_resp_cached()) or if the cache needs the whole response.
+ */
+static int
+tfw_http_resp_stream(TfwHttpResp *resp, TfwHttpReq *req, unsigned char *data,
+		     size_t len)
+{
+	int r;
+
+	if (resp->flags & TFW_HTTP_STREAM) {
+		tfw_http_resp_send(resp, req);
+		return TFW_PASS;
+	}
+
+	/* Wait for the headers. */
+	if (!tfw_http_resp_stream_min || !resp->crlf
+	    || (resp->flags & TFW_HTTP_VOID_BODY))
+		return TFW_PASS;
+	if (!(resp->flags & TFW_HTTP_CHUNKED)
+	    && resp->content_length < tfw_http_resp_stream_min)
+		return TFW_PASS;
+	if (req->flags & (TFW_HTTP_CACHE_VALIDATE | TFW_HTTP_CACHE_BACKGROUND))
+		return TFW_PASS;
+	switch (resp->status) {
+	case 500: case 502: case 503: case 504:
+		return TFW_PASS;
+	}
+	if (tfw_cache_resp_buffered(resp, req))
+		return TFW_PASS;
+
+	/* The filters see the headers only. */
+	r = tfw_gfsm_move(&resp->msg.state, TFW_HTTP_FSM_LOCAL_RESP_FILTER,
+			  data, len);
+	if (r == TFW_BLOCK)
+		return TFW_BLOCK;
+	if (r != TFW_PASS)
+		return TFW_PASS;
+
+	if (tfw_http_adjust_resp(resp))
+		return TFW_BLOCK;
+
+	TFW_DBG("Stream response %p with body length %u to client conn=%p\n",
+		resp, resp->content_length, req->conn);
+
+	resp->flags |= TFW_HTTP_STREAM;
+	tfw_http_resp_send(resp, req);
+
+	return TFW_PASS;
+}
+
 /**
  * @return number of processed bytes on success and negative value otherwise.
  */
@@ -877,6 +1287,19 @@ tfw_http_resp_process(TfwConnection *conn, unsigned char *data, size_t len)
 				  data, len);
 		if (r == TFW_BLOCK)
 			goto block;
+		/*
+		 * Write large responses to the cache as they're received
+		 * and send them to clients before the whole response.
+		 */
+		if (!list_empty(&conn->msg_queue)) {
+			TfwMsg *req_msg = list_first_entry(&conn->msg_queue,
+							   TfwMsg, msg_list);
+			tfw_cache_fill(resp, (TfwHttpReq *)req_msg);
+			if (tfw_http_resp_stream(resp, (TfwHttpReq *)req_msg,
+						 data, len))
+				goto block;
+			tfw_cache_fill_free_skbs(resp);
+		}
 		return TFW_POSTPONE;
 	case TFW_PASS:
 		tfw_http_establish_skb_hdrs((TfwHttpMsg *)resp);
@@ -887,15 +1310,22 @@ tfw_http_resp_process(TfwConnection *conn, unsigned char *data, size_t len)
 		/* fall through */
 	}
 
-	/* The response is fully parsed, process it. */
-
-	r = tfw_gfsm_move(&resp->msg.state, TFW_HTTP_FSM_LOCAL_RESP_FILTER,
-			  data, len);
+	/*
+	 * The response is fully parsed, process it.
+	 * The filters have already seen the headers of streamed response.
+	 */
+	if (resp->flags & TFW_HTTP_STREAM)
+		r = TFW_PASS;
+	else
+		r = tfw_gfsm_move(&resp->msg.state,
+				  TFW_HTTP_FSM_LOCAL_RESP_FILTER, data, len);
 	if (r == TFW_PASS) {
 		TfwMsg *req_msg;
 		TfwHttpReq *req;
+		TfwHttpResp *c_resp;
 
-		if (tfw_http_adjust_resp(resp))
+		if (!(resp->flags & TFW_HTTP_STREAM)
+		    && tfw_http_adjust_resp(resp))
 			goto block;
 
 		/*
@@ -908,24 +1338,48 @@ tfw_http_resp_process(TfwConnection *conn, unsigned char *data, size_t len)
 			goto block;
 		}
 		req_msg = list_first_entry(&conn->msg_queue, TfwMsg, msg_list);
+		req = (TfwHttpReq *)req_msg;
+
+		/*
+		 * The server responded before the streamed request is fully
+		 * received, e.g. with 413 error. The client connection still
+		 * owns the request and frees it when the request is received.
+		 */
+		if (unlikely(req->flags & TFW_HTTP_STREAM)) {
+			list_del_init(&req_msg->msg_list);
+			tfw_http_resp_send(resp, req);
+			tfw_cache_fill_abort(resp);
+			tfw_http_msg_free((TfwHttpMsg *)resp);
+			return r;
+		}
 		list_del(&req_msg->msg_list);
 
 		/*
-		 * Send the response to client before caching it.
+		 * Send the response, or the cached one replacing it, to
+		 * client before caching it. Clients of background requests
+		 * have already got stale responses.
 		 * The cache frees the response.
 		 */
-		req = (TfwHttpReq *)req_msg;
-		tfw_connection_send_cli(req->conn, (TfwMsg *)resp);
+		c_resp = tfw_http_resp_cached(resp, req);
+		if (c_resp) {
+			tfw_connection_send_cli(req->conn, (TfwMsg *)c_resp);
+			tfw_http_msg_free((TfwHttpMsg *)c_resp);
+		}
+		else if (!(req->flags & TFW_HTTP_CACHE_BACKGROUND)) {
+			tfw_http_resp_send(resp, req);
+		}
 
 		tfw_cache_add(resp, req);
 	}
 	else if (r == TFW_BLOCK) {
+		tfw_cache_fill_abort(resp);
 		tfw_pool_free(resp->pool);
 		conn->msg = NULL;
 	}
 
 	return r;
 block:
+	tfw_cache_fill_abort(resp);
 	tfw_http_msg_free((TfwHttpMsg *)resp);
 	return TFW_BLOCK;
 }
@@ -958,6 +1412,31 @@ tfw_http_req_key_calc(const TfwHttpReq *req)
 }
 EXPORT_SYMBOL(tfw_http_req_key_calc);
 
+static TfwCfgSpec tfw_http_cfg_specs[] = {
+	{
+		"request_stream_min", "0",
+		tfw_cfg_set_int,
+		&tfw_http_req_stream_min,
+		&(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		}
+	},
+	{
+		"response_stream_min", "0",
+		tfw_cfg_set_int,
+		&tfw_http_resp_stream_min,
+		&(TfwCfgSpecInt) {
+			.range = { 0, INT_MAX },
+		}
+	},
+	{}
+};
+
+TfwCfgMod tfw_http_cfg_mod = {
+	.name	= "http",
+	.specs	= tfw_http_cfg_specs,
+};
+
 static TfwConnHooks http_conn_hooks = {
 	.conn_init	= tfw_http_conn_init,
 	.conn_destruct	= tfw_http_conn_destruct,
@@ -31,11 +31,14 @@
 #define TFW_HTTP_PF_CR			0x01
 #define TFW_HTTP_PF_LF			0x02
 #define TFW_HTTP_PF_CRLF		(TFW_HTTP_PF_CR | TFW_HTTP_PF_LF)
+/* Parsed date is after February, so it's shifted by a leap day. */
+#define TFW_HTTP_PF_PAST_FEB		0x04
 
 typedef enum {
 	TFW_HTTP_METH_GET	= 0,
 	TFW_HTTP_METH_HEAD	= 1,
 	TFW_HTTP_METH_POST	= 2,
+	TFW_HTTP_METH_PURGE	= 3,
 } tfw_http_meth_t;
 
 #define TFW_HTTP_CC_NO_CACHE		0x001
@@ -47,6 +50,10 @@ typedef enum {
 #define TFW_HTTP_CC_PROXY_REV		0x040
 #define TFW_HTTP_CC_PUBLIC		0x080
 #define TFW_HTTP_CC_PRIVATE		0x100
+/* Directives with values, the values are meaningful if the flag is set. */
+#define TFW_HTTP_CC_MAX_AGE		0x200
+#define TFW_HTTP_CC_S_MAXAGE		0x400
+#define TFW_HTTP_CC_MIN_FRESH		0x800
 typedef struct {
 	unsigned int	flags;
 	unsigned int	max_age;
@@ -93,9 +100,20 @@ typedef enum {
 	TFW_HTTP_HDR_NUM_MAX	= PAGE_SIZE / sizeof(int) / 2
 } tfw_http_hdr_t;
 
+/*
+ * Number of well-known header names which are resolved to ids,
+ * see tfw_http_msg_hdr_id().
+ */
+#define TFW_HTTP_HID_NUM	67
+
+/**
+ * @next	- position of the next raw header with the same name id,
+ *		  zero terminates the list (see @h_idx of TfwHttpMsg).
+ */
 typedef struct {
 	TfwStr		field;
 	struct sk_buff	*skb;
+	unsigned short	next;
 } TfwHttpHdr;
 
 typedef struct {
@@ -113,10 +131,24 @@ typedef struct {
 #define TFW_HTTP_CONN_KA		0x0002
 #define __TFW_HTTP_CONN_MASK		(TFW_HTTP_CONN_CLOSE | TFW_HTTP_CONN_KA)
 #define TFW_HTTP_CHUNKED		0x0004
+#define TFW_HTTP_STREAM			0x0008	/* body is sent as received */
+
+/* Request flags. */
+#define TFW_HTTP_CACHE_VALIDATE		0x0100	/* validates cache entry */
+#define TFW_HTTP_CACHE_FOLLOWER		0x0200	/* waited for cache fetch */
+#define TFW_HTTP_CACHE_BACKGROUND	0x0400	/* got stale cached response */
+#define TFW_HTTP_STREAM_HELD		0x0800	/* waits for stream end */
+
+/* Response flags. */
+#define TFW_HTTP_VOID_BODY		0x1000	/* response has no body */
 
 /**
  * Common HTTP message members.
  *
+ * @h_idx	- position in @h_tbl of the first raw header for each
+ *		  well-known header name id, so the headers are found without
+ *		  scanning of the table (special headers are at fixed
+ *		  positions);
  * @conn	- connection which the message was received on;
  * @crlf	- pointer to CRLF between headers and body
  */
@@ -124,6 +156,7 @@ typedef struct {
 	TfwMsg		msg;						\
 	TfwPool		*pool;						\
 	TfwHttpHdrTbl	*h_tbl;						\
+	unsigned short	h_idx[TFW_HTTP_HID_NUM];			\
 	TfwHttpParser	parser;						\
 	TfwCacheControl	cache_ctl;					\
 	unsigned int	flags;						\
@@ -140,24 +173,57 @@ typedef struct {
 	TFW_HTTP_MSG_COMMON;
 } TfwHttpMsg;
 
+/* Maximum number of processed byte ranges of Range header. */
+#define TFW_HTTP_RANGES_MAX	8
+#define TFW_HTTP_RANGE_NONE	UINT_MAX
+
+/**
+ * Byte range of Range request header, RFC 7233 2.1.
+ * @first is TFW_HTTP_RANGE_NONE for suffix range of last @last bytes and
+ * @last is TFW_HTTP_RANGE_NONE for range lasting to the representation end.
+ */
+typedef struct {
+	unsigned int	first;
+	unsigned int	last;
+} TfwHttpRange;
+
 /**
  * HTTP Request.
  *
  * @host	- host in URI, may differ from Host header;
  * @uri_path	- path + query + fragment from URI (RFC3986.3);
+ * @range_n	- number of byte ranges in Range header;
+ * @range	- byte ranges of Range header;
+ * @stream_conn	- server connection which the request body is forwarded
+ *		  to while it's being received (see TFW_HTTP_STREAM);
+ * @stream_skb	- last skb of the request already sent to @stream_conn;
  */
 typedef struct {
 	TFW_HTTP_MSG_COMMON;
 	unsigned char		method;
+	unsigned char		range_n;
 	TfwStr			host;
 	TfwStr			uri_path;
+	TfwHttpRange		range[TFW_HTTP_RANGES_MAX];
+	TfwConnection		*stream_conn;
+	struct sk_buff		*stream_skb;
 } TfwHttpReq;
 
+/**
+ * HTTP Response.
+ *
+ * @cache_fill	- state of the response writing to the cache while it's
+ *		  being received, see tfw_cache_fill();
+ * @stream_skb	- last skb of the response already sent to the client while
+ *		  the response is being received (see TFW_HTTP_STREAM);
+ */
 typedef struct {
 	TFW_HTTP_MSG_COMMON;
 	unsigned short	status;
 	unsigned int	keep_alive;
 	unsigned int	expires;
+	void		*cache_fill;
+	struct sk_buff	*stream_skb;
 } TfwHttpResp;
 
 typedef void (*tfw_http_req_cache_cb_t)(TfwHttpReq *, TfwHttpResp *, void *);
@@ -63,6 +63,7 @@
 #include <linux/cache.h>
 #include "http_match.h"
 #include "http.h"
+#include "http_msg.h"
 
 /*
  * Use -DTFW_HTTP_MATCH_DBG_LVL=N to increase verbosity just for this unit.
@@ -215,25 +216,48 @@ match_hdr(const TfwHttpReq *req, const TfwHttpMatchRule *rule)
 	return hdr_val_eq(req, id, rule->arg.str, rule->arg.len, flags);
 }
 
+/**
+ * Match a raw header rule. If the rule contains well-known header name,
+ * then only the special headers and the headers with the same name id are
+ * compared, so the headers table isn't scanned.
+ */
 static bool
 match_hdr_raw(const TfwHttpReq *req, const TfwHttpMatchRule *rule)
 {
 	TfwStr *hdr;
-	int i;
+	int i, hid = -1;
+	const char *colon;
+	TfwHttpHdrTbl *ht = req->h_tbl;
 	tfw_str_eq_flags_t flags = map_op_to_str_eq_flags(rule->op);
 
 	/* It would be hard to apply some header-specific rules here, so ignore
 	 * case for all headers according to the robustness principle. */
 	flags |= TFW_STR_EQ_CASEI;
 
-	for (i = 0; i < req->h_tbl->size; ++i) {
-		hdr = &req->h_tbl->tbl[i].field;
+	/* TODO: handle LWS* between header and value for raw headers.
+	 * (currently "X-Hdr:foo" is not equal to "X-Hdr: foo").
+	 */
+	colon = memchr(rule->arg.str, ':', rule->arg.len);
+	if (colon)
+		hid = tfw_http_msg_hdr_id(rule->arg.str, colon - rule->arg.str);
+	if (hid >= 0) {
+		for (i = 0; i < TFW_HTTP_HDR_RAW; ++i) {
+			hdr = &ht->tbl[i].field;
+			if (hdr->len && tfw_str_eq_cstr(hdr, rule->arg.str,
+							rule->arg.len, flags))
+				return true;
+		}
+		for (i = req->h_idx[hid]; i; i = ht->tbl[i].next)
+			if (tfw_str_eq_cstr(&ht->tbl[i].field, rule->arg.str,
+					    rule->arg.len, flags))
+				return true;
+		return false;
+	}
+
+	for (i = 0; i < ht->size; ++i) {
+		hdr = &ht->tbl[i].field;
 		if (!hdr->len)
 			continue;
-
-		/* TODO: handle LWS* between header and value for raw headers.
-		 * (currently "X-Hdr:foo" is not equal to "X-Hdr: foo").
-		 */
 		if (tfw_str_eq_cstr(hdr, rule->arg.str, rule->arg.len, flags))
 			return true;
 	}
@@ -241,7 +265,6 @@ match_hdr_raw(const TfwHttpReq *req, const TfwHttpMatchRule *rule)
 	return false;
 }
 
-
 typedef bool (*match_fn)(const TfwHttpReq *, const TfwHttpMatchRule *);
 
 static const match_fn
@@ -18,11 +18,264 @@
  * this program; if not, write to the Free Software Foundation, Inc., 59
  * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
+#include <linux/ctype.h>
+#include <linux/string.h>
+
 #include "gfsm.h"
 #include "http.h"
 #include "http_msg.h"
 #include "lib.h"
 
+/*
+ * Well-known header names resolved by perfect hash, see tfw_http_msg_hdr_id().
+ * The names are lower case and sorted, ids are indexes in the table.
+ * @slot is the fixed position of special headers in the headers table.
+ */
+#define TFW_HTTP_HID_NAME_MAX	27
+#define TFW_HTTP_HID_SEED	0x5755
+
+#define __HID(s)		{ s, sizeof(s) - 1, TFW_HTTP_HDR_RAW }
+#define __HID_SPEC(s, slot)	{ s, sizeof(s) - 1, slot }
+
+static const struct {
+	const char	*name;
+	unsigned char	len;
+	unsigned char	slot;
+} tfw_http_hid_names[TFW_HTTP_HID_NUM] = {
+	__HID("accept"),
+	__HID("accept-charset"),
+	__HID("accept-encoding"),
+	__HID("accept-language"),
+	__HID("accept-ranges"),
+	__HID("access-control-allow-origin"),
+	__HID("age"),
+	__HID("allow"),
+	__HID("authorization"),
+	__HID("cache-control"),
+	__HID_SPEC("connection", TFW_HTTP_HDR_CONNECTION),
+	__HID("content-disposition"),
+	__HID("content-encoding"),
+	__HID("content-language"),
+	__HID("content-length"),
+	__HID("content-location"),
+	__HID("content-range"),
+	__HID("content-type"),
+	__HID("cookie"),
+	__HID("date"),
+	__HID("dnt"),
+	__HID("etag"),
+	__HID("expect"),
+	__HID("expires"),
+	__HID("forwarded"),
+	__HID("from"),
+	__HID_SPEC("host", TFW_HTTP_HDR_HOST),
+	__HID("if-match"),
+	__HID("if-modified-since"),
+	__HID("if-none-match"),
+	__HID("if-range"),
+	__HID("if-unmodified-since"),
+	__HID("keep-alive"),
+	__HID("last-modified"),
+	__HID("link"),
+	__HID("location"),
+	__HID("max-forwards"),
+	__HID("origin"),
+	__HID("pragma"),
+	__HID("proxy-authenticate"),
+	__HID("proxy-authorization"),
+	__HID("proxy-connection"),
+	__HID("range"),
+	__HID("referer"),
+	__HID("refresh"),
+	__HID("retry-after"),
+	__HID("server"),
+	__HID("set-cookie"),
+	__HID("strict-transport-security"),
+	__HID("te"),
+	__HID("trailer"),
+	__HID("transfer-encoding"),
+	__HID("upgrade"),
+	__HID("upgrade-insecure-requests"),
+	__HID("user-agent"),
+	__HID("vary"),
+	__HID("via"),
+	__HID("warning"),
+	__HID("www-authenticate"),
+	__HID("x-content-type-options"),
+	__HID_SPEC("x-forwarded-for", TFW_HTTP_HDR_X_FORWARDED_FOR),
+	__HID("x-forwarded-host"),
+	__HID("x-forwarded-proto"),
+	__HID("x-frame-options"),
+	__HID("x-real-ip"),
+	__HID("x-requested-with"),
+	__HID("x-xss-protection"),
+};
+
+/*
+ * The table maps the hash to id + 1, zero means no well-known header with
+ * the hash. The table is generated by searching for such @seed that
+ *
+ *	for (h = 0, i = 0; i < len; ++i)
+ *		h = h * 31 + name[i];
+ *	slot = (h * seed) >> 24;
+ *
+ * (32-bit arithmetic) gives unique slots for all the names.
+ */
+static const unsigned char tfw_http_hid_tbl[256] ____cacheline_aligned = {
+	32,  0,  0, 20, 50,  0,  0,  0,  0, 34,  0,  0,  0,  0,  0, 52,
+	 0, 30,  0, 17,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0, 61,  0, 45,  0,  0, 40, 58,
+	48,  0,  0,  0,  0,  0, 60, 44,  0,  0,  0,  0,  0, 10,  0,  0,
+	 0, 49, 22,  0,  0,  0,  0,  0, 33, 62, 35,  0,  0,  0,  0,  0,
+	 0, 29,  1,  0,  0,  0,  0,  0, 41,  0,  0, 54,  0,  0,  0, 12,
+	42,  0,  0,  6, 23,  0,  0,  0, 26,  0,  0,  0,  0, 11,  0, 15,
+	 0,  0,  0,  0,  0,  0,  0,  0, 37,  0,  0,  0,  0,  0,  0,  0,
+	 7,  0,  0,  0, 21, 39,  0,  0,  0,  0,  0,  0,  0, 66,  0,  9,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 55, 57,  0,  8,  0,  0,
+	 0,  0,  0,  0, 43,  0,  0,  0,  0, 53,  0,  0,  0,  0, 36,  0,
+	 0,  0,  0, 27,  0,  0,  0,  0, 51, 18,  0, 67, 38, 13,  0,  0,
+	 0,  0, 28,  0, 31,  0,  3,  0, 14,  0,  0,  0,  0, 56,  0,  0,
+	47,  4,  0,  0,  0, 64, 16,  0, 63,  0,  0,  0, 46,  0,  0,  0,
+	 0,  0,  0,  0,  0, 59,  0,  0,  0, 24,  0, 25,  5,  0,  0,  0,
+	 0,  0,  0, 19,  2, 65,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+};
+
+/**
+ * Resolve header name @name of length @n (without the colon) to the id
+ * of the well-known header. The name is case insensitive.
+ * @return the id or -1 if the name is unknown.
+ */
+int
+tfw_http_msg_hdr_id(const char *name, int n)
+{
+	int i, id;
+	unsigned int h = 0;
+
+	if (n > TFW_HTTP_HID_NAME_MAX)
+		return -1;
+	for (i = 0; i < n; ++i)
+		h = h * 31 + tolower(name[i]);
+
+	id = tfw_http_hid_tbl[(h * TFW_HTTP_HID_SEED) >> 24] - 1;
+	if (id < 0 || tfw_http_hid_names[id].len != n
+	    || strncasecmp(tfw_http_hid_names[id].name, name, n))
+		return -1;
+
+	return id;
+}
+DEBUG_EXPORT_SYMBOL(tfw_http_msg_hdr_id);
+
+/**
+ * Get the well-known header id by the name part of header string @hdr.
+ * The name can be split among several chunks.
+ */
+static int
+__hdr_str_id(const TfwStr *hdr)
+{
+	int n = 0;
+	char buf[TFW_HTTP_HID_NAME_MAX];
+	const TfwStr *c;
+
+	TFW_STR_FOR_EACH_CHUNK(c, hdr) {
+		const char *p = c->ptr, *end = p + c->len;
+
+		for ( ; p < end; ++p) {
+			if (*p == ':' || *p == ' ' || *p == '\t')
+				return tfw_http_msg_hdr_id(buf, n);
+			if (n == TFW_HTTP_HID_NAME_MAX)
+				return -1;
+			buf[n++] = *p;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Link fully read raw header at position @pos of @hm headers table to the
+ * list of headers with the same name id. The parser calls the function
+ * for each header, so lookups of well-known headers are O(1) and the
+ * duplicate headers are kept in the order they appear in the message.
+ */
+void
+tfw_http_msg_hdr_index(TfwHttpMsg *hm, unsigned int pos)
+{
+	unsigned short *i;
+	TfwHttpHdrTbl *ht = hm->h_tbl;
+	int hid = __hdr_str_id(&ht->tbl[pos].field);
+
+	if (hid < 0)
+		return;
+
+	for (i = &hm->h_idx[hid]; *i; i = &ht->tbl[*i].next)
+		;
+	*i = pos;
+}
+
+/**
+ * Find header @name of length @n in @hm headers table.
+ * Well-known headers are found by the id index, other headers are looked
+ * up by scanning of the raw headers.
+ * @return the first found header ("Name: value" string) or NULL.
+ */
+TfwStr *
+tfw_http_msg_hdr_find(TfwHttpMsg *hm, const char *name, int n)
+{
+	int i, hid = tfw_http_msg_hdr_id(name, n);
+	TfwHttpHdrTbl *ht = hm->h_tbl;
+
+	if (hid >= 0) {
+		i = tfw_http_hid_names[hid].slot;
+		if (i < TFW_HTTP_HDR_RAW && ht->tbl[i].field.ptr)
+			return &ht->tbl[i].field;
+		i = hm->h_idx[hid];
+		return i ? &ht->tbl[i].field : NULL;
+	}
+
+	for (i = TFW_HTTP_HDR_RAW; i < ht->off; ++i) {
+		TfwStr *hdr = &ht->tbl[i].field;
+		if (!hdr->ptr)
+			continue;
+		if (tfw_str_eq_kv(hdr, name, n, ':', "", 0, TFW_STR_EQ_PREFIX))
+			return hdr;
+	}
+
+	return NULL;
+}
+DEBUG_EXPORT_SYMBOL(tfw_http_msg_hdr_find);
+
+/**
+ * Copy value of raw header @name of length @n to @buf of size @size.
+ * Spaces around the value are skipped, the value is zero-terminated.
+ * @return length of the value or zero if there is no such header or the
+ * header doesn't fit @buf.
+ */
+size_t
+tfw_http_msg_hdr_val(TfwHttpMsg *hm, const char *name, int n, char *buf,
+		     size_t size)
+{
+	size_t len;
+	char *v, *end;
+	TfwStr *hdr = tfw_http_msg_hdr_find(hm, name, n);
+
+	if (!hdr || tfw_str_len(hdr) >= size)
+		return 0;
+
+	len = tfw_str_to_cstr(hdr, buf, size);
+	v = memchr(buf, ':', len);
+	BUG_ON(!v);
+	for (++v, end = buf + len; v < end && isspace(*v); ++v)
+		;
+	while (end > v && isspace(end[-1]))
+		--end;
+	len = end - v;
+	memmove(buf, v, len);
+	buf[len] = '\0';
+
+	return len;
+}
+DEBUG_EXPORT_SYMBOL(tfw_http_msg_hdr_val);
+
 /**
  * The function does not free @m->skb_list, the caller is responsible for that.
  */
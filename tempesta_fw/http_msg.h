@@ -24,5 +24,11 @@
 
 TfwHttpMsg *tfw_http_msg_alloc(int type);
 void tfw_http_msg_free(TfwHttpMsg *m);
+int tfw_http_msg_hdr_id(const char *name, int n);
+void tfw_http_msg_hdr_index(TfwHttpMsg *hm, unsigned int pos);
+TfwStr *tfw_http_msg_hdr_find(TfwHttpMsg *hm, const char *name, int n);
+size_t tfw_http_msg_hdr_val(TfwHttpMsg *hm, const char *name, int n,
+			    char *buf, size_t size);
+int tfw_http_msg_hdr_add(TfwHttpMsg *hm, const char *hdr, size_t len);
 
 #endif /* __TFW_HTTP_MSG_H__ */
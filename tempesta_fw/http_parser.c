@@ -32,6 +32,7 @@
 
 #include "gfsm.h"
 #include "http.h"
+#include "http_msg.h"
 #include "lib.h"
 
 /*
@@ -48,7 +49,7 @@ __field_finish(TfwStr *field, unsigned char *begin, unsigned char *end)
 	if (unlikely(field->flags & TFW_STR_COMPOUND)) {
 		TfwStr *last = (TfwStr *)field->ptr + field->len - 1;
 		if (unlikely(begin == end)) {
-			BUG_ON(field->len >= 2);
+			BUG_ON(field->len < 2);
 			if (--field->len == 1)
 				/*
 				 * Last/second chunk is empty
@@ -70,6 +71,20 @@ __field_finish(TfwStr *field, unsigned char *begin, unsigned char *end)
 	}
 }
 
+/**
+ * The field continues in the next data chunk, so set length of its current
+ * chunk lasting till the end of current data [@begin, @end).
+ */
+static inline void
+__field_postpone(TfwStr *field, unsigned char *begin, unsigned char *end)
+{
+	TfwStr *c = TFW_STR_CURR(field);
+
+	if (!c->ptr)
+		c->ptr = begin;
+	c->len = end - (unsigned char *)c->ptr;
+}
+
 #define __FSM_START(s)							\
 int __fsm_const_state;							\
 parser->data_off = 0; /* new data chunk */				\
@@ -87,9 +102,11 @@ st: __attribute__((unused)) 						\
 
 #define __FSM_EXIT(field)						\
 do {									\
-	if (field) /* staticaly resolved */				\
+	if (field) { /* staticaly resolved */				\
+		__field_postpone(field, data, data + len);		\
 		if (unlikely(!tfw_str_add_compound(msg->pool, field)))	\
 			return TFW_BLOCK;				\
+	}								\
 	goto done;							\
 } while (0)
 
@@ -204,6 +221,76 @@ static const unsigned long hdr_a[] ____cacheline_aligned = {
 
 #define IN_ALPHABET(c, a)	(a[c >> 6] & (1UL << (c & 0x3f)))
 
+/*
+ * Fast paths for long runs of characters, e.g. URIs and header values,
+ * which are skipped at once instead of a state dispatch per character.
+ *
+ * The data is scanned word at a time on general purpose registers: SIMD
+ * instructions require kernel_fpu_begin() in the kernel, which saves FPU
+ * state and costs more than scanning of typical URI or header value.
+ */
+#define TFW_ONES_LONG	0x0101010101010101UL
+#define TFW_HIGHS_LONG	0x8080808080808080UL
+/* Whether word @w has a zero byte. */
+#define HAS_ZERO_BYTE(w)	(((w) - TFW_ONES_LONG) & ~(w) & TFW_HIGHS_LONG)
+
+/**
+ * Find the first @c1 or @c2 character in @p of length @len.
+ * The same as two memchr() calls, but the data is read only once.
+ */
+static inline unsigned char *
+__data_chr2(unsigned char *p, size_t len, unsigned char c1, unsigned char c2)
+{
+	unsigned long w, m1 = TFW_ONES_LONG * c1, m2 = TFW_ONES_LONG * c2;
+	unsigned char *end = p + len;
+
+	for ( ; p + sizeof(long) <= end; p += sizeof(long)) {
+		w = *(unsigned long *)p;
+		if (HAS_ZERO_BYTE(w ^ m1) | HAS_ZERO_BYTE(w ^ m2))
+			break;
+	}
+	for ( ; p < end; ++p)
+		if (*p == c1 || *p == c2)
+			return p;
+
+	return NULL;
+}
+
+/**
+ * Find the first @c character in @p of length @len, see memchr().
+ */
+static inline unsigned char *
+__data_chr(unsigned char *p, size_t len, unsigned char c)
+{
+	return __data_chr2(p, len, c, c);
+}
+
+/**
+ * Get length of the leading run of characters of @p of length @len from
+ * alphabet @a. The loop is unrolled since the runs are mostly long.
+ */
+static inline size_t
+__data_span(const unsigned char *p, size_t len, const unsigned long *a)
+{
+	const unsigned char *s = p, *end = p + len;
+
+	for ( ; p + 4 <= end; p += 4) {
+		if (!IN_ALPHABET(p[0], a))
+			return p - s;
+		if (!IN_ALPHABET(p[1], a))
+			return p - s + 1;
+		if (!IN_ALPHABET(p[2], a))
+			return p - s + 2;
+		if (!IN_ALPHABET(p[3], a))
+			return p - s + 3;
+	}
+	for ( ; p < end; ++p)
+		if (!IN_ALPHABET(*p, a))
+			break;
+
+	return p - s;
+}
+
 /**
  * Prepare the parser to process a new message in the same data chunk.
  */
@@ -357,6 +444,30 @@ parse_int_list(TfwStr *chunk, unsigned char *data, size_t len, unsigned int *acc
 	return __parse_int_a(chunk, data, len, ws_coma_a, acc);
 }
 
+/**
+ * Parse an integer as part of byte range.
+ */
+static inline int
+parse_int_range(TfwStr *chunk, unsigned char *data, size_t len,
+		unsigned int *acc)
+{
+	/*
+	 * Standard white-space plus coma and hyphen characters:
+	 * '\t' (0x09) horizontal tab (TAB)
+	 * '\n' (0x0a) newline (LF)
+	 * '\v' (0x0b) vertical tab (VT)
+	 * '\f' (0x0c) feed (FF)
+	 * '\r' (0x0d) carriage return (CR)
+	 * ' '  (0x20) space (SPC)
+	 * ','  (0x2c) coma
+	 * '-'  (0x2d) hyphen
+	 */
+	static const unsigned long ws_range_a[] ____cacheline_aligned = {
+		0x0000300100003e00UL, 0, 0, 0
+	};
+	return __parse_int_a(chunk, data, len, ws_range_a, acc);
+}
+
 /**
  * Parse probably chunked string representation of an hexadecimal integer.
  * Returns number of parsed bytes (in data, w/o stored chunk) on success
@@ -496,6 +607,11 @@ do {									\
 do {									\
 	TFW_DBG("parse msg body: flags=%#x content_length=%d\n",	\
 		msg->flags, msg->content_length);			\
+	/* RFC 7230 3.3.3: response to HEAD never has body. */		\
+	if (msg->flags & TFW_HTTP_VOID_BODY) {				\
+		r = TFW_PASS;						\
+		FSM_EXIT();						\
+	}								\
 	/* RFC 2616 4.4: firstly check chunked transfer encoding. */	\
 	if (msg->flags & TFW_HTTP_CHUNKED)				\
 		__FSM_B_MOVE(to_state);					\
@@ -656,19 +772,12 @@ __parse_connection(TfwHttpMsg *msg, unsigned char *data, size_t *lenrval)
 	 * it could be names of any headers, including custom headers.
 	 */
 	__FSM_STATE(I_ConnOther) {
-		/*
-		 * TODO
-		 * - replace double memchr() below by a strspn() analog
-		 *   that accepts string length instead of processing
-		 *   null-terminated strings.
-		 */
 		size_t plen = len - (size_t)(p - data);
-		unsigned char *lf = memchr(p, '\n', plen);
-		unsigned char *comma = memchr(p, ',', plen);
-		if (comma && (!lf || (lf && (comma < lf))))
-			__FSM_I_MOVE_n(I_EoT, comma - p);
-		if (lf)
-			__FSM_I_MOVE_n(I_EoL, lf - p);
+		unsigned char *d = __data_chr2(p, plen, '\n', ',');
+		if (d && *d == ',')
+			__FSM_I_MOVE_n(I_EoT, d - p);
+		if (d)
+			__FSM_I_MOVE_n(I_EoL, d - p);
 		return CSTR_POSTPONE;
 	}
 
@@ -780,18 +889,14 @@ __parse_transfer_encoding(TfwHttpMsg *msg, unsigned char *data, size_t *lenrval)
 		/*
 		 * TODO
 		 * - process transfer encodings:
-		 *   gzip, deflate, identity, compress;
-		 * - replace double memchr() below by a strspn() analog
-		 *   that accepts string length instead of processing
-		 *   null-terminated strings.
+		 *   gzip, deflate, identity, compress.
 		 */
 		size_t plen = len - (size_t)(p - data);
-		unsigned char *lf = memchr(p, '\n', plen);
-		unsigned char *comma = memchr(p, ',', plen);
-		if (comma && (!lf || (lf && (comma < lf))))
-			__FSM_I_MOVE_n(I_EoT, comma - p);
-		if (lf)
-			__FSM_I_MOVE_n(I_EoL, lf - p);
+		unsigned char *d = __data_chr2(p, plen, '\n', ',');
+		if (d && *d == ',')
+			__FSM_I_MOVE_n(I_EoT, d - p);
+		if (d)
+			__FSM_I_MOVE_n(I_EoL, d - p);
 		return CSTR_POSTPONE;
 	}
 
@@ -888,9 +993,14 @@ __store_header(TfwHttpMsg *hm, unsigned char *data, long len, int id,
 	TFW_DBG("store header w/ ptr=%p len=%d flags=%x id=%d\n",
 		h->ptr, h->len, h->flags, id);
 
-	/* Move the offset forward if current header is fully read. */
-	if (close && (id == ht->off))
+	/*
+	 * Move the offset forward if current header is fully read
+	 * and add the header to the name index.
+	 */
+	if (close && (id == ht->off)) {
+		tfw_http_msg_hdr_index(hm, id);
 		ht->off++;
+	}
 }
 
 #define STORE_HEADER(rmsg, id, len)	__store_header((TfwHttpMsg *)rmsg, \
@@ -1034,6 +1144,12 @@ enum {
 	Req_HdrX_Forwarded_Fo,
 	Req_HdrX_Forwarded_For,
 	Req_HdrX_Forwarded_ForV,
+	Req_HdrR,
+	Req_HdrRa,
+	Req_HdrRan,
+	Req_HdrRang,
+	Req_HdrRange,
+	Req_HdrRangeV,
 	Req_HdrOther,
 	Req_HdrDone,
 	/* Body */
@@ -1075,6 +1191,17 @@ enum {
 	Req_I_XFF_Node_Id,
 	Req_I_XFF_Sep,
 	Req_I_XFF_EoL,
+	/* Range header */
+	Req_I_Range,
+	Req_I_Range_Spec,
+	Req_I_Range_First,
+	Req_I_Range_Hyphen,
+	Req_I_Range_Last,
+	Req_I_Range_Suffix,
+	Req_I_Range_EoT,
+	Req_I_Range_Sep,
+	Req_I_Range_Ext,
+	Req_I_Range_EoL,
 };
 
 /**
@@ -1136,6 +1263,7 @@ __req_parse_cache_control(TfwHttpReq *req, unsigned char *data, size_t *lenrval)
 		if (n < 0)
 			return n;
 		req->cache_ctl.max_age = acc;
+		req->cache_ctl.flags |= TFW_HTTP_CC_MAX_AGE;
 		__FSM_I_MOVE_n(Req_I_CC_EoT, n);
 	}
 
@@ -1146,24 +1274,21 @@ __req_parse_cache_control(TfwHttpReq *req, unsigned char *data, size_t *lenrval)
 		if (n < 0)
 			return n;
 		req->cache_ctl.max_fresh = acc;
+		req->cache_ctl.flags |= TFW_HTTP_CC_MIN_FRESH;
 		__FSM_I_MOVE_n(Req_I_CC_EoT, n);
 	}
 
 	__FSM_STATE(Req_I_CC_Ext) {
 		/*
 		 * TODO
-		 * - process cache extensions;
-		 * - replace double memchr() below by a strspn() analog
-		 *   that accepts string length instead of processing
-		 *   null-terminated strings.
+		 * - process cache extensions.
 		 */
 		size_t plen = len - (size_t)(p - data);
-		unsigned char *lf = memchr(p, '\n', plen);
-		unsigned char *comma = memchr(p, ',', plen);
-		if (comma && (!lf || (lf && (comma < lf))))
-			__FSM_I_MOVE_n(Req_I_CC_EoT, comma - p);
-		if (lf)
-			__FSM_I_MOVE_n(Req_I_CC_EoL, lf - p);
+		unsigned char *d = __data_chr2(p, plen, '\n', ',');
+		if (d && *d == ',')
+			__FSM_I_MOVE_n(Req_I_CC_EoT, d - p);
+		if (d)
+			__FSM_I_MOVE_n(Req_I_CC_EoL, d - p);
 		return CSTR_POSTPONE;
 	}
 
@@ -1178,8 +1303,9 @@ __req_parse_cache_control(TfwHttpReq *req, unsigned char *data, size_t *lenrval)
 		 */
 		if (c == '=')
 			__FSM_I_MOVE(Req_I_CC_Ext);
+		/* Next directive starts at current character. */
 		if (IN_ALPHABET(c, hdr_a))
-			__FSM_I_MOVE(Req_I_CC);
+			__FSM_I_JMP(Req_I_CC);
 		if (!isspace(c))
 			return CSTR_NEQ;
 		/* fall through */
@@ -1340,6 +1466,138 @@ done:
 	return r;
 }
 
+/**
+ * Parse request Range header, RFC 7233 3.1.
+ * Only byte ranges are processed, the header with other range units or with
+ * more than TFW_HTTP_RANGES_MAX ranges is ignored.
+ */
+static int
+__req_parse_range(TfwHttpReq *req, unsigned char *data, size_t *lenrval)
+{
+	int r = CSTR_NEQ;
+	TfwHttpParser *parser = &req->parser;
+	TfwStr *chunk = &parser->_tmp_chunk;
+	unsigned char *p = data;
+	size_t len = *lenrval;
+	unsigned char c = *p;
+	bool hlen_set = false;
+
+	__FSM_START(parser->_i_st) {
+
+	__FSM_STATE(Req_I_Range) {
+		TRY_STR("bytes=", Req_I_Range_Spec);
+		__FSM_I_MOVE_n(Req_I_Range_Ext, 0);
+	}
+
+	__FSM_STATE(Req_I_Range_Spec) {
+		if (unlikely(req->range_n == TFW_HTTP_RANGES_MAX)) {
+			req->range_n = 0;
+			__FSM_I_MOVE_n(Req_I_Range_Ext, 0);
+		}
+		if (c == '-')
+			__FSM_I_MOVE(Req_I_Range_Suffix);
+		__FSM_I_JMP(Req_I_Range_First);
+	}
+
+	__FSM_STATE(Req_I_Range_First) {
+		unsigned int acc = 0;
+		size_t plen = len - (size_t)(p - data);
+		int n = parse_int_range(chunk, p, plen, &acc);
+		if (n < 0)
+			return n;
+		req->range[req->range_n].first = acc;
+		__FSM_I_MOVE_n(Req_I_Range_Hyphen, n);
+	}
+
+	__FSM_STATE(Req_I_Range_Hyphen) {
+		if (likely(c == '-'))
+			__FSM_I_MOVE(Req_I_Range_Last);
+		return CSTR_NEQ;
+	}
+
+	__FSM_STATE(Req_I_Range_Last) {
+		unsigned int acc = 0;
+		size_t plen = len - (size_t)(p - data);
+		TfwHttpRange *rng = &req->range[req->range_n];
+		int n;
+
+		/* The range lasts to the representation end. */
+		if (!chunk->ptr && !isdigit(c)) {
+			rng->last = TFW_HTTP_RANGE_NONE;
+			++req->range_n;
+			__FSM_I_JMP(Req_I_Range_EoT);
+		}
+
+		n = parse_int_range(chunk, p, plen, &acc);
+		if (n < 0)
+			return n;
+		if (unlikely(acc < rng->first))
+			return CSTR_NEQ;
+		rng->last = acc;
+		++req->range_n;
+		__FSM_I_MOVE_n(Req_I_Range_EoT, n);
+	}
+
+	/* Suffix range of last @last bytes of the representation. */
+	__FSM_STATE(Req_I_Range_Suffix) {
+		unsigned int acc = 0;
+		size_t plen = len - (size_t)(p - data);
+		int n = parse_int_range(chunk, p, plen, &acc);
+		if (n < 0)
+			return n;
+		req->range[req->range_n].first = TFW_HTTP_RANGE_NONE;
+		req->range[req->range_n].last = acc;
+		++req->range_n;
+		__FSM_I_MOVE_n(Req_I_Range_EoT, n);
+	}
+
+	/* End of term. */
+	__FSM_STATE(Req_I_Range_EoT) {
+		if (IS_WS(c))
+			__FSM_I_MOVE(Req_I_Range_EoT);
+		if (c == ',')
+			__FSM_I_MOVE(Req_I_Range_Sep);
+		if (!isspace(c))
+			return CSTR_NEQ;
+		__FSM_I_JMP(Req_I_Range_EoL);
+	}
+
+	__FSM_STATE(Req_I_Range_Sep) {
+		if (IS_WS(c))
+			__FSM_I_MOVE(Req_I_Range_Sep);
+		__FSM_I_JMP(Req_I_Range_Spec);
+	}
+
+	/* Skip the ignored header value. */
+	__FSM_STATE(Req_I_Range_Ext) {
+		size_t plen = len - (size_t)(p - data);
+		unsigned char *lf = __data_chr(p, plen, '\n');
+		if (lf)
+			__FSM_I_MOVE_n(Req_I_Range_EoL, lf - p);
+		return CSTR_POSTPONE;
+	}
+
+	__FSM_STATE(Req_I_Range_EoL) {
+		if (!hlen_set) {
+			*lenrval = p - data; /* set header length */
+			hlen_set = true;
+		}
+		if (c == '\n') {
+			r = p - data + 1;
+			goto done;
+		}
+		if (isspace(c))
+			/* Eat all spaces including '\r'. */
+			__FSM_I_MOVE(Req_I_Range_EoL);
+		return CSTR_NEQ;
+	}
+
+	} /* FSM END */
+done:
+	parser->_i_st = Req_I_0;
+	return r;
+}
+
 int
 tfw_http_parse_req(TfwHttpReq *req, unsigned char *data, size_t len)
 {
@@ -1374,6 +1632,11 @@ tfw_http_parse_req(TfwHttpReq *req, unsigned char *data, size_t len)
 		case TFW_CHAR4_INT('P', 'O', 'S', 'T'):
 			req->method = TFW_HTTP_METH_POST;
 			__FSM_MOVE_n(Req_MUSpace, 4);
+		case TFW_CHAR4_INT('P', 'U', 'R', 'G'):
+			if (unlikely(*(p + 4) != 'E'))
+				return TFW_BLOCK;
+			req->method = TFW_HTTP_METH_PURGE;
+			__FSM_MOVE_n(Req_MUSpace, 5);
 		}
 
 		return TFW_BLOCK; /* Unsupported method */
@@ -1448,10 +1711,18 @@ tfw_http_parse_req(TfwHttpReq *req, unsigned char *data, size_t len)
 	 * as we should according to RFC 2616 (3.2.2) and RFC 7230 (2.7).
 	 */
 	__FSM_STATE(Req_UriAbsPath) {
-		if (likely(IN_ALPHABET(c, uap_a)))
+		if (likely(IN_ALPHABET(c, uap_a))) {
+#ifdef TFW_HTTP_NORMALIZATION
+			/* The normalization hook processes each character. */
+			size_t n = 1;
+#else
+			size_t n = __data_span(p, len - (size_t)(p - data),
+					       uap_a);
+#endif
 			/* Move forward through possibly segmented data. */
-			____FSM_MOVE_LAMBDA(TFW_HTTP_URI_HOOK, 1,
+			____FSM_MOVE_LAMBDA(TFW_HTTP_URI_HOOK, n,
 					    __FSM_EXIT(&req->uri_path));
+		}
 
 		if (likely(c == ' ')) {
 			__field_finish(&req->uri_path, data, p);
@@ -1537,6 +1808,15 @@ tfw_http_parse_req(TfwHttpReq *req, unsigned char *data, size_t len)
 				__FSM_MOVE_n(RGen_LWS, 5);
 			}
 			__FSM_MOVE(Req_HdrH);
+		case 'r':
+			if (likely(p + 6 <= data + len
+				   && LC(*(p + 1)) == 'a'
+				   && C4_INT_LCM(p + 2, 'n', 'g', 'e', ':')))
+			{
+				parser->_i_st = Req_HdrRangeV;
+				__FSM_MOVE_n(RGen_LWS, 6);
+			}
+			__FSM_MOVE(Req_HdrR);
 		case 't':
 			if (likely(p + 17 <= data + len
 				   && C8_INT_LCM(p, 't', 'r', 'a', 'n',
@@ -1638,6 +1918,10 @@ tfw_http_parse_req(TfwHttpReq *req, unsigned char *data, size_t len)
 				 Req_I_XFF, req, __req_parse_x_forwarded_for,
 				 TFW_HTTP_HDR_X_FORWARDED_FOR);
 
+	/* 'Range:*LWS' is read, process field-value. */
+	TFW_HTTP_PARSE_HDR_VAL(Req_HdrRangeV, Req_Hdr, Req_I_Range, req,
+			       __req_parse_range);
+
 	/*
 	 * Other (non interesting HTTP headers).
 	 * Note that some of them (like Cookie or User-Agent can be
@@ -1646,17 +1930,25 @@ tfw_http_parse_req(TfwHttpReq *req, unsigned char *data, size_t len)
 	__FSM_STATE(Req_HdrOther) {
 		/* Just eat the header until LF. */
 		size_t plen = len - (size_t)(p - data);
-		unsigned char *lf = memchr(p, '\n', plen);
+		unsigned char *lf = __data_chr(p, plen, '\n');
+		unsigned char *hs = TFW_STR_CURR(&parser->hdr)->ptr;
+		/*
+		 * The header starts before @p if we fell back here from
+		 * partially matched header name, or at @p for a header
+		 * continued in the next data chunk.
+		 */
+		if (!hs)
+			hs = TFW_STR_CURR(&parser->hdr)->ptr = p;
 		if (lf) {
 			/* Get length of the header. */
 			unsigned char *cr = lf - 1;
-			while (cr != p && *cr == '\r')
+			while (cr != hs && *cr == '\r')
 				--cr;
-			CLOSE_HEADER(req, TFW_HTTP_HDR_RAW, cr - p + 1);
+			CLOSE_HEADER(req, TFW_HTTP_HDR_RAW, cr - hs + 1);
 			p = lf; /* move to just after LF */
 			__FSM_MOVE(Req_Hdr);
 		}
-		STORE_HEADER(req, TFW_HTTP_HDR_RAW, plen);
+		STORE_HEADER(req, TFW_HTTP_HDR_RAW, data + len - hs);
 		__FSM_MOVE_n(Req_HdrOther, plen);
 	}
 
@@ -1746,6 +2038,13 @@ tfw_http_parse_req(TfwHttpReq *req, unsigned char *data, size_t len)
 	__FSM_TX_AF(Req_HdrHos, 't', Req_HdrHost, hdr_a, Req_HdrOther);
 	__FSM_TX_AF_LWS(Req_HdrHost, ':', Req_HdrHostV, hdr_a, Req_HdrOther);
 
+	/* Range header processing. */
+	__FSM_TX_AF(Req_HdrR, 'a', Req_HdrRa, hdr_a, Req_HdrOther);
+	__FSM_TX_AF(Req_HdrRa, 'n', Req_HdrRan, hdr_a, Req_HdrOther);
+	__FSM_TX_AF(Req_HdrRan, 'g', Req_HdrRang, hdr_a, Req_HdrOther);
+	__FSM_TX_AF(Req_HdrRang, 'e', Req_HdrRange, hdr_a, Req_HdrOther);
+	__FSM_TX_AF_LWS(Req_HdrRange, ':', Req_HdrRangeV, hdr_a, Req_HdrOther);
+
 	/* Transfer-Encoding header processing. */
 	__FSM_TX_AF(Req_HdrT, 'r', Req_HdrTr, hdr_a, Req_HdrOther);
 	__FSM_TX_AF(Req_HdrTr, 'a', Req_HdrTra, hdr_a, Req_HdrOther);
@@ -1869,7 +2168,7 @@ __resp_parse_cache_control(TfwHttpResp *resp, unsigned char *data, size_t *lenrv
 				__FSM_I_MOVE_str(Resp_I_EoT, "public");
 			});
 			TRY_STR_LAMBDA("private", {
-				resp->cache_ctl.flags |= TFW_HTTP_CC_PUBLIC;
+				resp->cache_ctl.flags |= TFW_HTTP_CC_PRIVATE;
 				__FSM_I_MOVE_str(Resp_I_EoT, "private");
 			});
 			TRY_STR_LAMBDA("proxy-revalidate", {
@@ -1893,6 +2192,7 @@ __resp_parse_cache_control(TfwHttpResp *resp, unsigned char *data, size_t *lenrv
 		if (n < 0)
 			return n;
 		resp->cache_ctl.max_age = acc;
+		resp->cache_ctl.flags |= TFW_HTTP_CC_MAX_AGE;
 		__FSM_I_MOVE_n(Resp_I_EoT, n);
 	}
 
@@ -1903,24 +2203,21 @@ __resp_parse_cache_control(TfwHttpResp *resp, unsigned char *data, size_t *lenrv
 		if (n < 0)
 			return n;
 		resp->cache_ctl.s_maxage = acc;
+		resp->cache_ctl.flags |= TFW_HTTP_CC_S_MAXAGE;
 		__FSM_I_MOVE_n(Resp_I_EoT, n);
 	}
 
 	__FSM_STATE(Resp_I_Ext) {
 		/*
 		 * TODO
-		 * - process cache extensions;
-		 * - replace double memchr() below by a strspn() analog
-		 *   that accepts string length instead of processing
-		 *   null-terminated strings.
+		 * - process cache extensions.
 		 */
 		size_t plen = len - (size_t)(p - data);
-		unsigned char *lf = memchr(p, '\n', plen);
-		unsigned char *comma = memchr(p, ',', plen);
-		if (comma && (!lf || (lf && (comma < lf))))
-			__FSM_I_MOVE_n(Resp_I_EoT, comma - p);
-		if (lf)
-			__FSM_I_MOVE_n(Resp_I_EoL, lf - p);
+		unsigned char *d = __data_chr2(p, plen, '\n', ',');
+		if (d && *d == ',')
+			__FSM_I_MOVE_n(Resp_I_EoT, d - p);
+		if (d)
+			__FSM_I_MOVE_n(Resp_I_EoL, d - p);
 		return CSTR_POSTPONE;
 	}
 
@@ -1935,8 +2232,9 @@ __resp_parse_cache_control(TfwHttpResp *resp, unsigned char *data, size_t *lenrv
 		 */
 		if (c == '=')
 			__FSM_I_MOVE(Resp_I_Ext);
+		/* Next directive starts at current character. */
 		if (IN_ALPHABET(c, hdr_a))
-			__FSM_I_MOVE(Resp_I_CC);
+			__FSM_I_JMP(Resp_I_CC);
 		if (!isspace(c))
 			return CSTR_NEQ;
 		/* fall through */
@@ -1985,16 +2283,23 @@ done:
 #define SB_OCT		(SB_SEP + 30 * SEC24H)
 #define SB_NOV		(SB_OCT + 31 * SEC24H)
 #define SB_DEC		(SB_NOV + 30 * SEC24H)
-/* Number of days befor epoch including leap years. */
-#define EPOCH_DAYS	(1970 * 365 + 1970 / 4 - 1970 / 100 + 1970 / 400)
+/* Number of days before epoch including leap years. */
+#define EPOCH_DAYS	(1970 * 365 + 1969 / 4 - 1969 / 100 + 1969 / 400)
 
-static int
-__year_day_secs(unsigned int year, unsigned int day_sec)
+/*
+ * @past_feb tells whether the month of the date is after February: Feb 29
+ * and Mar 1 have the same @day_sec, so the month can't be inferred from it.
+ */
+static long
+__year_day_secs(unsigned int year, unsigned int day_sec, bool past_feb)
 {
-	unsigned int days = year * 365 + year / 4 - year / 100 + year / 400;
+	/* Days before the year, leap days are counted for previous years. */
+	unsigned long days = (unsigned long)year * 365 + (year - 1) / 4
+			     - (year - 1) / 100 + (year - 1) / 400;
 
 	/* Add SEC24H if the year is leap and we left Feb behind. */
-	if (year % 4 == 0 && !(year % 100 == 0 && year % 400 != 0))
+	if (year % 4 == 0 && !(year % 100 == 0 && year % 400 != 0)
+	    && past_feb)
 		day_sec += SEC24H;
 
 	if (days < EPOCH_DAYS)
@@ -2023,7 +2328,7 @@ __resp_parse_expires(TfwHttpResp *resp, unsigned char *data, size_t *lenrval)
 	__FSM_STATE(Resp_I_Expires) {
 		/* Skip a weekday as redundant information. */
 		size_t plen = len - (size_t)(p - data);
-		unsigned char *sp = memchr(p, ' ', plen);
+		unsigned char *sp = __data_chr(p, plen, ' ');
 		if (sp)
 			__FSM_I_MOVE_n(Resp_I_ExpDate, sp - p + 1);
 		return CSTR_POSTPONE;
@@ -2044,6 +2349,7 @@ __resp_parse_expires(TfwHttpResp *resp, unsigned char *data, size_t *lenrval)
 			return CSTR_BADLEN;
 		/* Add seconds in full passed days. */
 		resp->expires = (acc - 1) * SEC24H;
+		parser->flags &= ~TFW_HTTP_PF_PAST_FEB;
 		/* Skip a day and a following SP. */
 		__FSM_I_MOVE_n(Resp_I_ExpMonth, 3);
 	}
@@ -2053,10 +2359,12 @@ __resp_parse_expires(TfwHttpResp *resp, unsigned char *data, size_t *lenrval)
 		case 'A':
 			TRY_STR_LAMBDA("Apr", {
 				resp->expires += SB_APR;
+				parser->flags |= TFW_HTTP_PF_PAST_FEB;
 				__FSM_I_MOVE_n(Resp_I_ExpYearSP, 3);
 			});
 			TRY_STR_LAMBDA("Aug", {
 				resp->expires += SB_AUG;
+				parser->flags |= TFW_HTTP_PF_PAST_FEB;
 				__FSM_I_MOVE_n(Resp_I_ExpYearSP, 3);
 			});
 			return CSTR_NEQ;
@@ -2066,21 +2374,24 @@ __resp_parse_expires(TfwHttpResp *resp, unsigned char *data, size_t *lenrval)
 			});
 			TRY_STR_LAMBDA("Jun", {
 				resp->expires += SB_JUN;
+				parser->flags |= TFW_HTTP_PF_PAST_FEB;
 				__FSM_I_MOVE_n(Resp_I_ExpYearSP, 3);
 			});
 			TRY_STR_LAMBDA("Jul", {
 				resp->expires += SB_JUL;
+				parser->flags |= TFW_HTTP_PF_PAST_FEB;
 				__FSM_I_MOVE_n(Resp_I_ExpYearSP, 3);
 			});
 			return CSTR_NEQ;
 		case 'M':
 			TRY_STR_LAMBDA("Mar", {
-				/* Add SEC24H for leap year on year parsing. */
 				resp->expires += SB_MAR;
+				parser->flags |= TFW_HTTP_PF_PAST_FEB;
 				__FSM_I_MOVE_n(Resp_I_ExpYearSP, 3);
 			});
 			TRY_STR_LAMBDA("May", {
 				resp->expires += SB_MAY;
+				parser->flags |= TFW_HTTP_PF_PAST_FEB;
 				__FSM_I_MOVE_n(Resp_I_ExpYearSP, 3);
 			});
 			return CSTR_NEQ;
@@ -2091,18 +2402,22 @@ __resp_parse_expires(TfwHttpResp *resp, unsigned char *data, size_t *lenrval)
 			});
 			TRY_STR_LAMBDA("Sep", {
 				resp->expires += SB_SEP;
+				parser->flags |= TFW_HTTP_PF_PAST_FEB;
 				__FSM_I_MOVE_n(Resp_I_ExpYearSP, 3);
 			});
 			TRY_STR_LAMBDA("Oct", {
 				resp->expires += SB_OCT;
+				parser->flags |= TFW_HTTP_PF_PAST_FEB;
 				__FSM_I_MOVE_n(Resp_I_ExpYearSP, 3);
 			});
 			TRY_STR_LAMBDA("Nov", {
 				resp->expires += SB_NOV;
+				parser->flags |= TFW_HTTP_PF_PAST_FEB;
 				__FSM_I_MOVE_n(Resp_I_ExpYearSP, 3);
 			});
 			TRY_STR_LAMBDA("Dec", {
 				resp->expires += SB_DEC;
+				parser->flags |= TFW_HTTP_PF_PAST_FEB;
 				__FSM_I_MOVE_n(Resp_I_ExpYearSP, 3);
 			});
 			return CSTR_NEQ;
@@ -2118,6 +2433,7 @@ __resp_parse_expires(TfwHttpResp *resp, unsigned char *data, size_t *lenrval)
 
 	/* 4-digit year. */
 	__FSM_STATE(Resp_I_ExpYear) {
+		long secs;
 		unsigned int year = 0;
 		size_t plen = len - (size_t)(p - data);
 		int n = parse_int_ws(chunk, p, plen, &year);
@@ -2125,10 +2441,11 @@ __resp_parse_expires(TfwHttpResp *resp, unsigned char *data, size_t *lenrval)
 			return n;
 		else if (n != 4)
 			return CSTR_BADLEN;
-		n = __year_day_secs(year, resp->expires);
-		if (n < 0)
+		secs = __year_day_secs(year, resp->expires,
+				       parser->flags & TFW_HTTP_PF_PAST_FEB);
+		if (secs < 0 || secs > UINT_MAX)
 			return CSTR_NEQ;
-		resp->expires = n;
+		resp->expires = secs;
 		/* Skip a year and a following SP. */
 		__FSM_I_MOVE_n(Resp_I_ExpHour, 5);
 	}
@@ -2141,7 +2458,7 @@ __resp_parse_expires(TfwHttpResp *resp, unsigned char *data, size_t *lenrval)
 			return n;
 		else if (n != 2)
 			return CSTR_BADLEN;
-		resp->expires = t * 3600;
+		resp->expires += t * 3600;
 		/* Skip an hour and a following ':'. */
 		__FSM_I_MOVE_n(Resp_I_ExpMin, 3);
 	}
@@ -2154,7 +2471,7 @@ __resp_parse_expires(TfwHttpResp *resp, unsigned char *data, size_t *lenrval)
 			return n;
 		else if (n != 2)
 			return CSTR_BADLEN;
-		resp->expires = t * 60;
+		resp->expires += t * 60;
 		/* Skip minutes and a following ':'. */
 		__FSM_I_MOVE_n(Resp_I_ExpSec, 3);
 	}
@@ -2167,7 +2484,7 @@ __resp_parse_expires(TfwHttpResp *resp, unsigned char *data, size_t *lenrval)
 			return n;
 		else if (n != 2)
 			return CSTR_BADLEN;
-		resp->expires = t;
+		resp->expires += t;
 		/* Skip seconds and a following ' GMT'. */
 		__FSM_I_MOVE_n(Resp_I_EoL, 6);
 	}
@@ -2231,12 +2548,11 @@ __resp_parse_keep_alive(TfwHttpResp *resp, unsigned char *data, size_t *lenrval)
 	 */
 	__FSM_STATE(Resp_I_Ext) {
 		size_t plen = len - (size_t)(p - data);
-		unsigned char *lf = memchr(p, '\n', plen);
-		unsigned char *comma = memchr(p, ',', plen);
-		if (comma && (!lf || (lf && (comma < lf))))
-			__FSM_I_MOVE_n(Resp_I_EoT, comma - p);
-		if (lf)
-			__FSM_I_MOVE_n(Resp_I_EoL, lf - p);
+		unsigned char *d = __data_chr2(p, plen, '\n', ',');
+		if (d && *d == ',')
+			__FSM_I_MOVE_n(Resp_I_EoT, d - p);
+		if (d)
+			__FSM_I_MOVE_n(Resp_I_EoL, d - p);
 		return CSTR_POSTPONE;
 	}
 
@@ -2437,7 +2753,7 @@ tfw_http_parse_resp(TfwHttpResp *resp, unsigned char *data, size_t len)
 	/* Reason-Phrase: just skip. */
 	__FSM_STATE(Resp_ReasonPhrase) {
 		size_t plen = len - (size_t)(p - data);
-		unsigned char *lf = memchr(p, '\n', plen);
+		unsigned char *lf = __data_chr(p, plen, '\n');
 		if (lf)
 			__FSM_MOVE_n(Resp_Hdr, lf - p + 1);
 		__FSM_MOVE_n(Resp_ReasonPhrase, plen);
@@ -2586,11 +2902,30 @@ tfw_http_parse_resp(TfwHttpResp *resp, unsigned char *data, size_t len)
 	 * can be extremely large.
 	 */
 	__FSM_STATE(Resp_HdrOther) {
-		/* Just eat the header including LF. */
+		/*
+		 * Eat the header until LF. The header is stored since
+		 * the cache uses validators and other response headers.
+		 */
 		size_t plen = len - (size_t)(p - data);
-		unsigned char *lf = memchr(p, '\n', plen);
-		if (lf)
-			__FSM_MOVE_n(Resp_Hdr, lf - p + 1);
+		unsigned char *lf = __data_chr(p, plen, '\n');
+		unsigned char *hs = TFW_STR_CURR(&parser->hdr)->ptr;
+		/*
+		 * The header starts before @p if we fell back here from
+		 * partially matched header name, or at @p for a header
+		 * continued in the next data chunk.
+		 */
+		if (!hs)
+			hs = TFW_STR_CURR(&parser->hdr)->ptr = p;
+		if (lf) {
+			/* Get length of the header. */
+			unsigned char *cr = lf - 1;
+			while (cr != hs && *cr == '\r')
+				--cr;
+			CLOSE_HEADER(resp, TFW_HTTP_HDR_RAW, cr - hs + 1);
+			p = lf; /* move to just after LF */
+			__FSM_MOVE(Resp_Hdr);
+		}
+		STORE_HEADER(resp, TFW_HTTP_HDR_RAW, data + len - hs);
 		__FSM_MOVE_n(Resp_HdrOther, plen);
 	}
 
@@ -2720,3 +3055,4 @@ tfw_http_parse_resp(TfwHttpResp *resp, unsigned char *data, size_t len)
 
 	return r;
 }
+DEBUG_EXPORT_SYMBOL(tfw_http_parse_resp);
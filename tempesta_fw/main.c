@@ -83,6 +83,7 @@ tfw_init(void)
 	DO_INIT(client);
 	DO_INIT(connection);
 
+	DO_CFG_REG(http);
 	DO_CFG_REG(cache);
 	DO_CFG_REG(sock_server);
 	DO_CFG_REG(sock_client);
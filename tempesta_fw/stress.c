@@ -21,6 +21,7 @@
 * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 */
 #include "tempesta_fw.h"
+#include "cache.h"
 #include "classifier.h"
 #include "stress.h"
 
@@ -50,8 +51,10 @@ tfw_stress_account_sys(void)
 	read_lock(&tfw_stress_lock);
 	list_for_each_entry(s, &stress_handlers, st_list) {
 		if (s->type & TfwStress_Sys)
-			if (s->account_sys())
+			if (s->account_sys()) {
 				tfw_classify_shrink();
+				tfw_cache_shrink();
+			}
 	}
 	read_unlock(&tfw_stress_lock);
 }
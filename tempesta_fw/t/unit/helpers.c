@@ -58,3 +58,22 @@ test_req_free(TfwHttpReq *req)
 
 	tfw_http_msg_free((TfwHttpMsg *)req);
 }
+
+TfwHttpResp *
+test_resp_alloc(void)
+{
+	TfwHttpResp *resp;
+
+	resp = (TfwHttpResp *)tfw_http_msg_alloc(Conn_HttpSrv);
+	BUG_ON(!resp);
+
+	return resp;
+}
+
+void
+test_resp_free(TfwHttpResp *resp)
+{
+	BUG_ON(!resp);
+
+	tfw_http_msg_free((TfwHttpMsg *)resp);
+}
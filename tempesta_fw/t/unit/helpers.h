@@ -24,5 +24,7 @@
  * involving complicated stuff like sk_buff manipulations. */
 TfwHttpReq *test_req_alloc(void);
 void test_req_free(TfwHttpReq *req);
+TfwHttpResp *test_resp_alloc(void);
+void test_resp_free(TfwHttpResp *resp);
 
 #endif /* __TFW_TEST_HELPER_H__ */
@@ -66,6 +66,7 @@ TEST_SUITE(http_match);
 TEST_SUITE(hash);
 TEST_SUITE(addr);
 TEST_SUITE(cfg);
+TEST_SUITE(cache);
 
 int
 test_run_all(void)
@@ -78,6 +79,7 @@ test_run_all(void)
 	TEST_SUITE_RUN(hash);
 	TEST_SUITE_RUN(addr);
 	TEST_SUITE_RUN(cfg);
+	TEST_SUITE_RUN(cache);
 
 	return test_fail_counter;
 }
@@ -0,0 +1,282 @@
+/**
+ *		Tempesta FW
+ *
+ * Copyright (C) 2015 Tempesta Technologies, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+#include <linux/slab.h>
+
+#include "cache.h"
+#include "http_msg.h"
+
+#include "test.h"
+#include "helpers.h"
+
+static TfwHttpReq *c_req;
+static TfwHttpResp *c_resp;
+
+static void
+cache_suite_setup(void)
+{
+	c_req = test_req_alloc();
+	c_resp = test_resp_alloc();
+	c_req->method = TFW_HTTP_METH_GET;
+	c_resp->status = 200;
+}
+
+static void
+cache_suite_teardown(void)
+{
+	test_req_free(c_req);
+	test_resp_free(c_resp);
+	c_req = NULL;
+	c_resp = NULL;
+}
+
+TEST(cache, calcs_freshness_lifetime)
+{
+	unsigned long now = 1000000;
+	TfwCacheControl *cc = &c_resp->cache_ctl;
+
+	cc->flags = TFW_HTTP_CC_MAX_AGE | TFW_HTTP_CC_S_MAXAGE;
+	cc->max_age = 60;
+	cc->s_maxage = 30;
+	EXPECT_EQ(tfw_cache_lifetime(c_resp, now), 30);
+
+	/* max-age overrides Expires. */
+	cc->flags = TFW_HTTP_CC_MAX_AGE;
+	c_resp->expires = now + 100;
+	EXPECT_EQ(tfw_cache_lifetime(c_resp, now), 60);
+
+	cc->flags = 0;
+	EXPECT_EQ(tfw_cache_lifetime(c_resp, now), 100);
+
+	c_resp->expires = now - 100;
+	EXPECT_EQ(tfw_cache_lifetime(c_resp, now), 0);
+}
+
+TEST(cache, stores_cacheable_responses_only)
+{
+	unsigned char crlf[] = "\r\n";
+
+	EXPECT_FALSE(tfw_cache_storable(c_req, c_resp));
+
+	/* The response is stored when its headers are fully read. */
+	c_resp->crlf = crlf;
+	EXPECT_TRUE(tfw_cache_storable(c_req, c_resp));
+
+	c_req->cache_ctl.flags = TFW_HTTP_CC_NO_STORE;
+	EXPECT_FALSE(tfw_cache_storable(c_req, c_resp));
+	c_req->cache_ctl.flags = 0;
+
+	c_resp->cache_ctl.flags = TFW_HTTP_CC_PRIVATE;
+	EXPECT_FALSE(tfw_cache_storable(c_req, c_resp));
+	c_resp->cache_ctl.flags = TFW_HTTP_CC_NO_CACHE;
+	EXPECT_FALSE(tfw_cache_storable(c_req, c_resp));
+	c_resp->cache_ctl.flags = 0;
+
+	c_resp->status = 206;
+	EXPECT_FALSE(tfw_cache_storable(c_req, c_resp));
+	c_resp->status = 200;
+
+	c_req->method = TFW_HTTP_METH_POST;
+	EXPECT_FALSE(tfw_cache_storable(c_req, c_resp));
+}
+
+TEST(cache, checks_request_freshness_directives)
+{
+	TfwCacheEntry ce = { .lifetime = 60 };
+	TfwCacheControl *cc = &c_req->cache_ctl;
+
+	EXPECT_TRUE(tfw_cache_entry_acceptable(&ce, c_req, 20));
+
+	cc->flags = TFW_HTTP_CC_MAX_AGE;
+	cc->max_age = 10;
+	EXPECT_FALSE(tfw_cache_entry_acceptable(&ce, c_req, 20));
+	EXPECT_TRUE(tfw_cache_entry_acceptable(&ce, c_req, 5));
+
+	cc->flags = TFW_HTTP_CC_MIN_FRESH;
+	cc->max_fresh = 50;
+	EXPECT_FALSE(tfw_cache_entry_acceptable(&ce, c_req, 20));
+	EXPECT_TRUE(tfw_cache_entry_acceptable(&ce, c_req, 5));
+
+	cc->flags = TFW_HTTP_CC_NO_CACHE;
+	EXPECT_FALSE(tfw_cache_entry_acceptable(&ce, c_req, 0));
+}
+
+TEST(cache, resolves_byte_ranges)
+{
+	TfwCacheEntry ce = { .body_len = 1000 };
+	TfwHttpRange rng[TFW_HTTP_RANGES_MAX];
+	const TfwHttpRange r[] = {
+		{ 0, 499 },
+		{ 900, TFW_HTTP_RANGE_NONE },
+		{ TFW_HTTP_RANGE_NONE, 200 },
+		/* Unsatisfiable ranges are skipped. */
+		{ 1000, TFW_HTTP_RANGE_NONE },
+		{ TFW_HTTP_RANGE_NONE, 0 },
+		/* Suffix longer than the body selects the whole body. */
+		{ TFW_HTTP_RANGE_NONE, 2000 },
+		{ 100, 5000 },
+	};
+
+	memcpy(c_req->range, r, sizeof(r));
+	c_req->range_n = ARRAY_SIZE(r);
+
+	EXPECT_EQ(tfw_cache_ranges(&ce, c_req, rng), 5);
+	EXPECT_EQ(rng[0].first, 0);
+	EXPECT_EQ(rng[0].last, 499);
+	EXPECT_EQ(rng[1].first, 900);
+	EXPECT_EQ(rng[1].last, 999);
+	EXPECT_EQ(rng[2].first, 800);
+	EXPECT_EQ(rng[2].last, 999);
+	EXPECT_EQ(rng[3].first, 0);
+	EXPECT_EQ(rng[3].last, 999);
+	EXPECT_EQ(rng[4].first, 100);
+	EXPECT_EQ(rng[4].last, 999);
+
+	ce.body_len = 0;
+	EXPECT_EQ(tfw_cache_ranges(&ce, c_req, rng), 0);
+}
+
+/*
+ * The keys use different counters in each row of the sketch, so their
+ * estimations are exact.
+ */
+#define KEY_HOT		0x001001001001UL
+#define KEY_COLD	0x002002002002UL
+#define KEY_FILL	0x003003003003UL
+
+TEST(cache, estimates_request_frequency)
+{
+	int i;
+	TfwCacheSketch *sk = kzalloc(sizeof(*sk), GFP_KERNEL);
+
+	BUG_ON(!sk);
+
+	for (i = 0; i < 5; ++i)
+		tfw_cache_sketch_inc(sk, KEY_HOT);
+	tfw_cache_sketch_inc(sk, KEY_COLD);
+
+	EXPECT_EQ(tfw_cache_sketch_estimate(sk, KEY_HOT), 5);
+	EXPECT_EQ(tfw_cache_sketch_estimate(sk, KEY_COLD), 1);
+	EXPECT_EQ(tfw_cache_sketch_estimate(sk, KEY_FILL), 0);
+	/* One-hit-wonder doesn't replace the hot entry. */
+	EXPECT_LT(tfw_cache_sketch_estimate(sk, KEY_COLD),
+		  tfw_cache_sketch_estimate(sk, KEY_HOT));
+
+	/* The counters saturate. */
+	for (i = 0; i < 2 * TFW_CACHE_SKETCH_MAX; ++i)
+		tfw_cache_sketch_inc(sk, KEY_HOT);
+	EXPECT_EQ(tfw_cache_sketch_estimate(sk, KEY_HOT),
+		  TFW_CACHE_SKETCH_MAX);
+
+	kfree(sk);
+}
+
+TEST(cache, ages_request_frequency)
+{
+	int i;
+	TfwCacheSketch *sk = kzalloc(sizeof(*sk), GFP_KERNEL);
+
+	BUG_ON(!sk);
+
+	for (i = 0; i < 8; ++i)
+		tfw_cache_sketch_inc(sk, KEY_HOT);
+	for ( ; i < TFW_CACHE_SKETCH_RESET - 1; ++i)
+		tfw_cache_sketch_inc(sk, KEY_FILL);
+	EXPECT_EQ(tfw_cache_sketch_estimate(sk, KEY_HOT), 8);
+
+	/* All the counters are halved on the last sample of the period. */
+	tfw_cache_sketch_inc(sk, KEY_COLD);
+	EXPECT_EQ(sk->samples, 0);
+	EXPECT_EQ(tfw_cache_sketch_estimate(sk, KEY_HOT), 4);
+	EXPECT_EQ(tfw_cache_sketch_estimate(sk, KEY_COLD), 0);
+	EXPECT_EQ(tfw_cache_sketch_estimate(sk, KEY_FILL),
+		  TFW_CACHE_SKETCH_MAX / 2);
+
+	kfree(sk);
+}
+
+/*
+ * Templates w/o responses linked with entries w/o TDB records.
+ * The LRU list is manipulated w/o the lock, so the tests must be run
+ * before the cache starts.
+ */
+static TfwCacheTmpl *
+test_lru_tmpl(TfwCacheEntry *ce, unsigned long key)
+{
+	TfwCacheTmpl *t = kzalloc(sizeof(*t), GFP_KERNEL);
+
+	BUG_ON(!t);
+	atomic_set(&t->refcnt, 1);
+	t->ce.trec.key = key;
+	__tfw_cache_tmpl_link(ce, t);
+
+	return t;
+}
+
+TEST(cache, evicts_least_recently_used)
+{
+	unsigned long key = 0;
+	TfwCacheEntry ce[3];
+	TfwCacheTmpl *t;
+
+	memset(ce, 0, sizeof(ce));
+	tfw_cache_shrink_lru(ULONG_MAX);
+	EXPECT_FALSE(tfw_cache_lru_victim(&key));
+
+	t = test_lru_tmpl(&ce[0], 1);
+	test_lru_tmpl(&ce[1], 2);
+	test_lru_tmpl(&ce[2], 3);
+	EXPECT_TRUE(tfw_cache_lru_victim(&key));
+	EXPECT_EQ(key, 1);
+
+	/* Just linked template isn't moved again. */
+	tfw_cache_lru_touch(t);
+	EXPECT_TRUE(tfw_cache_lru_victim(&key));
+	EXPECT_EQ(key, 1);
+
+	t->lru_touch = jiffies - 10 * HZ;
+	tfw_cache_lru_touch(t);
+	EXPECT_TRUE(tfw_cache_lru_victim(&key));
+	EXPECT_EQ(key, 2);
+
+	EXPECT_EQ(tfw_cache_shrink_lru(1), 1);
+	EXPECT_NULL(ce[1].tmpl);
+	EXPECT_NOT_NULL(ce[0].tmpl);
+	EXPECT_TRUE(tfw_cache_lru_victim(&key));
+	EXPECT_EQ(key, 3);
+
+	EXPECT_EQ(tfw_cache_shrink_lru(ULONG_MAX), 2);
+	EXPECT_NULL(ce[0].tmpl);
+	EXPECT_NULL(ce[2].tmpl);
+	EXPECT_FALSE(tfw_cache_lru_victim(&key));
+}
+
+TEST_SUITE(cache)
+{
+	TEST_SETUP(cache_suite_setup);
+	TEST_TEARDOWN(cache_suite_teardown);
+
+	TEST_RUN(cache, calcs_freshness_lifetime);
+	TEST_RUN(cache, stores_cacheable_responses_only);
+	TEST_RUN(cache, checks_request_freshness_directives);
+	TEST_RUN(cache, resolves_byte_ranges);
+	TEST_RUN(cache, estimates_request_frequency);
+	TEST_RUN(cache, ages_request_frequency);
+	TEST_RUN(cache, evicts_least_recently_used);
+}
@@ -188,6 +188,19 @@ TEST(tfw_hash_str, distributes_all_input_across_hash_bits)
 	}
 }
 
+TEST(tfw_hash_chr, calcs_same_hash_as_hash_str)
+{
+	int i;
+	unsigned long crc = TFW_HASH_INIT;
+	const char *p = "Host: example.com";
+	TfwStr s = { .len = 17, .ptr = (void *)p };
+
+	for (i = 0; i < s.len; ++i)
+		crc = tfw_hash_chr(crc, p[i]);
+
+	EXPECT_EQ(crc, tfw_hash_str(&s));
+}
+
 TEST_SUITE(hash)
 {
 	TEST_RUN(tfw_hash_str, calcs_diff_hash_for_diff_str);
@@ -195,4 +208,5 @@ TEST_SUITE(hash)
 	TEST_RUN(tfw_hash_str, hashes_all_chars);
 	TEST_RUN(tfw_hash_str, doesnt_read_behind_end_of_buf);
 	TEST_RUN(tfw_hash_str, distributes_all_input_across_hash_bits);
+	TEST_RUN(tfw_hash_chr, calcs_same_hash_as_hash_str);
 }